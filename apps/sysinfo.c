@@ -2,6 +2,11 @@
 #include "desktop.h"
 #include "graphics.h"
 #include "string.h"
+#include "scheduler.h"
+#include "sched_trace.h"
+#include "spinlock.h"
+#include "clock.h"
+#include "ipc.h"
 
 extern volatile uint64 g_timer_ticks;
 
@@ -73,7 +78,41 @@ void sysinfo_draw(window_t* win) {
     draw_text((uint32)content.x + 48, (uint32)content.y + 90, "Running", COLOR_GREEN);
     draw_progress_bar((uint32)content.x + 4, (uint32)content.y + 108, 100, ticks32 % 100, COLOR_GREEN);
 
-    draw_text((uint32)content.x + 4, (uint32)content.y + 124, "R refreshes", COLOR_DARK_GRAY);
+    // Scheduler: switches, wake latency and the task using the most CPU
+    sched_stats_t sched;
+    scheduler_get_stats(&sched);
+    draw_text((uint32)content.x + 4, (uint32)content.y + 120, "Switches:", COLOR_BLACK);
+    uint_to_str(sched.context_switches, num);
+    draw_text((uint32)content.x + 76, (uint32)content.y + 120, num, COLOR_BLUE);
+
+    draw_text((uint32)content.x + 4, (uint32)content.y + 131, "Wake us:", COLOR_BLACK);
+    uint_to_str(sched.wake_latency_avg / 1000, num);
+    draw_text((uint32)content.x + 76, (uint32)content.y + 131, num, COLOR_BLUE);
+    uint_to_str(sched.wake_latency_max / 1000, num);
+    draw_text((uint32)content.x + 124, (uint32)content.y + 131, num, COLOR_RED);
+
+    static sched_task_stats_t tasks[SCHED_MAX_TASKS];
+    uint32 count = scheduler_get_task_stats(tasks, SCHED_MAX_TASKS);
+    sched_task_stats_t* top = NULL;
+    for (uint32 i = 0; i < count; i++) {
+        if (!top || tasks[i].cpu_ns > top->cpu_ns) {
+            top = &tasks[i];
+        }
+    }
+    draw_text((uint32)content.x + 4, (uint32)content.y + 142, "Top task:", COLOR_BLACK);
+    if (top) {
+        uint_to_str(top->task_id, num);
+        draw_text((uint32)content.x + 76, (uint32)content.y + 142, num, COLOR_BLUE);
+        uint_to_str(clock_ns_to_ms(top->cpu_ns), num);
+        draw_text((uint32)content.x + 100, (uint32)content.y + 142, num, COLOR_BLUE);
+        draw_text((uint32)content.x + 148, (uint32)content.y + 142, "ms", COLOR_BLACK);
+    }
+
+    draw_text((uint32)content.x + 4, (uint32)content.y + 153, "Trace:", COLOR_BLACK);
+    uint_to_str(sched_trace_count(), num);
+    draw_text((uint32)content.x + 76, (uint32)content.y + 153, num, COLOR_BLUE);
+
+    draw_text((uint32)content.x + 4, (uint32)content.y + 166, "R refresh T trace I IPC", COLOR_DARK_GRAY);
     state->update_counter++;
 }
 
@@ -81,6 +120,16 @@ void sysinfo_handle_key(window_t* win, char key) {
     if ((key == 'r' || key == 'R') && win && win->draw_content) {
         win->draw_content(win);
     }
+    // Trace, per-task accounting and lock contention go to the serial port
+    if (key == 't' || key == 'T') {
+        sched_trace_dump();
+        scheduler_dump();
+        lock_stats_dump();
+    }
+    // IPC throughput, reported on the serial port when the tasks finish
+    if (key == 'i' || key == 'I') {
+        ipc_bench_start();
+    }
 }
 
 void sysinfo_handle_mouse(window_t* win, sint32 local_x, sint32 local_y, uint8 buttons) {
@@ -92,13 +141,13 @@ void sysinfo_handle_mouse(window_t* win, sint32 local_x, sint32 local_y, uint8 b
 }
 
 window_t* sysinfo_create(void) {
-    window_t* win = desktop_create_window("System Info", 44, 18, 220, 146);
+    window_t* win = desktop_create_window("System Info", 44, 4, 220, 190);
     if (!win) {
         return NULL;
     }
 
     win->min_width = 190;
-    win->min_height = 126;
+    win->min_height = 180;
     win->draw_content = sysinfo_draw;
     win->handle_key = sysinfo_handle_key;
     win->handle_mouse = sysinfo_handle_mouse;
@@ -0,0 +1,81 @@
+; Application processor start-up
+;
+; smp_trampoline_start..smp_trampoline_end is copied to SMP_TRAMPOLINE_ADDR
+; and entered in real mode by the SIPI (CS = address >> 4, IP = 0). It only
+; switches to protected mode with a flat GDT; ap_start32 runs from the
+; kernel image, turns on paging with the kernel directory and calls
+; smp_ap_main on a boot stack prepared by smp_init.
+
+%define SMP_TRAMPOLINE_ADDR 0x8000
+%define SMP_MAX_CPUS        8
+%define CR4_PSE_PGE         0x90
+%define CR0_PG_WP           0x80010000
+
+section .text
+    extern smp_ap_main
+    extern smp_ap_cr3
+    extern smp_ap_next
+    extern smp_ap_stacks
+    global smp_trampoline_start
+    global smp_trampoline_end
+
+[bits 16]
+align 16
+smp_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    o32 lgdt [tramp_gdt_ptr - smp_trampoline_start]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:ap_start32
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF   ; Flat code, same selector as the kernel's
+    dq 0x00CF92000000FFFF   ; Flat data
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd SMP_TRAMPOLINE_ADDR + (tramp_gdt - smp_trampoline_start)
+smp_trampoline_end:
+
+[bits 32]
+ap_start32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Same paging setup as paging_enable()
+    mov eax, cr4
+    or eax, CR4_PSE_PGE
+    mov cr4, eax
+    mov eax, [smp_ap_cr3]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, CR0_PG_WP
+    mov cr0, eax
+
+    ; APs wake together: claim a CPU number, then its stack
+    mov eax, 1
+    lock xadd [smp_ap_next], eax
+    cmp eax, SMP_MAX_CPUS
+    jae .park
+    mov esp, [smp_ap_stacks + eax * 4]
+    test esp, esp
+    jz .park
+
+    push eax
+    call smp_ap_main
+
+    ; More CPUs than supported, no stack, or smp_ap_main returned
+.park:
+    cli
+    hlt
+    jmp .park
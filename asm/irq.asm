@@ -1,6 +1,10 @@
 section .text
     extern isr_irq_handler
     extern task_scheduler_tick
+    extern task_ap_tick
+    extern task_switch_now
+    extern task_switch_done
+    extern vmm_tlb_shootdown_ipi
 
 irq_handler:
     pusha
@@ -52,6 +56,7 @@ irq_0_with_task_switch:
     push esp
     call task_scheduler_tick
     mov esp, eax        ; Switch to returned ESP (may be same or different task)
+    call task_switch_done ; Off the old stack: it may now run elsewhere
 
     ; Restore registers from (potentially new) stack
     pop ebx
@@ -66,6 +71,102 @@ irq_0_with_task_switch:
     sti
     iret
 
+; Local APIC timer of an AP: same frame and switch as IRQ0
+global lapic_timer_with_task_switch
+lapic_timer_with_task_switch:
+    cli
+    push byte 0         ; Error code
+    push dword 0xF0     ; Interrupt number (LAPIC_TIMER_VECTOR)
+
+    pusha
+    mov ax, ds
+    push eax
+
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    push esp
+    call task_ap_tick
+    mov esp, eax
+    call task_switch_done
+
+    pop ebx
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+
+    popa
+    add esp, 0x8
+
+    sti
+    iret
+
+; Switch requested by the running task (task_switch): same frame, no tick
+global task_switch_int
+task_switch_int:
+    cli
+    push byte 0
+    push dword 0x81     ; Interrupt number (TASK_SWITCH_VECTOR)
+
+    pusha
+    mov ax, ds
+    push eax
+
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    push esp
+    call task_switch_now
+    mov esp, eax
+    call task_switch_done
+
+    pop ebx
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+
+    popa
+    add esp, 0x8
+
+    iret                ; Keeps the caller's interrupt flag
+
+; TLB shootdown from another CPU (vmm_tlb_shootdown)
+global lapic_tlb_shootdown
+lapic_tlb_shootdown:
+    pusha
+    mov ax, ds
+    push eax
+
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    call vmm_tlb_shootdown_ipi
+
+    pop ebx
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+
+    popa
+    iret
+
+; Spurious local APIC interrupt: no EOI
+global lapic_spurious
+lapic_spurious:
+    iret
+
 
 %macro IRQ 2
   global irq_%1
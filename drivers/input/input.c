@@ -28,7 +28,7 @@ void input_send_key_event(uint32 type, uint32 keycode) {
     message_queue_enqueue(&target->inbox, &msg);
     
     if (target->main_thread && target->main_thread->state == TASK_WAITING) {
-        target->main_thread->state = TASK_READY;
+        task_wake(target->main_thread);
     }
 }
 
@@ -48,6 +48,6 @@ void input_send_mouse_event(uint32 type, uint32 button, uint32 x, uint32 y) {
     message_queue_enqueue(&target->inbox, &msg);
     
     if (target->main_thread && target->main_thread->state == TASK_WAITING) {
-        target->main_thread->state = TASK_READY;
+        task_wake(target->main_thread);
     }
 }
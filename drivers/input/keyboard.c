@@ -7,6 +7,8 @@
 #include "string.h"
 #include "ux.h"
 #include "desktop.h"
+#include "workqueue.h"
+#include "spinlock.h"
 
 static BOOL g_caps_lock = FALSE;
 static BOOL g_shift_pressed = FALSE;
@@ -15,6 +17,15 @@ static BOOL g_ctrl_pressed = FALSE;
 static BOOL g_extended = FALSE;  // E0 prefix received
 char g_ch = 0;
 
+// Scancodes read by the IRQ and decoded later by keyboard_work
+#define KEYBOARD_BUFFER_SIZE 64
+static uint8 g_scancodes[KEYBOARD_BUFFER_SIZE];
+static uint32 g_scancode_head = 0;
+static uint32 g_scancode_tail = 0;
+static uint32 g_scancode_count = 0;
+static spinlock_t g_scancode_lock = SPINLOCK_INIT;
+static work_t g_keyboard_work;
+
 #define SCAN_CODE_KEY_CTRL 0x1D
 
 // Special key codes (not printable)
@@ -79,11 +90,9 @@ char alternate_chars(char ch) {
     }
 }
 
-void keyboard_handler(REGISTERS *r __attribute__((unused))) {
-    int scancode;
-
+// Decode one scancode; runs in a worker because desktop keys redraw
+static void keyboard_process_scancode(int scancode) {
     g_ch = 0;
-    scancode = get_scancode();
     
     // Handle extended scancode prefix (E0)
     if (scancode == 0xE0) {
@@ -220,7 +229,38 @@ void keyboard_handler(REGISTERS *r __attribute__((unused))) {
     }
 }
 
+static void keyboard_work(void *data __attribute__((unused))) {
+    for (;;) {
+        uint32 flags = spin_lock_irqsave(&g_scancode_lock);
+        if (g_scancode_count == 0) {
+            spin_unlock_irqrestore(&g_scancode_lock, flags);
+            break;
+        }
+        uint8 scancode = g_scancodes[g_scancode_head];
+        g_scancode_head = (g_scancode_head + 1) % KEYBOARD_BUFFER_SIZE;
+        g_scancode_count--;
+        spin_unlock_irqrestore(&g_scancode_lock, flags);
+
+        keyboard_process_scancode(scancode);
+    }
+}
+
+// IRQ1: only read the controller and hand the scancode to a worker
+void keyboard_handler(REGISTERS *r __attribute__((unused))) {
+    int scancode = get_scancode();
+
+    uint32 flags = spin_lock_irqsave(&g_scancode_lock);
+    if (g_scancode_count < KEYBOARD_BUFFER_SIZE) {
+        g_scancodes[g_scancode_tail] = (uint8)scancode;
+        g_scancode_tail = (g_scancode_tail + 1) % KEYBOARD_BUFFER_SIZE;
+        g_scancode_count++;
+    }
+    spin_unlock_irqrestore(&g_scancode_lock, flags);
+    work_queue(&g_keyboard_work, WORK_PRIO_HIGH);
+}
+
 void keyboard_init() {
+    work_init(&g_keyboard_work, keyboard_work, NULL);
     isr_register_interrupt_handler(IRQ_BASE + 1, keyboard_handler);
 }
 
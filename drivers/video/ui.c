@@ -1,20 +1,28 @@
 #include "ui.h"
 #include "graphics.h"
 #include "string.h"
+#include "timer.h"
 
 // Global focus state
 static focus_state_t g_focus_state = {FOCUS_NONE, NULL, 0};
 
-// Caret blink counter (updated by timer)
-static uint32 g_caret_blink_ticks = 0;
+// Caret blink timer (periodic, runs in the timer IRQ)
+static ktimer_t g_caret_timer;
 #define CARET_BLINK_RATE 25  // ~250ms at 100Hz timer
 
+static void caret_blink_timer(void* data) {
+    (void)data;
+    ui_update_caret_blink();
+}
+
 // Initialize UI subsystem
 void ui_init(void) {
     g_focus_state.type = FOCUS_NONE;
     g_focus_state.element = NULL;
     g_focus_state.caret_visible = 1;
-    g_caret_blink_ticks = 0;
+    
+    ktimer_init(&g_caret_timer, caret_blink_timer, NULL);
+    ktimer_start(&g_caret_timer, CARET_BLINK_RATE, CARET_BLINK_RATE);
 }
 
 // Initialize a textbox
@@ -192,14 +200,9 @@ focus_type_t ui_get_focus_type(void) {
     return g_focus_state.type;
 }
 
-// Update caret blink state (called from timer interrupt)
+// Update caret blink state (called every CARET_BLINK_RATE ticks)
 void ui_update_caret_blink(void) {
-    g_caret_blink_ticks++;
-    
-    if (g_caret_blink_ticks >= CARET_BLINK_RATE) {
-        g_caret_blink_ticks = 0;
-        g_focus_state.caret_visible = !g_focus_state.caret_visible;
-    }
+    g_focus_state.caret_visible = !g_focus_state.caret_visible;
 }
 
 // Render caret for focused element
@@ -0,0 +1,89 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Clock Events and Monotonic Time
+ *
+ * The timer IRQ normally fires every tick (TIMER_HZ). When the kernel
+ * idles, clock_idle() asks the timer wheel how many ticks are empty
+ * and programs the clock event device to fire once after them instead,
+ * so idle ticks are skipped. The IRQ path then replays the ticks that
+ * actually elapsed, measured with the TSC.
+ *
+ * clock_monotonic_ns() is a TSC-based nanosecond clock calibrated
+ * against the PIT at boot.
+ */
+
+/* Clock event device: something that can raise the timer IRQ */
+typedef struct clock_event {
+    const char* name;
+    uint32_t max_oneshot;           /* Longest one-shot delay, in ticks */
+    void (*set_periodic)(void);     /* Interrupt every tick */
+    void (*set_oneshot)(uint32_t ticks); /* Interrupt once after ticks */
+} clock_event_t;
+
+/* Clock statistics */
+typedef struct {
+    uint32_t tsc_khz;           /* Calibrated TSC frequency */
+    uint32_t idle_entries;      /* clock_idle() calls */
+    uint32_t oneshots;          /* Idle periods run tickless */
+    uint32_t ticks_skipped;     /* Timer IRQs avoided while idle */
+    uint8_t initialized;
+} clock_stats_t;
+
+/* ============== Public API ============== */
+
+/**
+ * Calibrate the TSC and start the PIT at TIMER_HZ
+ *
+ * @return           0 on success, -1 if calibration failed
+ */
+int clock_init(void);
+
+/**
+ * Account for a timer IRQ
+ * Called from the IRQ0 path; restores periodic mode after a one-shot.
+ *
+ * @return           Number of ticks that elapsed since the previous IRQ
+ */
+uint32_t clock_event_elapsed(void);
+
+/**
+ * Idle until the next interrupt, skipping empty ticks
+ * Must be called with nothing else runnable.
+ */
+void clock_idle(void);
+
+/**
+ * Get monotonic time since clock_init()
+ *
+ * @return           Nanoseconds
+ */
+uint64_t clock_monotonic_ns(void);
+
+/**
+ * Busy-wait on the TSC (AP start-up timing; interrupts may be off)
+ *
+ * @param us         Microseconds to wait
+ */
+void clock_udelay(uint32_t us);
+
+/**
+ * Convert nanoseconds to milliseconds (no 64-bit division in the kernel)
+ *
+ * @param ns         Nanoseconds
+ * @return           Milliseconds, saturated at 0xFFFFFFFF
+ */
+uint32_t clock_ns_to_ms(uint64_t ns);
+
+/**
+ * Get clock statistics
+ *
+ * @param stats      Pointer to clock_stats_t to fill
+ */
+void clock_get_stats(clock_stats_t* stats);
+
+#endif /* CLOCK_H */
@@ -0,0 +1,38 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "types.h"
+#include "task.h"
+
+// FXSAVE image size; FNSAVE (no FXSR) fits in the same area
+#define FPU_STATE_SIZE      512
+#define FPU_STATE_ALIGN     16
+
+// Enable the FPU/SSE and arm lazy switching (CR0.TS)
+void fpu_init(void);
+
+// The per-CPU part of fpu_init(), run by each AP
+void fpu_init_cpu(void);
+
+// Give a task its save area: a 16-byte aligned FPU_STATE_SIZE buffer,
+// or NULL to allocate one from the heap; returns -1 if out of memory
+int fpu_task_init(task_t* task, void* area);
+
+// Called after every context switch: trap the next FPU use unless
+// the registers already belong to the incoming task
+void fpu_task_switched(task_t* next);
+
+// Write a task's live registers back to its save area so it can resume
+// on another CPU (lazy state would otherwise stay behind on this one)
+void fpu_task_save(task_t* task);
+
+// Forget a task that will never run again
+void fpu_task_exit(task_t* task);
+
+// Device-not-available (#NM, exception 7): swap FPU state to the current task
+void fpu_handle_nm(void);
+
+// Is SSE usable?
+int fpu_has_sse(void);
+
+#endif
@@ -2,8 +2,10 @@
 #define GDT_H
 
 #include "types.h"
+#include "smp.h"
 
-#define NO_GDT_DESCRIPTORS     8
+// 0-4 segments, 5 boot CPU TSS, 6 double-fault TSS, then one TSS per AP
+#define NO_GDT_DESCRIPTORS     SMP_AP_TSS_ENTRY(SMP_MAX_CPUS)
 
 typedef struct {
     uint16 segment_limit;
@@ -55,5 +57,9 @@ extern void tss_flush(void);
 void gdt_set_entry(int index, uint32 base, uint32 limit, uint8 access, uint8 gran);
 void gdt_init();
 void tss_init(uint32 kernel_ss, uint32 kernel_esp);
+void tss_init_cpu(uint32 cpu, uint32 kernel_esp);
+
+extern TSS g_tss;
+extern GDT_PTR g_gdt_ptr;
 
 #endif
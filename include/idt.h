@@ -23,4 +23,6 @@ extern void load_idt(uint32 idt_ptr);
 void idt_set_entry(int index, uint32 base, uint16 seg_sel, uint8 flags);
 void idt_init();
 
+extern IDT_PTR g_idt_ptr;
+
 #endif
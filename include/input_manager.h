@@ -43,9 +43,6 @@ typedef struct input_manager {
     // Smoothing state
     sint32 mouse_velocity_x;
     sint32 mouse_velocity_y;
-    
-    // Timestamp
-    uint32 tick_count;
 } input_manager_t;
 
 // ============================================================================
@@ -118,10 +115,4 @@ void input_set_mouse_sensitivity(uint8 level);  // 1-10
 void input_set_mouse_acceleration(uint8 level); // 0-3
 void input_set_mouse_smoothing(uint8 level);    // 0-3
 
-// ============================================================================
-// Tick Update (called from timer)
-// ============================================================================
-
-void input_tick(void);
-
 #endif // INPUT_MANAGER_H
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define IPC_H
 
 #include "types.h"
+#include "spinlock.h"
+#include "task.h"
 
 // Message structure - fixed size, no pointers
 // Only integers to avoid memory bugs
@@ -21,6 +23,8 @@ typedef struct message_queue {
     uint32 read_index;     // Where to read next
     uint32 write_index;    // Where to write next
     uint32 count;          // Number of messages in queue
+    spinlock_t lock;       // Senders on other CPUs and IRQ handlers
+    task_t* volatile waiter;  // Task blocked in ipc_wait(), if any
 } message_queue_t;
 
 // Message queue operations
@@ -30,4 +34,104 @@ int message_queue_dequeue(message_queue_t* queue, message_t* msg);
 int message_queue_is_empty(message_queue_t* queue);
 int message_queue_is_full(message_queue_t* queue);
 
+// Variable-length messages (kernel senders only)
+// Payloads that fit in data1/data2 travel inline as before. A longer one
+// rides in an ipc_buf_t: the message type gets IPC_MSG_BUF, data1 points
+// at the buffer and data2 holds the length. Payloads up to IPC_BUF_HEAP_MAX
+// bytes share a heap block with the header; larger ones get whole page
+// frames (identity mapped, so every task sees them), which the sender
+// fills in place and lends to the receiver without a copy. Once sent, the
+// buffer belongs to the receiver, who frees it.
+#define IPC_MSG_BUF         0x80000000
+#define IPC_MSG_CALL        0x40000000  // Sent by ipc_call(), wants a reply
+#define IPC_MSG_FLAGS       (IPC_MSG_BUF | IPC_MSG_CALL)
+#define IPC_INLINE_MAX      8       // Bytes carried in data1/data2
+#define IPC_BUF_HEAP_MAX    2048    // Larger buffers get their own pages
+
+typedef struct ipc_buf {
+    uint32 size;          // Payload bytes
+    uint32 capacity;      // Bytes available at data
+    uint32 frames;        // Page frames backing data, 0 = same heap block
+    uint8* data;          // Payload
+    struct ipc_call* call;  // Caller waiting for the reply, if any
+} ipc_buf_t;
+
+// Synchronous call in progress (lives on the caller's stack)
+typedef struct ipc_call {
+    task_t* caller;
+    message_t reply;
+    volatile uint32 done;
+} ipc_call_t;
+
+// Buffer carried by a received message, NULL for an inline one
+static inline ipc_buf_t* ipc_msg_buf(message_t* msg) {
+    return (msg->type & IPC_MSG_BUF) ? (ipc_buf_t*)msg->data1 : NULL;
+}
+
+// Call to reply to, NULL for a one-way message. Take it before
+// ipc_msg_read() frees the buffer
+static inline ipc_call_t* ipc_msg_call(message_t* msg) {
+    return (msg->type & IPC_MSG_CALL) ? ((ipc_buf_t*)msg->data1)->call : NULL;
+}
+
+// Message type without the IPC flags
+static inline uint32 ipc_msg_type(message_t* msg) {
+    return msg->type & ~IPC_MSG_FLAGS;
+}
+
+// Transfer counters
+typedef struct ipc_stats {
+    uint32 inline_msgs;   // Payload fit in data1/data2
+    uint32 copied_msgs;   // Payload copied into a buffer by ipc_send_data
+    uint32 lent_msgs;     // Buffer filled by the sender and handed over
+    uint32 page_bufs;     // Buffers backed by page frames
+    uint32 calls;         // Completed ipc_call() round trips
+    uint64 bytes_copied;
+    uint64 bytes_lent;
+} ipc_stats_t;
+
+// Allocate a buffer for size payload bytes; NULL if out of memory
+ipc_buf_t* ipc_buf_alloc(uint32 size);
+
+// Free a buffer (a received one, or one that could not be sent)
+void ipc_buf_free(ipc_buf_t* buf);
+
+// Hand a filled buffer to the queue; on failure (-1) the caller keeps it
+int ipc_send_buf(message_queue_t* queue, uint32 sender_pid, uint32 type, ipc_buf_t* buf);
+
+// Send len bytes from data, inline when they fit, otherwise copied into
+// a buffer. 0 on success, -1 if the queue is full or memory ran out
+int ipc_send_data(message_queue_t* queue, uint32 sender_pid, uint32 type,
+                  const void* data, uint32 len);
+
+// Copy a received payload (inline or buffer) to out, up to max bytes,
+// and free the buffer. Returns the payload length
+uint32 ipc_msg_read(message_t* msg, void* out, uint32 max);
+
+// Synchronous calls (kernel tasks; needs the scheduler)
+// ipc_call() sends a request and blocks until it is answered. If the
+// receiver is blocked in ipc_wait() it runs at once on the caller's CPU,
+// and ipc_reply() switches straight back, so a round trip never waits
+// for a timer tick or for the rest of the run queue.
+
+// Send len bytes to the queue's receiver and wait for its reply.
+// 0 on success, -1 if the queue is full or memory ran out
+int ipc_call(message_queue_t* queue, uint32 type, const void* data, uint32 len,
+             message_t* reply);
+
+// Answer a call: data1/data2 go back to the caller, who runs next
+void ipc_reply(ipc_call_t* call, uint32 data1, uint32 data2);
+
+// Blocking receive on the calling task's own queue.
+// 0 on success, -1 if there is nothing and no scheduler to wait with
+int ipc_wait(message_queue_t* queue, message_t* msg);
+
+// Get the transfer counters
+void ipc_get_stats(ipc_stats_t* stats);
+
+// Measure transfer throughput and call round trips between two kernel
+// tasks; results (MB/s for each payload size, copied and lent, and ns
+// per call) go to the debug console
+int ipc_bench_start(void);
+
 #endif
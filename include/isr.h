@@ -17,6 +17,7 @@ void isr_register_interrupt_handler(int num, ISR handler);
 void isr_end_interrupt(int num);
 void isr_exception_handler(REGISTERS reg);
 void isr_irq_handler(REGISTERS *reg);
+void double_fault_task(void);
 
 
 extern void exception_0();
@@ -71,6 +72,10 @@ extern void irq_12();
 extern void irq_13();
 extern void irq_14();
 extern void irq_15();
+extern void lapic_timer_with_task_switch();
+extern void lapic_spurious();
+extern void lapic_tlb_shootdown();
+extern void task_switch_int();
 
 
 #define IRQ_BASE            0x20
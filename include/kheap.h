@@ -11,8 +11,23 @@
 /* Block header flags */
 #define KHEAP_FLAG_FREE    0x0
 #define KHEAP_FLAG_USED    0x1
+#define KHEAP_FLAG_SLAB    0x2     /* Block belongs to a size class */
 #define KHEAP_MAGIC        0xDEADBEEF
 
+/* Size classes: requests up to KHEAP_SLAB_MAX are served from per-class
+ * free lists (16, 32, ... 2048 bytes); larger ones use best-fit */
+#define KHEAP_NUM_CLASSES  8
+#define KHEAP_SLAB_MIN     16
+#define KHEAP_SLAB_MAX     2048
+
+/* Per-CPU magazines: each CPU keeps up to two magazines (stacks of class
+ * blocks) per class, so a kmalloc/kfree that hits them takes no lock.
+ * Full and empty magazines are traded with a global depot; excess full
+ * ones are trimmed back to the class lists by kheap_rebalance() */
+#define KHEAP_MAG_ROUNDS   16      /* Blocks per magazine (small classes) */
+#define KHEAP_MAG_BYTES    8192    /* Cap on bytes one magazine holds */
+#define KHEAP_MAG_COUNT    192     /* Magazines in the static pool */
+
 typedef struct kheap_block {
     uint32_t magic;
     uint32_t flags;
@@ -21,6 +36,16 @@ typedef struct kheap_block {
     struct kheap_block* prev;
 } kheap_block_t;
 
+/* Per-class free list and counters */
+typedef struct {
+    size_t size;                /* Block size served by this class */
+    kheap_block_t* free_list;   /* Freed blocks ready for reuse */
+    uint32_t cached;            /* Blocks currently on free_list */
+    uint32_t hits;              /* Allocations served from free_list */
+    uint32_t misses;            /* Allocations carved from the heap */
+    uint32_t frees;             /* Blocks returned to free_list */
+} kheap_class_t;
+
 typedef struct {
     kheap_block_t* free_list;
     kheap_block_t* used_list;
@@ -31,6 +56,14 @@ typedef struct {
     size_t total_freed;
     uint32_t num_allocs;
     uint32_t num_frees;
+    uint32_t large_allocs;      /* Allocations above KHEAP_SLAB_MAX */
+    uint32_t reclaims;          /* Class caches flushed back to the heap */
+    uint32_t mag_allocs;        /* Served from a per-CPU magazine */
+    uint32_t mag_frees;         /* Returned to a per-CPU magazine */
+    uint32_t depot_refills;     /* Empty CPU caches refilled from shared state */
+    uint32_t depot_drains;      /* Full magazines handed to the depot */
+    uint32_t depot_trims;       /* Idle depot magazines flushed by rebalancing */
+    kheap_class_t classes[KHEAP_NUM_CLASSES];
     uint8_t initialized;
 } kheap_state_t;
 
@@ -39,8 +72,13 @@ void* kmalloc(size_t size);
 void kfree(void* ptr);
 void* krealloc(void* ptr, size_t size);
 void* kcalloc(size_t num, size_t size);
+/* Snapshot of the heap state with the per-CPU counters folded in */
 kheap_state_t* kheap_get_state(void);
 int kheap_check_integrity(void);
 void kheap_dump(void);
 
+/* Flush depot magazines left unused since the previous call back to the
+ * class lists (called periodically) */
+void kheap_rebalance(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Kernel Stack Allocator
+ *
+ * Task stacks live in a dedicated kernel virtual region carved into
+ * fixed 64KB slots. A stack is mapped at the top of its slot and the
+ * rest of the slot stays unmapped, so running off the bottom hits at
+ * least one guard page and faults instead of corrupting the heap.
+ *
+ * Freed stacks keep their pages and go to a small cache, so creating
+ * a task of a recently used size is a list pop. New stacks are filled
+ * with a pattern to track how deep each one has been used.
+ */
+
+/* Virtual region (page tables are preallocated and shared by all
+ * page directories) */
+#define KSTACK_REGION_BASE  0xE0000000
+#define KSTACK_REGION_SIZE  0x01000000
+#define KSTACK_SLOT_SIZE    0x10000
+#define KSTACK_SLOTS        (KSTACK_REGION_SIZE / KSTACK_SLOT_SIZE)
+
+/* Stack sizes (rounded up to whole pages; one page of a slot is always
+ * left as a guard) */
+#define KSTACK_DEFAULT_SIZE 8192
+#define KSTACK_MAX_SIZE     (KSTACK_SLOT_SIZE - 4096)
+
+/* Freed stacks kept mapped for reuse */
+#define KSTACK_CACHE_MAX    8
+
+/* Kernel stack statistics */
+typedef struct {
+    uint32_t in_use;            /* Stacks handed out */
+    uint32_t cached;            /* Freed stacks kept for reuse */
+    uint32_t mapped_pages;      /* Pages backing in-use and cached stacks */
+    uint32_t allocs;            /* kstack_alloc() calls that succeeded */
+    uint32_t cache_hits;        /* Allocations served from the cache */
+    uint32_t max_used;          /* Deepest stack use measured, bytes */
+    uint8_t initialized;
+} kstack_stats_t;
+
+/* ============== Public API ============== */
+
+/**
+ * Reserve the stack region in the kernel page directory
+ * Must run before any other page directory is created.
+ *
+ * @return           0 on success, -1 if the region is unusable
+ */
+int kstack_init(void);
+
+/**
+ * Allocate a guarded kernel stack
+ *
+ * @param size       Requested size in bytes (0 = KSTACK_DEFAULT_SIZE)
+ * @return           Lowest usable address of the stack, or NULL
+ */
+void* kstack_alloc(uint32_t size);
+
+/**
+ * Free a kernel stack (it may be cached for reuse)
+ *
+ * @param stack      Address returned by kstack_alloc()
+ */
+void kstack_free(void* stack);
+
+/**
+ * Get the usable size of a stack
+ *
+ * @param stack      Address returned by kstack_alloc()
+ * @return           Size in bytes, 0 if not a live stack
+ */
+uint32_t kstack_size(void* stack);
+
+/**
+ * Measure the deepest use of a stack since it was allocated
+ *
+ * @param stack      Address returned by kstack_alloc()
+ * @return           High-water mark in bytes
+ */
+uint32_t kstack_high_water(void* stack);
+
+/**
+ * Check whether an address falls in a guard area
+ * Used by the fault handlers to report stack overflows.
+ *
+ * @param addr       Faulting address
+ * @return           1 if addr is inside the region but below a stack
+ */
+int kstack_is_guard(uint32_t addr);
+
+/**
+ * Get kernel stack statistics
+ *
+ * @param stats      Pointer to kstack_stats_t to fill
+ */
+void kstack_get_stats(kstack_stats_t* stats);
+
+#endif /* KSTACK_H */
@@ -0,0 +1,40 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include "types.h"
+
+#define LAPIC_DEFAULT_BASE  0xFEE00000
+
+// Vectors owned by the local APIC (above the remapped PIC range)
+#define LAPIC_TIMER_VECTOR    0xF0
+#define LAPIC_TLB_VECTOR      0xF1   // TLB shootdown request (vmm.c)
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+// Map the local APIC and enable it on the boot CPU; -1 if there is none
+int lapic_init(void);
+
+// Is a local APIC mapped and enabled?
+int lapic_present(void);
+
+// Enable the local APIC of the calling CPU (APs, after lapic_init)
+void lapic_enable(void);
+
+// APIC ID of the calling CPU
+uint32 lapic_id(void);
+
+// Acknowledge the interrupt being serviced
+void lapic_eoi(void);
+
+// INIT-SIPI-SIPI to every other CPU; they start in real mode at page << 12
+void lapic_start_aps(uint8 page);
+
+// Send a fixed interrupt to every other CPU
+void lapic_send_ipi_others(uint8 vector);
+
+// Count timer ticks over one TIMER_HZ period against the PIT (boot CPU)
+void lapic_timer_calibrate(void);
+
+// Periodic LAPIC_TIMER_VECTOR interrupts at TIMER_HZ on the calling CPU
+void lapic_timer_start(void);
+
+#endif
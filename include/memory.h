@@ -7,6 +7,7 @@
 
 // Page directory type (opaque pointer)
 typedef struct page_directory page_directory_t;
+typedef struct vmm_tlb_batch vmm_tlb_batch_t;
 
 void memory_init(multiboot_info_t *mbi);
 void *allocate_page();
@@ -20,12 +21,22 @@ void paging_enable();
 
 // Page directory management for processes
 page_directory_t* create_page_directory(void);
+page_directory_t* clone_page_directory(page_directory_t* parent);
+void destroy_page_directory(page_directory_t* dir);
 void switch_page_directory(page_directory_t* dir);
 page_directory_t* get_kernel_page_directory(void);
 void map_page_in_directory(page_directory_t* dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
+void map_page_in_directory_batch(page_directory_t* dir, uint32_t virt_addr, uint32_t phys_addr,
+                                 uint32_t flags, vmm_tlb_batch_t* batch);
+
+// Copy-on-write: returns 0 if the fault was resolved, -1 otherwise
+int memory_handle_cow_fault(uint32_t fault_addr, uint32_t err_code);
+void memory_get_cow_stats(uint32_t* faults, uint32_t* copies);
+int memory_cow_selftest(void);
 
 // Memory info functions
 uint32_t memory_get_end(void);
+uint32_t memory_get_heap_size(void);
 int memory_is_initialized(void);
 
 #endif
\ No newline at end of file
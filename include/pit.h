@@ -0,0 +1,23 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include "types.h"
+
+#define PIT_BASE_HZ         1193182
+#define PIT_CHANNEL0        0x40
+#define PIT_CHANNEL2        0x42
+#define PIT_COMMAND         0x43
+#define PIT_GATE_PORT       0x61    // Channel 2 gate / speaker control
+
+#define PIT_MAX_COUNT       0xFFFF
+
+// Channel 0: periodic interrupts at hz
+void pit_set_periodic(uint32 hz);
+
+// Channel 0: a single interrupt after count PIT cycles
+void pit_set_oneshot(uint16 count);
+
+// Count TSC cycles over count PIT cycles using channel 2 (no IRQ needed)
+uint64 pit_measure_tsc(uint16 count);
+
+#endif
@@ -9,6 +9,8 @@
  * 
  * Manages physical memory using a bitmap allocator.
  * Tracks which physical frames are available for use.
+ * The bitmap is scanned a 32-bit word at a time, starting from a
+ * rotating next-free hint.
  */
 
 /* Page/frame size - 4KB */
@@ -19,6 +21,9 @@
 #define PMM_ADDR_TO_FRAME(addr)  ((uint32_t)(addr) >> PMM_PAGE_SHIFT)
 #define PMM_FRAME_TO_ADDR(frame) ((uint32_t)(frame) << PMM_PAGE_SHIFT)
 
+/* Bytes of bitmap storage needed for mem_size bytes (whole 32-bit words) */
+#define PMM_BITMAP_SIZE(mem_size) ((((uint32_t)(mem_size) / PMM_PAGE_SIZE + 31) / 32) * 4)
+
 /* Memory region types */
 typedef enum {
     PMM_REGION_FREE = 0,      /* Available for allocation */
@@ -42,16 +47,47 @@ typedef struct {
     uint32_t reserved_frames; /* Number of reserved frames */
     uint32_t total_memory;    /* Total memory in KB */
     uint32_t free_memory;     /* Free memory in KB */
+    uint32_t shared_frames;   /* Frames mapped more than once */
     uint8_t initialized;      /* Is PMM initialized? */
 } pmm_stats_t;
 
+/* Buddy allocator: blocks of 2^order frames, order 0..PMM_BUDDY_MAX_ORDER */
+#define PMM_BUDDY_MAX_ORDER  10
+#define PMM_BUDDY_ORDERS     (PMM_BUDDY_MAX_ORDER + 1)
+
+/* Per-frame buddy metadata (only meaningful for free block heads) */
+typedef struct {
+    uint32_t next;            /* Next free block head at this order */
+    uint32_t prev;            /* Previous free block head at this order */
+    uint8_t order;            /* Order of the free block headed here */
+    uint8_t flags;            /* Free-head flag */
+} pmm_buddy_frame_t;
+
+/* Bytes of buddy metadata needed for mem_size bytes */
+#define PMM_BUDDY_META_SIZE(mem_size) (((uint32_t)(mem_size) / PMM_PAGE_SIZE) * sizeof(pmm_buddy_frame_t))
+
+/* Buddy allocator statistics */
+typedef struct {
+    uint32_t allocs;          /* Blocks handed out */
+    uint32_t frees;           /* Blocks or runs returned */
+    uint32_t splits;          /* Blocks split in two */
+    uint32_t merges;          /* Buddy pairs merged */
+    uint32_t fallbacks;       /* Requests above max order (bitmap scan) */
+    uint32_t free_blocks[PMM_BUDDY_ORDERS]; /* Free blocks per order */
+    uint8_t enabled;          /* Is the buddy allocator active? */
+} pmm_buddy_stats_t;
+
+/* Bytes of reference count storage needed for mem_size bytes */
+#define PMM_REFS_SIZE(mem_size) (((uint32_t)(mem_size) / PMM_PAGE_SIZE) * sizeof(uint16_t))
+
 /* ============== Public API ============== */
 
 /**
  * Initialize the physical memory manager
  * 
  * @param mem_size   Total physical memory size in bytes
- * @param bitmap     Pointer to bitmap storage (or NULL to allocate)
+ * @param bitmap     Pointer to 4-byte aligned bitmap storage of at least
+ *                   PMM_BITMAP_SIZE(mem_size) bytes
  * @return           0 on success, -1 on failure
  */
 int pmm_init(uint32_t mem_size, void* bitmap);
@@ -131,6 +167,84 @@ int pmm_is_frame_free(uint32_t frame);
  */
 void pmm_get_stats(pmm_stats_t* stats);
 
+/**
+ * Enable the buddy allocator for contiguous allocations
+ * Seeds the free lists from the current bitmap. Afterwards
+ * pmm_alloc_frame(s) and all frees go through the buddy lists, while
+ * the bitmap remains the source of truth for pmm_is_frame_free().
+ * 
+ * @param meta       Storage of at least PMM_BUDDY_META_SIZE(mem_size) bytes
+ * @return           0 on success, -1 on failure
+ */
+int pmm_buddy_init(void* meta);
+
+/**
+ * Allocate a naturally aligned block of 2^order frames
+ * 
+ * @param order      Block order (0..PMM_BUDDY_MAX_ORDER)
+ * @return           Starting frame number, or 0 if not available
+ */
+uint32_t pmm_alloc_order(uint32_t order);
+
+/**
+ * Free a block returned by pmm_alloc_order
+ * 
+ * @param frame      Starting frame number
+ * @param order      Block order
+ */
+void pmm_free_order(uint32_t frame, uint32_t order);
+
+/**
+ * Get buddy allocator statistics
+ * 
+ * @param stats      Pointer to pmm_buddy_stats_t to fill
+ */
+void pmm_get_buddy_stats(pmm_buddy_stats_t* stats);
+
+/**
+ * Enable per-frame reference counts for shared (copy-on-write) mappings
+ * An allocated frame starts with one reference, held by its owner.
+ * A saturated count is sticky and pins the frame.
+ * 
+ * @param refs       Storage of at least PMM_REFS_SIZE(mem_size) bytes
+ * @return           0 on success, -1 on failure
+ */
+int pmm_refs_init(void* refs);
+
+/**
+ * Add a reference to an allocated frame
+ * 
+ * @param frame      Frame number
+ * @return           New reference count, or 0 if the frame is free,
+ *                   out of range or the count would overflow
+ */
+uint32_t pmm_frame_ref(uint32_t frame);
+
+/**
+ * Drop a reference to a frame, freeing it when the last one goes
+ * 
+ * @param frame      Frame number
+ * @return           Remaining reference count (0 = frame was freed)
+ */
+uint32_t pmm_frame_unref(uint32_t frame);
+
+/**
+ * Get the shared zero-filled frame
+ * Allocated by pmm_refs_init() and pinned: its count is saturated, so
+ * it is never freed and every write to it must copy.
+ * 
+ * @return           Frame number, or 0 if reference counts are off
+ */
+uint32_t pmm_zero_frame(void);
+
+/**
+ * Get the reference count of a frame
+ * 
+ * @param frame      Frame number
+ * @return           0 if free, otherwise 1 + number of extra references
+ */
+uint32_t pmm_frame_refcount(uint32_t frame);
+
 /**
  * Dump PMM state for debugging
  */
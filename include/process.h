@@ -20,7 +20,8 @@ typedef struct process {
 // Process management functions
 void process_init(void);
 process_t* process_create(void (*entry_point)(void), uint32 is_user_mode);
-process_t* process_get_current(void);
+process_t* process_get_current(void);   // Owner of the loaded page directory
+process_t* process_get_running(void);   // Process of the calling task, NULL for kernel tasks
 void process_switch(process_t* next);
 process_t* process_find_by_pid(uint32 pid);
 
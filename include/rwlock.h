@@ -0,0 +1,101 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spinlock.h"
+
+/**
+ * Reader-Writer Lock
+ *
+ * Any number of readers or one writer. A waiting writer stops new
+ * readers from entering, so a steady stream of readers cannot starve
+ * it. Like the spinlocks it busy-waits; the _irqsave variants are for
+ * data touched from interrupt handlers.
+ *
+ * Statistics (if any) count both kinds of acquisition; hold times are
+ * recorded for writers only, since readers overlap.
+ */
+
+/* Reader-writer lock */
+typedef struct {
+    volatile int32_t count;             /* Readers inside, -1 = writer */
+    volatile uint32_t writers_waiting;
+    uint32_t hold_start;                /* Writer's TSC at acquisition */
+    lock_stats_t* stats;
+} rwlock_t;
+
+#define RWLOCK_INIT         { 0, 0, 0, NULL }
+
+/* ============== Public API ============== */
+
+/**
+ * Initialize a reader-writer lock
+ *
+ * @param lock       Lock to set up (unlocked)
+ * @param name       Name for the statistics registry
+ * @param stats      Statistics to keep, or NULL for none
+ */
+void rw_init(rwlock_t* lock, const char* name, lock_stats_t* stats);
+
+/**
+ * Enter as a reader
+ *
+ * @param lock       Lock to take
+ */
+void read_lock(rwlock_t* lock);
+
+/**
+ * Leave as a reader
+ *
+ * @param lock       Lock held for reading
+ */
+void read_unlock(rwlock_t* lock);
+
+/**
+ * Enter as the writer, waiting for readers to drain
+ *
+ * @param lock       Lock to take
+ */
+void write_lock(rwlock_t* lock);
+
+/**
+ * Leave as the writer
+ *
+ * @param lock       Lock held for writing
+ */
+void write_unlock(rwlock_t* lock);
+
+/**
+ * Disable local interrupts, then enter as a reader
+ *
+ * @param lock       Lock to take
+ * @return           Saved EFLAGS for read_unlock_irqrestore()
+ */
+uint32_t read_lock_irqsave(rwlock_t* lock);
+
+/**
+ * Leave as a reader and restore the interrupt state
+ *
+ * @param lock       Lock held for reading
+ * @param flags      Value returned by read_lock_irqsave()
+ */
+void read_unlock_irqrestore(rwlock_t* lock, uint32_t flags);
+
+/**
+ * Disable local interrupts, then enter as the writer
+ *
+ * @param lock       Lock to take
+ * @return           Saved EFLAGS for write_unlock_irqrestore()
+ */
+uint32_t write_lock_irqsave(rwlock_t* lock);
+
+/**
+ * Leave as the writer and restore the interrupt state
+ *
+ * @param lock       Lock held for writing
+ * @param flags      Value returned by write_lock_irqsave()
+ */
+void write_unlock_irqrestore(rwlock_t* lock, uint32_t flags);
+
+#endif /* RWLOCK_H */
@@ -0,0 +1,89 @@
+#ifndef SCHED_TRACE_H
+#define SCHED_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Scheduler Trace Ring
+ *
+ * A fixed ring of scheduler events stamped with the TSC. Writers claim
+ * a slot with one atomic increment and publish it by writing its
+ * sequence number last, so recording never takes a lock and is safe
+ * from the timer IRQ. Readers copy a snapshot and drop slots that were
+ * overwritten while they read.
+ */
+
+#define SCHED_TRACE_SIZE    256     /* Events kept (power of two) */
+#define SCHED_TRACE_MASK    (SCHED_TRACE_SIZE - 1)
+
+/* Event types */
+typedef enum {
+    SCHED_EV_SWITCH_IN = 1,         /* Task got the CPU */
+    SCHED_EV_SWITCH_OUT,            /* Task lost the CPU (arg: reason) */
+    SCHED_EV_WAKE,                  /* Task made ready (arg: priority) */
+    SCHED_EV_BLOCK,                 /* Task blocked */
+    SCHED_EV_SLEEP,                 /* Task went to sleep */
+    SCHED_EV_EXIT                   /* Task exited */
+} sched_event_t;
+
+/* Why a task was switched out */
+typedef enum {
+    SCHED_OUT_YIELD = 0,            /* Gave up the CPU voluntarily */
+    SCHED_OUT_SLICE,                /* Time slice used up */
+    SCHED_OUT_PREEMPT,              /* Higher priority task woke */
+    SCHED_OUT_BLOCK,                /* Blocked or sleeping */
+    SCHED_OUT_EXIT,                 /* Exited */
+    SCHED_OUT_HANDOFF               /* Handed the CPU to a woken task */
+} sched_out_reason_t;
+
+/* One trace record */
+typedef struct {
+    uint64_t tsc;                   /* Timestamp (TSC cycles) */
+    uint32_t seq;                   /* Event number + 1; 0 while being written */
+    uint16_t task_id;
+    uint8_t event;                  /* sched_event_t */
+    uint8_t arg;                    /* Event specific */
+} sched_trace_event_t;
+
+/* ============== Public API ============== */
+
+/**
+ * Record an event
+ *
+ * @param event      sched_event_t
+ * @param task_id    Task the event is about
+ * @param arg        Event specific argument
+ */
+void sched_trace(uint8_t event, uint32_t task_id, uint8_t arg);
+
+/**
+ * Copy the most recent events, oldest first
+ *
+ * @param out        Buffer for the events
+ * @param max        Capacity of out
+ * @return           Number of events copied
+ */
+uint32_t sched_trace_snapshot(sched_trace_event_t* out, uint32_t max);
+
+/**
+ * Get the number of events recorded since boot
+ *
+ * @return           Event count (including overwritten ones)
+ */
+uint32_t sched_trace_count(void);
+
+/**
+ * Print the ring to the serial port
+ */
+void sched_trace_dump(void);
+
+/**
+ * Get a short name for an event type
+ *
+ * @param event      sched_event_t
+ * @return           Static string
+ */
+const char* sched_trace_event_name(uint8_t event);
+
+#endif /* SCHED_TRACE_H */
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include "task.h"
 #include "process.h"
+#include "timer.h"
 
 /**
  * Process Scheduler
@@ -14,6 +15,16 @@
  * - Time slicing
  * - Preemptive multitasking
  * - Sleep/wake mechanism
+ * 
+ * The timer IRQ (irq_0_with_task_switch -> task_scheduler_tick) calls
+ * scheduler_tick() for accounting and scheduler_schedule() to pick the
+ * task whose stack it switches to.
+ *
+ * Every CPU has its own run queues and schedules from them on its own
+ * timer interrupt. A CPU that only has idle work steals the best task it
+ * is allowed to run from the busiest other CPU. Tasks are placed on the
+ * boot CPU and pinned to it (SCHED_AFFINITY_BSP) until they opt in to
+ * more CPUs with scheduler_set_affinity().
  */
 
 /* Scheduler configuration */
@@ -22,6 +33,10 @@
 #define SCHED_TIME_SLICE      10      /* Timer ticks per time slice */
 #define SCHED_MAX_SLEEP_MS    60000   /* Maximum sleep time in ms */
 
+/* CPU affinity masks (bit n = may run on CPU n) */
+#define SCHED_AFFINITY_BSP    0x00000001u
+#define SCHED_AFFINITY_ALL    0xFFFFFFFFu
+
 /* Priority levels */
 typedef enum {
     SCHED_PRIORITY_IDLE    = 0,
@@ -49,7 +64,15 @@ typedef struct {
     uint32_t ready_tasks;       /* Ready to run */
     uint32_t blocked_tasks;     /* Blocked waiting */
     uint32_t context_switches;  /* Total context switches */
+    uint32_t preemptions;       /* Switches forced by a higher priority wakeup */
     uint32_t timer_ticks;       /* Total timer ticks */
+    uint32_t wakeups;           /* Blocked/sleeping tasks made ready */
+    uint32_t wake_latency_last; /* Wake-to-run latency, ns */
+    uint32_t wake_latency_avg;  /* Running average (1/8 weight), ns */
+    uint32_t wake_latency_max;  /* Worst case seen, ns */
+    uint32_t steals;            /* Tasks pulled by an otherwise idle CPU */
+    uint32_t migrations;        /* Tasks moved to satisfy their affinity */
+    uint32_t handoffs;          /* Direct switches by scheduler_handoff() */
     uint8_t  initialized;       /* Is scheduler initialized? */
 } sched_stats_t;
 
@@ -62,11 +85,34 @@ typedef struct sched_task {
     uint32_t time_slice;        /* Remaining time slice */
     uint32_t total_cpu_time;    /* Total CPU time used */
     uint32_t wake_time;         /* Wake time for sleeping tasks */
+    uint64_t wake_stamp;        /* Time (ns) when last made ready by a wakeup */
+    uint64_t ready_stamp;       /* Time (ns) it last joined a run queue */
+    uint64_t run_stamp;         /* Time (ns) it last got the CPU */
+    uint64_t cpu_ns;            /* CPU time used */
+    uint64_t wait_ns;           /* Time spent ready but not running */
+    uint32_t switches;          /* Times it got the CPU */
+    uint32_t preempted;         /* Times it lost the CPU while still runnable */
+    ktimer_t sleep_timer;       /* Fires at wake_time while sleeping */
+    uint32_t cpu;               /* Run queue the task is on */
+    uint32_t affinity;          /* CPUs it may run on */
+    volatile uint8_t on_cpu;    /* Stack still in use by a CPU */
     void* wait_data;            /* Data for wait condition */
     struct sched_task* next;    /* Next task in queue */
     struct sched_task* prev;    /* Previous task in queue */
 } sched_task_t;
 
+/* Per-task accounting snapshot */
+typedef struct {
+    uint32_t task_id;
+    uint32_t cpu;               /* CPU whose run queue holds it */
+    sched_priority_t priority;
+    sched_state_t state;
+    uint64_t cpu_ns;            /* CPU time used */
+    uint64_t wait_ns;           /* Time spent ready but not running */
+    uint32_t switches;          /* Times it got the CPU */
+    uint32_t preempted;         /* Slice expiries and preemptions */
+} sched_task_stats_t;
+
 /* ============== Public API ============== */
 
 /**
@@ -94,15 +140,16 @@ int scheduler_add_task(task_t* task, process_t* process, sched_priority_t priori
 void scheduler_remove_task(task_t* task);
 
 /**
- * Get current running task
+ * Get the task running on the calling CPU
  * 
  * @return           Pointer to current sched_task, or NULL
  */
 sched_task_t* scheduler_get_current(void);
 
 /**
- * Request a context switch
- * Called from timer interrupt
+ * Give up the CPU
+ * Switches at once when another task is queued on this CPU; otherwise
+ * the caller waits for the next timer tick.
  */
 void scheduler_yield(void);
 
@@ -114,6 +161,16 @@ void scheduler_yield(void);
  */
 void scheduler_block(void* reason);
 
+/**
+ * Take a task off the run queues without waiting
+ * Safe from interrupt and syscall context; the task stops being
+ * scheduled from the next timer tick.
+ * 
+ * @param task       Task to block
+ * @param reason     Pointer to wait reason (for debugging)
+ */
+void scheduler_block_task(task_t* task, void* reason);
+
 /**
  * Wake a blocked task
  * 
@@ -121,6 +178,19 @@ void scheduler_block(void* reason);
  */
 void scheduler_wake(task_t* task);
 
+/**
+ * Wake a blocked task and switch straight to it on this CPU
+ * The target goes ahead of everything queued here. It still joins the
+ * run queue, which holds every runnable task. The caller stays runnable
+ * unless it blocked itself first, as a synchronous IPC client does
+ * before sending. A target that is not blocked, or may not run here, is
+ * woken the normal way. Returns once the caller is scheduled again.
+ * 
+ * @param task       Task to run next
+ * @return           1 if switched directly, 0 otherwise
+ */
+int scheduler_handoff(task_t* task);
+
 /**
  * Sleep for specified milliseconds
  * 
@@ -136,6 +206,31 @@ void scheduler_sleep(uint32_t ms);
  */
 void scheduler_set_priority(task_t* task, sched_priority_t priority);
 
+/**
+ * Restrict the CPUs a task may run on
+ * A queued task moves at once; a running one when it is next switched
+ * out. Sleeps, timers, work items, IPC and the heap are safe on any CPU;
+ * a task that opts in must not touch unlocked driver or UI state.
+ * 
+ * @param task       Task to modify
+ * @param mask       SCHED_AFFINITY_* or a bitmask of CPU numbers
+ * @return           0 on success, -1 if no online CPU is in the mask
+ */
+int scheduler_set_affinity(task_t* task, uint32_t mask);
+
+/**
+ * Get the CPUs a task may run on
+ * 
+ * @param task       Task to query
+ * @return           Affinity mask
+ */
+uint32_t scheduler_get_affinity(task_t* task);
+
+/**
+ * Bring the calling CPU's run queue online (APs, from task_init_cpu())
+ */
+void scheduler_cpu_online(void);
+
 /**
  * Get task priority
  * 
@@ -163,6 +258,15 @@ void scheduler_get_stats(sched_stats_t* stats);
  */
 void scheduler_dump(void);
 
+/**
+ * Get per-task CPU accounting
+ * 
+ * @param out        Buffer for one entry per task
+ * @param max        Capacity of out
+ * @return           Number of entries filled
+ */
+uint32_t scheduler_get_task_stats(sched_task_stats_t* out, uint32_t max);
+
 /**
  * Check if scheduler is initialized
  * 
@@ -171,19 +275,51 @@ void scheduler_dump(void);
 int scheduler_is_initialized(void);
 
 /**
- * Get number of runnable tasks
+ * Get number of runnable tasks on the calling CPU
  * 
- * @return           Number of tasks in READY state
+ * @return           Number of tasks on its run queues (the running one included)
  */
 uint32_t scheduler_runnable_count(void);
 
 /* ============== Timer Integration ============== */
 
 /**
- * Called from timer interrupt
- * Decrements time slice and triggers context switch if needed
+ * Called from the timer interrupt of every CPU
+ * Charges the running task's time slice and requests a reschedule
+ * when it runs out; the boot CPU also advances the tick count
+ * 
+ * @param ticks      Ticks covered by this interrupt (more than one
+ *                   after tickless idle)
+ */
+void scheduler_tick(uint32_t ticks);
+
+/**
+ * Pick the task to run next
+ * Called from the timer interrupt after scheduler_tick(). Keeps the
+ * current task unless its slice expired, it blocked, or a higher
+ * priority task woke up.
+ * 
+ * @return           Task to run, or NULL if none is registered
+ */
+task_t* scheduler_schedule(void);
+
+/**
+ * Called once the CPU runs on the stack scheduler_schedule() picked
+ * The task switched away from may now be stolen or migrated.
+ * 
+ * @return           1 if the task switched away from had exited
+ */
+int scheduler_finish_switch(void);
+
+/**
+ * Is a task's stack in use by some CPU?
+ * A task stays on its CPU until the switch away from it has completed,
+ * well after that CPU has moved on to the next task.
+ * 
+ * @param task       Task to check
+ * @return           1 if running or still switching out, 0 otherwise
  */
-void scheduler_tick(void);
+int scheduler_task_on_cpu(task_t* task);
 
 /**
  * Get current timer ticks
@@ -193,15 +329,15 @@ void scheduler_tick(void);
 uint64_t scheduler_get_ticks(void);
 
 /**
- * Convert ticks to milliseconds
+ * Convert ticks to milliseconds (at TIMER_HZ)
  * 
  * @param ticks      Timer ticks
- * @return           Milliseconds
+ * @return           Milliseconds, saturated at 0xFFFFFFFF
  */
 uint32_t scheduler_ticks_to_ms(uint64_t ticks);
 
 /**
- * Convert milliseconds to ticks
+ * Convert milliseconds to ticks (at TIMER_HZ, rounded down)
  * 
  * @param ms         Milliseconds
  * @return           Timer ticks
@@ -0,0 +1,93 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "task.h"
+
+/**
+ * Symmetric Multiprocessing
+ *
+ * smp_init() wakes the application processors (APs) with an INIT-SIPI-SIPI
+ * broadcast from the local APIC. Each AP runs a real-mode trampoline
+ * copied to SMP_TRAMPOLINE_ADDR, enters protected mode with paging on the
+ * kernel directory, and lands in smp_ap_main() on its own kstack. There
+ * it loads the shared GDT/IDT, its own TSS, and starts a LAPIC timer that
+ * drives its scheduler run queue; its boot context stays on as the CPU's
+ * idle task.
+ *
+ * The boot CPU keeps the PIT: it alone advances the timer wheel and the
+ * global tick count.
+ *
+ * The CPU a piece of code runs on is found from its task register: every
+ * CPU loads a different TSS selector, and str does not trap under
+ * virtualisation the way an APIC ID read can.
+ */
+
+#define SMP_MAX_CPUS        8
+#define SMP_TRAMPOLINE_ADDR 0x8000      /* Real-mode entry, page aligned, < 1MB */
+#define SMP_BOOT_TIMEOUT_MS 200         /* Wait for APs to check in */
+
+/* GDT selectors of the per-CPU TSSes (CPU 0 keeps the original one) */
+#define SMP_BSP_TSS_SEL     0x28
+#define SMP_AP_TSS_ENTRY(cpu) (6 + (cpu))
+
+/* Per-CPU state */
+typedef struct cpu {
+    uint32_t index;             /* Logical CPU number, 0 = boot CPU */
+    uint32_t apic_id;           /* Local APIC ID */
+    volatile uint8_t online;    /* Running its scheduler */
+    uint8_t started;            /* Has the first task switch happened? */
+    task_t* current_task;       /* Task running on this CPU */
+    task_t* idle_task;          /* Boot context of the CPU */
+    void* boot_stack;           /* kstack of the AP boot context */
+    uint32_t ticks;             /* Local timer interrupts */
+    uint64_t switch_start;      /* TSC of the pending switch decision, 0 = none */
+} cpu_t;
+
+extern cpu_t g_cpus[SMP_MAX_CPUS];
+
+/**
+ * Index of the calling CPU
+ *
+ * @return           0 .. SMP_MAX_CPUS - 1
+ */
+static inline uint32_t smp_cpu_id(void) {
+    uint16_t sel;
+    asm volatile("str %0" : "=r"(sel));
+    /* No TSS loaded yet (early boot) reads as 0 */
+    return sel <= SMP_BSP_TSS_SEL ? 0 : (sel >> 3) - 6;
+}
+
+/**
+ * State of the calling CPU
+ */
+static inline cpu_t* smp_this_cpu(void) {
+    return &g_cpus[smp_cpu_id()];
+}
+
+/* ============== Public API ============== */
+
+/**
+ * Start the application processors
+ * Needs lapic_init(), the clock, the scheduler and task_init().
+ *
+ * @return           Number of CPUs online, the boot CPU included
+ */
+uint32_t smp_init(void);
+
+/**
+ * Get the number of CPUs online
+ *
+ * @return           1 when only the boot CPU runs
+ */
+uint32_t smp_cpu_count(void);
+
+/**
+ * C entry of an AP (called from the trampoline on its boot stack)
+ *
+ * @param index      Logical CPU number claimed by the AP
+ */
+void smp_ap_main(uint32_t index);
+
+#endif /* SMP_H */
@@ -0,0 +1,193 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Spinlocks
+ *
+ * spinlock_t is a test-and-test-and-set lock: cheapest when uncontended,
+ * but waiters race for it. ticket_lock_t hands the lock out in arrival
+ * order, so no CPU starves under heavy contention (the scheduler's run
+ * queues). Both busy-wait and must only be held for short sections.
+ *
+ * Data also touched from interrupt handlers must use the _irqsave
+ * variants: they disable interrupts on the local CPU before spinning and
+ * restore the previous state on unlock, so an IRQ can never spin on a
+ * lock its own CPU holds.
+ *
+ * A lock may carry a lock_stats_t (registered by name when the lock is
+ * initialized) counting acquisitions, contended acquisitions and spin
+ * iterations, with a histogram of hold times in TSC cycles. Locks
+ * without one pay a single branch.
+ */
+
+/* Hold time histogram: bucket i counts holds shorter than 64 << 2i
+ * cycles; the last bucket takes everything longer */
+#define LOCK_HOLD_BUCKETS   8
+#define LOCK_HOLD_BASE      64
+
+/* Contention statistics of one lock */
+typedef struct lock_stats {
+    const char* name;
+    uint32_t acquisitions;
+    uint32_t contended;         /* Acquisitions that found the lock taken */
+    uint32_t spins;             /* Wait loop iterations */
+    uint32_t hold_max;          /* Longest hold, TSC cycles */
+    uint32_t hold_hist[LOCK_HOLD_BUCKETS];
+    struct lock_stats* next;    /* Registry of all lock_stats */
+} lock_stats_t;
+
+/* Test-and-set spinlock */
+typedef struct {
+    volatile uint32_t locked;
+    uint32_t hold_start;        /* TSC (low word) at acquisition */
+    lock_stats_t* stats;        /* NULL = no statistics */
+} spinlock_t;
+
+/* FIFO ticket lock */
+typedef struct {
+    volatile uint16_t next;     /* Next ticket to hand out */
+    volatile uint16_t owner;    /* Ticket being served */
+    uint32_t hold_start;
+    lock_stats_t* stats;
+} ticket_lock_t;
+
+/* Static initializers (no statistics) */
+#define SPINLOCK_INIT       { 0, 0, NULL }
+#define TICKET_LOCK_INIT    { 0, 0, 0, NULL }
+
+/* ============== Public API ============== */
+
+/**
+ * Initialize a spinlock
+ *
+ * @param lock       Lock to set up (unlocked)
+ * @param name       Name for the statistics registry
+ * @param stats      Statistics to keep, or NULL for none
+ */
+void spin_init(spinlock_t* lock, const char* name, lock_stats_t* stats);
+
+/**
+ * Acquire a spinlock, spinning until it is free
+ *
+ * @param lock       Lock to take
+ */
+void spin_lock(spinlock_t* lock);
+
+/**
+ * Try to acquire a spinlock without spinning
+ *
+ * @param lock       Lock to take
+ * @return           1 if acquired, 0 if it was held
+ */
+int spin_trylock(spinlock_t* lock);
+
+/**
+ * Release a spinlock
+ *
+ * @param lock       Lock held by the caller
+ */
+void spin_unlock(spinlock_t* lock);
+
+/**
+ * Disable local interrupts, then acquire a spinlock
+ *
+ * @param lock       Lock to take
+ * @return           Saved EFLAGS for spin_unlock_irqrestore()
+ */
+uint32_t spin_lock_irqsave(spinlock_t* lock);
+
+/**
+ * Release a spinlock and restore the interrupt state
+ *
+ * @param lock       Lock held by the caller
+ * @param flags      Value returned by spin_lock_irqsave()
+ */
+void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags);
+
+/**
+ * Initialize a ticket lock
+ *
+ * @param lock       Lock to set up (unlocked)
+ * @param name       Name for the statistics registry
+ * @param stats      Statistics to keep, or NULL for none
+ */
+void ticket_init(ticket_lock_t* lock, const char* name, lock_stats_t* stats);
+
+/**
+ * Take a ticket and wait for it to be served
+ *
+ * @param lock       Lock to take
+ */
+void ticket_lock(ticket_lock_t* lock);
+
+/**
+ * Serve the next ticket
+ *
+ * @param lock       Lock held by the caller
+ */
+void ticket_unlock(ticket_lock_t* lock);
+
+/**
+ * Disable local interrupts, then take a ticket lock
+ *
+ * @param lock       Lock to take
+ * @return           Saved EFLAGS for ticket_unlock_irqrestore()
+ */
+uint32_t ticket_lock_irqsave(ticket_lock_t* lock);
+
+/**
+ * Release a ticket lock and restore the interrupt state
+ *
+ * @param lock       Lock held by the caller
+ * @param flags      Value returned by ticket_lock_irqsave()
+ */
+void ticket_unlock_irqrestore(ticket_lock_t* lock, uint32_t flags);
+
+/**
+ * Disable interrupts on the calling CPU
+ * Enough on its own for per-CPU data: nothing else can run here.
+ *
+ * @return           Saved EFLAGS for local_irq_restore()
+ */
+uint32_t local_irq_save(void);
+
+/**
+ * Restore the interrupt state saved by local_irq_save()
+ *
+ * @param flags      Value returned by local_irq_save()
+ */
+void local_irq_restore(uint32_t flags);
+
+/**
+ * Add statistics to the registry (done by the *_init functions)
+ *
+ * @param stats      Statistics to register; counters are cleared
+ * @param name       Lock name
+ */
+void lock_stats_register(lock_stats_t* stats, const char* name);
+
+/**
+ * Fold one hold time into a lock's statistics
+ * Called by the lock implementations on release.
+ *
+ * @param stats      Lock statistics
+ * @param cycles     TSC cycles the lock was held
+ */
+void lock_stats_hold(lock_stats_t* stats, uint32_t cycles);
+
+/**
+ * Get the registered lock statistics
+ *
+ * @return           First entry; follow ->next for the rest
+ */
+lock_stats_t* lock_stats_list(void);
+
+/**
+ * Print every registered lock's statistics to the debug console
+ */
+void lock_stats_dump(void);
+
+#endif /* SPINLOCK_H */
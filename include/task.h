@@ -3,12 +3,16 @@
 
 #include "types.h"
 
+// Software interrupt a task raises to switch away at once (kernel only)
+#define TASK_SWITCH_VECTOR 0x81
+
 // Task states
 typedef enum {
     TASK_READY,
     TASK_RUNNING,
     TASK_BLOCKED,
-    TASK_WAITING    // Waiting for IPC message (Step 5)
+    TASK_WAITING,   // Waiting for IPC message (Step 5)
+    TASK_ZOMBIE     // Exited, waiting to be freed
 } task_state_t;
 
 // Minimum viable task structure
@@ -21,12 +25,38 @@ typedef struct task {
     void* process;    // Pointer to parent process (opaque to avoid circular dependency)
     struct task* next; // Next task in circular list
     void* sched_data; // Scheduler-private data (pointer to sched_task_t)
+    void* stack;      // Base of the kstack_alloc() stack (NULL for the boot task)
+    uint8* fpu_state; // 16-byte aligned FXSAVE area, filled lazily (see fpu.c)
+    uint8 fpu_used;   // Has the task touched the FPU/SSE yet?
 } task_t;
 
+// Context switch statistics (cycles are TSC cycles from the scheduling
+// decision up to task_switch_done() on the new task's stack, just before
+// its registers are restored)
+typedef struct {
+    uint32 switches;      // Task switches performed
+    uint32 cr3_switches;  // Switches that loaded another address space
+    uint32 cr3_skipped;   // Switches that kept the loaded one
+    uint32 cycles_last;
+    uint32 cycles_avg;    // Running average (1/8 weight)
+    uint32 cycles_max;
+} task_switch_stats_t;
+
 // Task management functions
 void task_init(void);
+int task_init_cpu(void);
 task_t* task_create(void (*entry_point)(void));
+task_t* task_create_with_stack(void (*entry_point)(void), uint32 stack_size);
+int task_destroy(task_t* task);
+void task_exit(void);
 task_t* task_get_current(void);
 uint32 task_scheduler_tick(uint32 current_esp);
+uint32 task_ap_tick(uint32 current_esp);
+void task_switch_done(void);
+uint32 task_switch_now(uint32 current_esp);
+void task_switch(void);
+void task_block(task_t* task, task_state_t state);
+void task_wake(task_t* task);
+void task_get_switch_stats(task_switch_stats_t* stats);
 
 #endif
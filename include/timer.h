@@ -0,0 +1,122 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Kernel Timers
+ *
+ * One-shot and periodic callbacks on a hierarchical timer wheel driven
+ * by the timer IRQ. Four levels of 64 slots cover 2^24 ticks (~46 hours
+ * at 100Hz); a tick only touches the timers that expire in it, plus an
+ * occasional cascade of one slot from a higher level.
+ *
+ * Callbacks run in interrupt context with interrupts disabled: they
+ * must not block. The wheel is spinlocked, so timers may be armed and
+ * cancelled from any CPU; the lock is not held across a callback.
+ */
+
+/* Wheel geometry */
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_MAX_DELAY     ((1u << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+/* Timer tick rate (PIT programmed by clock_init) */
+#define TIMER_HZ            100
+
+typedef void (*ktimer_fn_t)(void* data);
+
+/* Kernel timer (embed in the owning structure; no allocation) */
+typedef struct ktimer {
+    uint64_t expires;           /* Absolute tick to fire at */
+    uint32_t period;            /* Re-arm interval in ticks, 0 = one-shot */
+    ktimer_fn_t fn;             /* Callback */
+    void* data;                 /* Callback argument */
+    struct ktimer* next;        /* Wheel slot list */
+    struct ktimer** pprev;      /* Link pointing at this timer */
+    uint8_t pending;            /* Is the timer on the wheel? */
+} ktimer_t;
+
+/* Timer statistics */
+typedef struct {
+    uint32_t pending;           /* Timers currently armed */
+    uint32_t fired;             /* Callbacks run */
+    uint32_t cascaded;          /* Timers moved down a level */
+    uint64_t ticks;             /* Wheel clock */
+} timer_stats_t;
+
+/* ============== Public API ============== */
+
+/**
+ * Initialize the timer wheel
+ */
+void timer_init(void);
+
+/**
+ * Advance the wheel by one tick and run expired timers
+ * Called from the timer IRQ
+ */
+void timer_tick(void);
+
+/**
+ * Count the ticks that can pass without running a timer
+ * Used by tickless idle to decide how long to sleep.
+ *
+ * @param limit      Largest answer wanted
+ * @return           Ticks up to and including the next one with work
+ *                   (1 = next tick is busy), at most limit
+ */
+uint32_t timer_idle_ticks(uint32_t limit);
+
+/**
+ * Get the wheel clock
+ *
+ * @return           Ticks since timer_init()
+ */
+uint64_t timer_get_ticks(void);
+
+/**
+ * Get timer statistics
+ *
+ * @param stats      Pointer to timer_stats_t to fill
+ */
+void timer_get_stats(timer_stats_t* stats);
+
+/**
+ * Prepare a timer for use
+ *
+ * @param timer      Timer to set up
+ * @param fn         Callback to run on expiry
+ * @param data       Argument passed to fn
+ */
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* data);
+
+/**
+ * Arm (or re-arm) a timer
+ *
+ * @param timer      Timer to arm
+ * @param delay      Ticks until the first expiry (0 = next tick)
+ * @param period     Ticks between later expiries, 0 for one-shot
+ */
+void ktimer_start(ktimer_t* timer, uint32_t delay, uint32_t period);
+
+/**
+ * Disarm a timer
+ *
+ * @param timer      Timer to cancel
+ * @return           1 if it was pending, 0 otherwise
+ */
+int ktimer_cancel(ktimer_t* timer);
+
+/**
+ * Check whether a timer is armed
+ *
+ * @param timer      Timer to check
+ * @return           1 if pending, 0 otherwise
+ */
+int ktimer_pending(ktimer_t* timer);
+
+#endif /* TIMER_H */
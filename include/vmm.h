@@ -33,6 +33,11 @@
 #define VMM_FLAG_GLOBAL     0x100
 #define VMM_FLAG_COW        0x200   /* Custom: Copy-on-write */
 
+/* Page fault error code bits */
+#define VMM_FAULT_PRESENT   0x1     /* Protection fault (page was present) */
+#define VMM_FAULT_WRITE     0x2     /* Faulting access was a write */
+#define VMM_FAULT_USER      0x4     /* Fault came from ring 3 */
+
 /* Default protection flags */
 #define VMM_PROT_NONE       0
 #define VMM_PROT_READ       VMM_FLAG_PRESENT
@@ -58,16 +63,37 @@ typedef struct vma {
     uint32_t end;           /* End virtual address (exclusive) */
     uint32_t flags;         /* Protection flags */
     vma_type_t type;        /* Type of region */
-    struct vma* next;       /* Next VMA in list */
+    struct vma* next;       /* Next VMA in address order */
+    struct vma* left;       /* Address-ordered AVL tree links */
+    struct vma* right;
+    uint32_t gap;           /* Free bytes between the previous VMA and start */
+    uint32_t max_gap;       /* Largest gap in this subtree */
+    uint8_t height;         /* AVL subtree height */
 } vma_t;
 
-/* Page directory structure (1024 entries) */
-typedef struct {
+/* Page directory structure (1024 entries), shared with memory.c
+ * CR3 takes the address of entries[], which must be page aligned; the
+ * fault handlers turn CR3 back into the structure the same way */
+typedef struct page_directory {
     uint32_t entries[1024];
     uint32_t* tables[1024]; /* Virtual addresses of page tables */
-    vma_t* vma_list;        /* List of VMAs for this space */
+    vma_t* vma_list;        /* List of VMAs for this space, sorted */
     uint32_t ref_count;     /* Reference count for sharing */
-} page_directory_t;
+    vma_t* vma_root;        /* Root of the VMA tree */
+} __attribute__((aligned(4096))) page_directory_t;
+
+/* Page frames one directory occupies */
+#define VMM_DIR_FRAMES      ((sizeof(page_directory_t) + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE)
+
+/* TLB flush batching: past this many pages a full flush is cheaper */
+#define VMM_TLB_BATCH_MAX   32
+
+/* Addresses collected during one map/unmap operation */
+typedef struct vmm_tlb_batch {
+    uint32_t addrs[VMM_TLB_BATCH_MAX];
+    uint32_t count;         /* Pages queued (may exceed VMM_TLB_BATCH_MAX) */
+    uint8_t global;         /* A global (kernel) mapping changed */
+} vmm_tlb_batch_t;
 
 /* VMM statistics */
 typedef struct {
@@ -75,6 +101,12 @@ typedef struct {
     uint32_t user_pages;        /* User-space pages */
     uint32_t kernel_pages;      /* Kernel pages */
     uint32_t vma_count;         /* Number of VMAs */
+    uint32_t lazy_pages;        /* Pages reserved in anonymous VMAs */
+    uint32_t demand_faults;     /* Faults resolved from a VMA */
+    uint32_t zero_maps;         /* Read faults served by the zero page */
+    uint32_t tlb_page_flushes;  /* Single-page invlpg flushes */
+    uint32_t tlb_full_flushes;  /* Whole-TLB flushes */
+    uint32_t tlb_shootdowns;    /* Flushes sent to the other CPUs */
     uint8_t initialized;        /* Is VMM initialized? */
 } vmm_stats_t;
 
@@ -88,6 +120,21 @@ typedef struct {
  */
 int vmm_init(void);
 
+/**
+ * Allocate a zeroed, page-aligned page directory from the PMM
+ * kmalloc() cannot be used: its blocks are not page aligned.
+ * 
+ * @return           Pointer to the directory, or NULL if out of frames
+ */
+page_directory_t* vmm_alloc_directory(void);
+
+/**
+ * Free a directory from vmm_alloc_directory() (not what it maps)
+ * 
+ * @param dir        Page directory to free
+ */
+void vmm_free_directory(page_directory_t* dir);
+
 /**
  * Create a new page directory
  * Copies kernel mappings to new directory
@@ -168,6 +215,8 @@ int vmm_alloc_page(page_directory_t* dir, uint32_t virt, uint32_t flags);
 
 /**
  * Allocate and map a range of pages
+ * Ranges inside an anonymous (data, heap, stack) VMA are only reserved;
+ * frames are faulted in on first touch by vmm_handle_fault().
  * 
  * @param dir        Page directory (NULL = current)
  * @param virt       Start virtual address
@@ -186,10 +235,58 @@ int vmm_alloc_pages(page_directory_t* dir, uint32_t virt, uint32_t count, uint32
  */
 void vmm_free_pages(page_directory_t* dir, uint32_t virt, uint32_t count);
 
+/* ============== TLB Management ============== */
+
+/**
+ * Start collecting addresses whose translations must be flushed
+ * 
+ * @param batch      Batch to reset
+ */
+void vmm_tlb_batch_init(vmm_tlb_batch_t* batch);
+
+/**
+ * Queue a page for invalidation
+ * 
+ * @param batch      Batch to add to
+ * @param virt       Virtual address whose mapping changed
+ * @param global     Non-zero if the old mapping was global
+ */
+void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uint32_t virt, int global);
+
+/**
+ * Invalidate everything queued: invlpg each page, or one full flush
+ * when more than VMM_TLB_BATCH_MAX pages were queued
+ * 
+ * @param batch      Batch to flush (left empty)
+ */
+void vmm_tlb_batch_flush(vmm_tlb_batch_t* batch);
+
+/**
+ * Invalidate everything queued on every online CPU
+ * The other CPUs are interrupted and waited for, so call with
+ * interrupts enabled and no spinlock held.
+ * 
+ * @param batch      Batch to flush (left empty)
+ */
+void vmm_tlb_shootdown(vmm_tlb_batch_t* batch);
+
+/**
+ * Handle a shootdown sent by vmm_tlb_shootdown() (LAPIC_TLB_VECTOR)
+ */
+void vmm_tlb_shootdown_ipi(void);
+
+/**
+ * Flush the whole TLB
+ * 
+ * @param global     Non-zero to drop global (kernel) entries too
+ */
+void vmm_tlb_flush_all(int global);
+
 /* ============== VMA Management ============== */
 
 /**
  * Create a VMA in a page directory
+ * Fails if the region overlaps an existing VMA.
  * 
  * @param dir        Page directory
  * @param start      Start virtual address
@@ -202,7 +299,28 @@ vma_t* vmm_create_vma(page_directory_t* dir, uint32_t start, uint32_t size,
                       uint32_t flags, vma_type_t type);
 
 /**
- * Find a free region of the given size
+ * Find the VMA containing an address
+ * 
+ * @param dir        Page directory
+ * @param addr       Virtual address
+ * @return           Pointer to VMA, or NULL if none
+ */
+vma_t* vmm_find_vma(page_directory_t* dir, uint32_t addr);
+
+/**
+ * Resolve a not-present fault in an anonymous VMA of the current
+ * directory. Reads map the shared zero page copy-on-write, writes get a
+ * fresh zeroed frame.
+ * 
+ * @param addr       Faulting address (CR2)
+ * @param err_code   Page fault error code
+ * @return           0 if resolved, -1 if the fault is a real error
+ */
+int vmm_handle_fault(uint32_t addr, uint32_t err_code);
+
+/**
+ * Find the lowest free region of the given size above mapped RAM
+ * Uses the per-subtree gap sizes, so no page tables are walked.
  * 
  * @param dir        Page directory
  * @param size       Size in bytes
@@ -0,0 +1,95 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Deferred Work Queues
+ *
+ * Bottom halves for interrupt handlers: an IRQ does the minimum (read
+ * the device, queue a work item) and a pool of kernel worker tasks runs
+ * the rest with interrupts enabled. There is one FIFO per priority,
+ * each drained by its own workers running at a matching scheduler
+ * priority, so urgent input work is not stuck behind slow jobs.
+ *
+ * Work functions run in task context and may take their time, but they
+ * should not block forever: that ties up a worker.
+ */
+
+/* Work priorities */
+typedef enum {
+    WORK_PRIO_HIGH = 0,         /* Input dispatch, short latency-sensitive jobs */
+    WORK_PRIO_NORMAL,           /* Redraws, packet processing */
+    WORK_PRIO_LOW,              /* Housekeeping */
+    WORK_PRIO_COUNT
+} work_prio_t;
+
+/* Workers per priority queue */
+#define WORK_WORKERS_PER_QUEUE  2
+
+typedef void (*work_fn_t)(void* data);
+
+/* Work item (embed in the owning structure; no allocation) */
+typedef struct work {
+    work_fn_t fn;               /* Function to run */
+    void* data;                 /* Argument passed to fn */
+    struct work* next;          /* Queue link */
+    uint8_t pending;            /* Queued and not yet started? */
+    uint8_t prio;               /* Queue it is on while pending */
+} work_t;
+
+/* Work queue statistics */
+typedef struct {
+    uint32_t queued;            /* Items accepted by work_queue() */
+    uint32_t merged;            /* Items already pending when queued again */
+    uint32_t completed;         /* Work functions run */
+    uint32_t depth_max;         /* Longest queue seen */
+    uint32_t workers;           /* Worker tasks created */
+} work_stats_t;
+
+/* ============== Public API ============== */
+
+/**
+ * Create the worker pool
+ * Needs the scheduler and task system to be initialized.
+ *
+ * @return           0 on success, -1 if no worker could be created
+ */
+int workqueue_init(void);
+
+/**
+ * Prepare a work item for use
+ *
+ * @param work       Work item to set up
+ * @param fn         Function to run
+ * @param data       Argument passed to fn
+ */
+void work_init(work_t* work, work_fn_t fn, void* data);
+
+/**
+ * Queue a work item; safe from interrupt context
+ * An item that is already pending is not queued twice.
+ *
+ * @param work       Work item
+ * @param prio       Queue to put it on
+ * @return           1 if queued, 0 if it was already pending
+ */
+int work_queue(work_t* work, work_prio_t prio);
+
+/**
+ * Remove a work item that has not started yet
+ *
+ * @param work       Work item
+ * @return           1 if it was pending, 0 otherwise
+ */
+int work_cancel(work_t* work);
+
+/**
+ * Get work queue statistics
+ *
+ * @param stats      Pointer to work_stats_t to fill
+ */
+void workqueue_get_stats(work_stats_t* stats);
+
+#endif /* WORKQUEUE_H */
@@ -0,0 +1,170 @@
+#include "fpu.h"
+#include "kheap.h"
+#include "smp.h"
+#include "video.h"
+
+#define CR0_MP  0x02    // Monitor coprocessor: wait/fwait honour TS
+#define CR0_EM  0x04    // Emulation: must be clear for FPU/SSE
+#define CR0_TS  0x08    // Task switched: next FPU/SSE use raises #NM
+#define CR0_NE  0x20    // Native FPU error reporting
+
+#define CR4_OSFXSR      0x200   // FXSAVE/FXRSTOR and SSE enabled
+#define CR4_OSXMMEXCPT  0x400   // Unmasked SSE exceptions raise #XM
+
+#define CPUID_FXSR  (1 << 24)
+#define CPUID_SSE   (1 << 25)
+
+#define MXCSR_DEFAULT 0x1F80
+
+static struct {
+    int fxsr;
+    int sse;
+    task_t* owner[SMP_MAX_CPUS];    // Task whose state is in each CPU's registers
+} g_fpu;
+
+// Clean state handed to a task on its first FPU instruction
+static uint8 fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static inline void clts(void) {
+    asm volatile("clts");
+}
+
+static inline void stts(void) {
+    uint32 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS) : "memory");
+}
+
+static inline void fpu_save(uint8* area) {
+    if (g_fpu.fxsr)
+        asm volatile("fxsave (%0)" : : "r"(area) : "memory");
+    else
+        asm volatile("fnsave (%0)" : : "r"(area) : "memory");
+}
+
+static inline void fpu_restore(const uint8* area) {
+    if (g_fpu.fxsr)
+        asm volatile("fxrstor (%0)" : : "r"(area) : "memory");
+    else
+        asm volatile("frstor (%0)" : : "r"(area) : "memory");
+}
+
+
+void fpu_init(void) {
+    uint32 eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    g_fpu.fxsr = (edx & CPUID_FXSR) != 0;
+    g_fpu.sse = g_fpu.fxsr && (edx & CPUID_SSE);
+
+    fpu_init_cpu();
+
+    // The clean image is taken once; clts for the save, then trap again
+    clts();
+    fpu_save(fpu_initial_state);
+    stts();
+
+    debug_print("FPU: lazy switching, ");
+    debug_print(g_fpu.sse ? "SSE/FXSAVE\n" : (g_fpu.fxsr ? "FXSAVE\n" : "x87 FNSAVE\n"));
+}
+
+
+void fpu_init_cpu(void) {
+    g_fpu.owner[smp_cpu_id()] = NULL;
+
+    uint32 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+
+    if (g_fpu.fxsr) {
+        uint32 cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if (g_fpu.sse)
+            cr4 |= CR4_OSXMMEXCPT;
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+
+    asm volatile("fninit");
+    if (g_fpu.sse) {
+        uint32 mxcsr = MXCSR_DEFAULT;
+        asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+    }
+
+    // From here on nobody owns this CPU's registers; first use traps
+    stts();
+}
+
+
+int fpu_task_init(task_t* task, void* area) {
+    if (!area) {
+        // Over-allocate so the save area can be aligned for FXSAVE
+        uint8* raw = (uint8*)kmalloc(FPU_STATE_SIZE + FPU_STATE_ALIGN - 1);
+        if (!raw)
+            return -1;
+        area = (void*)(((uint32)raw + FPU_STATE_ALIGN - 1) & ~(FPU_STATE_ALIGN - 1));
+    }
+
+    task->fpu_state = (uint8*)area;
+    task->fpu_used = 0;
+    return 0;
+}
+
+
+void fpu_task_switched(task_t* next) {
+    if (next && next == g_fpu.owner[smp_cpu_id()])
+        clts();
+    else
+        stts();
+}
+
+
+void fpu_task_save(task_t* task) {
+    uint32 cpu = smp_cpu_id();
+    if (!task || g_fpu.owner[cpu] != task)
+        return;
+
+    clts();
+    fpu_save(task->fpu_state);
+    g_fpu.owner[cpu] = NULL;
+    stts();
+}
+
+
+void fpu_task_exit(task_t* task) {
+    if (!task)
+        return;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (g_fpu.owner[i] == task)
+            g_fpu.owner[i] = NULL;
+    }
+}
+
+
+void fpu_handle_nm(void) {
+    task_t* current = task_get_current();
+    task_t** owner = &g_fpu.owner[smp_cpu_id()];
+    clts();
+
+    if (*owner == current)
+        return;
+
+    // fnsave reinitialises the FPU, which is fine: a restore follows
+    if (*owner)
+        fpu_save((*owner)->fpu_state);
+
+    if (current && current->fpu_state) {
+        fpu_restore(current->fpu_used ? current->fpu_state : fpu_initial_state);
+        current->fpu_used = 1;
+        *owner = current;
+    } else {
+        // Not in a task (boot path): start clean, owned by no one
+        fpu_restore(fpu_initial_state);
+        *owner = NULL;
+    }
+}
+
+
+int fpu_has_sse(void) {
+    return g_fpu.sse;
+}
@@ -1,9 +1,16 @@
 #include "gdt.h"
 #include "string.h"
+#include "idt.h"
+#include "isr.h"
+
+#define DOUBLE_FAULT_STACK_SIZE 4096
 
 GDT g_gdt[NO_GDT_DESCRIPTORS];
 GDT_PTR g_gdt_ptr;
 TSS g_tss;
+TSS g_df_tss;
+static TSS g_ap_tss[SMP_MAX_CPUS];
+static uint8 g_df_stack[DOUBLE_FAULT_STACK_SIZE] __attribute__((aligned(16)));
 
 void gdt_set_entry(int index, uint32 base, uint32 limit, uint8 access, uint8 gran) {
     GDT *this = &g_gdt[index];
@@ -56,4 +63,44 @@ void tss_init(uint32 kernel_ss, uint32 kernel_esp) {
     
     // Load TSS
     tss_flush();
+
+    // Double faults switch to their own TSS and stack, so a kernel stack
+    // overflow is reported instead of escalating to a triple fault
+    memset(&g_df_tss, 0, sizeof(TSS));
+    uint32 cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    g_df_tss.cr3 = cr3;
+    g_df_tss.eip = (uint32)double_fault_task;
+    g_df_tss.eflags = 0x2;   // Interrupts off
+    g_df_tss.esp = (uint32)g_df_stack + DOUBLE_FAULT_STACK_SIZE;
+    g_df_tss.cs = 0x08;
+    g_df_tss.ss = 0x10;
+    g_df_tss.ds = 0x10;
+    g_df_tss.es = 0x10;
+    g_df_tss.fs = 0x10;
+    g_df_tss.gs = 0x10;
+    g_df_tss.iomap_base = sizeof(TSS);
+    gdt_set_entry(6, (uint32)&g_df_tss, sizeof(TSS), 0x89, 0x00);
+
+    // Task gate (type 5) selecting GDT entry 6
+    idt_set_entry(8, 0, 0x30, 0x85);
+}
+
+// An AP's own TSS; loading it is also what smp_cpu_id() reads back
+void tss_init_cpu(uint32 cpu, uint32 kernel_esp) {
+    TSS* tss = &g_ap_tss[cpu];
+    memset(tss, 0, sizeof(TSS));
+    tss->ss0 = 0x10;
+    tss->esp0 = kernel_esp;
+    tss->cs = 0x08;
+    tss->ss = 0x10;
+    tss->ds = 0x10;
+    tss->es = 0x10;
+    tss->fs = 0x10;
+    tss->gs = 0x10;
+    tss->iomap_base = sizeof(TSS);
+
+    int entry = SMP_AP_TSS_ENTRY(cpu);
+    gdt_set_entry(entry, (uint32)tss, sizeof(TSS), 0x89, 0x00);
+    asm volatile("ltr %0" : : "r"((uint16)(entry << 3)));
 }
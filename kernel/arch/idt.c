@@ -1,6 +1,7 @@
 #include "idt.h"
 #include "isr.h"
 #include "8259_pic.h"
+#include "task.h"
 
 IDT g_idt[NO_IDT_DESCRIPTORS];
 IDT_PTR g_idt_ptr;
@@ -69,6 +70,7 @@ void idt_init() {
     idt_set_entry(46, (uint32)irq_14, 0x08, 0x8E);
     idt_set_entry(47, (uint32)irq_15, 0x08, 0x8E);
     idt_set_entry(128, (uint32)syscall_int_0x80, 0x08, 0xEE); // DPL=3 for user mode access
+    idt_set_entry(TASK_SWITCH_VECTOR, (uint32)task_switch_int, 0x08, 0x8E); // Kernel only
 
     load_idt((uint32)&g_idt_ptr);
     // Interrupts will be enabled explicitly after all handlers are registered
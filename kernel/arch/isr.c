@@ -4,6 +4,11 @@
 #include "8259_pic.h"
 #include "video.h"
 #include "kernel.h"
+#include "memory.h"
+#include "vmm.h"
+#include "fpu.h"
+#include "kstack.h"
+#include "gdt.h"
 
 
 ISR g_interrupt_handlers[NO_INTERRUPT_HANDLERS];
@@ -81,6 +86,27 @@ void page_fault_handler(REGISTERS *reg) {
     // Read CR2 to get the address that caused the fault
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
     
+    // Writes to copy-on-write pages are expected; copy and retry
+    if (memory_handle_cow_fault(faulting_address, reg->err_code) == 0) {
+        return;
+    }
+    
+    // Untouched pages of anonymous VMAs are filled in on demand
+    if (vmm_handle_fault(faulting_address, reg->err_code) == 0) {
+        return;
+    }
+    
+    // A task ran off the bottom of its stack into the guard page
+    if (kstack_is_guard(faulting_address)) {
+        print("\n\nKERNEL STACK OVERFLOW\n");
+        print("Address: ");
+        print_hex(faulting_address);
+        print("\nEIP: ");
+        print_hex(reg->eip);
+        print("\n");
+        kernel_panic("Kernel stack overflow");
+    }
+    
     print("\n\nPAGE FAULT\n");
     print("Address: ");
     print_hex(faulting_address);
@@ -116,6 +142,30 @@ void page_fault_handler(REGISTERS *reg) {
     kernel_panic("Page Fault Exception");
 }
 
+// Double fault task (IDT 8 is a task gate, so this runs on its own
+// stack even when the faulting stack is unusable). Overflowing a kernel
+// stack lands here: pushing the page fault frame into the guard page
+// faults again.
+void double_fault_task(void) {
+    uint32 faulting_address;
+    asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
+    
+    print("\n\nEXCEPTION: Double Fault\n");
+    if (kstack_is_guard(faulting_address)) {
+        print("Kernel stack overflow at ");
+        print_hex(faulting_address);
+        print("\n");
+    }
+    // The hardware task switch saved the interrupted state in g_tss
+    print("EIP: ");
+    print_hex(g_tss.eip);
+    print("\nESP: ");
+    print_hex(g_tss.esp);
+    print("\n");
+    
+    kernel_panic("Double Fault");
+}
+
 void isr_exception_handler(REGISTERS reg) {
     // Special handling for page faults (exception 14)
     if (reg.int_no == 14) {
@@ -123,6 +173,12 @@ void isr_exception_handler(REGISTERS reg) {
         return;
     }
     
+    // First FPU/SSE use since a switch (CR0.TS set)
+    if (reg.int_no == 7) {
+        fpu_handle_nm();
+        return;
+    }
+    
     if (reg.int_no < 32) {
         print("\n\nEXCEPTION: ");
         print(exception_messages[reg.int_no]);
@@ -0,0 +1,180 @@
+#include "lapic.h"
+#include "pit.h"
+#include "timer.h"
+#include "clock.h"
+#include "memory.h"
+#include "vmm.h"
+#include "video.h"
+
+#define IA32_APIC_BASE_MSR  0x1B
+#define APIC_BASE_BSP       0x100
+#define APIC_BASE_ENABLE    0x800
+#define CPUID_APIC          (1 << 9)
+
+// Register offsets
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LO        0x300
+#define LAPIC_ICR_HI        0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CUR     0x390
+#define LAPIC_TIMER_DIV     0x3E0
+
+#define SVR_ENABLE          0x100
+#define LVT_MASKED          0x10000
+#define LVT_TIMER_PERIODIC  0x20000
+#define TIMER_DIV_16        0x3
+
+// ICR: delivery mode, level, destination shorthand
+#define ICR_FIXED           0x000
+#define ICR_INIT            0x500
+#define ICR_STARTUP         0x600
+#define ICR_PENDING         0x1000
+#define ICR_ASSERT          0x4000
+#define ICR_ALL_BUT_SELF    0xC0000
+
+static volatile uint32* g_lapic = NULL;
+static uint32 g_timer_count;    // Timer count per TIMER_HZ period
+
+static inline uint32 lapic_read(uint32 reg) {
+    return g_lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32 reg, uint32 value) {
+    g_lapic[reg / 4] = value;
+    (void)g_lapic[LAPIC_ID / 4];    // Read back to post the write
+}
+
+static inline uint64 rdmsr(uint32 msr) {
+    uint32 lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32 msr, uint64 value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32)value), "d"((uint32)(value >> 32)));
+}
+
+static void icr_wait(void) {
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+        asm volatile("pause");
+}
+
+
+int lapic_init(void) {
+    uint32 eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & CPUID_APIC)) {
+        debug_print("LAPIC: not present\n");
+        return -1;
+    }
+
+    uint64 msr = rdmsr(IA32_APIC_BASE_MSR);
+    uint32 base = (uint32)msr & VMM_PAGE_MASK;
+    wrmsr(IA32_APIC_BASE_MSR, msr | APIC_BASE_ENABLE);
+
+    // Identity mapped, uncached; mapped before any address space is
+    // cloned so every directory shares the table
+    map_page_in_directory(get_kernel_page_directory(), base, base,
+                          VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_WRITETHRU |
+                          VMM_FLAG_CACHE_DIS | VMM_FLAG_GLOBAL);
+    g_lapic = (volatile uint32*)base;
+
+    lapic_enable();
+
+    debug_print("LAPIC: base 0x");
+    debug_print_hex(base);
+    debug_print(", boot CPU id ");
+    debug_print_hex(lapic_id());
+    debug_print("\n");
+    return 0;
+}
+
+
+int lapic_present(void) {
+    return g_lapic != NULL;
+}
+
+
+void lapic_enable(void) {
+    if (!g_lapic)
+        return;
+
+    wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    // Only the boot CPU takes PIC interrupts (virtual wire mode)
+    if (!(rdmsr(IA32_APIC_BASE_MSR) & APIC_BASE_BSP))
+        lapic_write(LAPIC_LVT_LINT0, lapic_read(LAPIC_LVT_LINT0) | LVT_MASKED);
+}
+
+
+uint32 lapic_id(void) {
+    return g_lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+
+void lapic_eoi(void) {
+    if (g_lapic)
+        g_lapic[LAPIC_EOI / 4] = 0;
+}
+
+
+void lapic_start_aps(uint8 page) {
+    if (!g_lapic)
+        return;
+
+    lapic_write(LAPIC_ICR_HI, 0);
+    lapic_write(LAPIC_ICR_LO, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_INIT);
+    icr_wait();
+    clock_udelay(10000);
+
+    // The second SIPI covers CPUs that missed the first
+    for (int i = 0; i < 2; i++) {
+        lapic_write(LAPIC_ICR_LO, ICR_ALL_BUT_SELF | ICR_STARTUP | page);
+        icr_wait();
+        clock_udelay(200);
+    }
+}
+
+
+void lapic_send_ipi_others(uint8 vector) {
+    if (!g_lapic)
+        return;
+
+    lapic_write(LAPIC_ICR_HI, 0);
+    lapic_write(LAPIC_ICR_LO, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_FIXED | vector);
+    icr_wait();
+}
+
+
+void lapic_timer_calibrate(void) {
+    if (!g_lapic)
+        return;
+
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    pit_measure_tsc(PIT_BASE_HZ / TIMER_HZ);
+    g_timer_count = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    debug_print("LAPIC: timer count per tick 0x");
+    debug_print_hex(g_timer_count);
+    debug_print("\n");
+}
+
+
+void lapic_timer_start(void) {
+    if (!g_lapic || !g_timer_count)
+        return;
+
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, g_timer_count);
+}
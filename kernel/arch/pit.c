@@ -0,0 +1,52 @@
+#include "pit.h"
+#include "io_ports.h"
+
+
+// Mode bits for the command register: channel, lobyte/hibyte access, mode
+#define PIT_CMD_CH0_RATE    0x34    // Mode 2: rate generator
+#define PIT_CMD_CH0_ONESHOT 0x30    // Mode 0: interrupt on terminal count
+#define PIT_CMD_CH2_ONESHOT 0xB0
+
+static inline uint64 read_tsc(void) {
+    uint32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64)hi << 32) | lo;
+}
+
+
+void pit_set_periodic(uint32 hz) {
+    uint32 divisor = PIT_BASE_HZ / hz;
+    if (divisor > PIT_MAX_COUNT)
+        divisor = PIT_MAX_COUNT;
+
+    outportb(PIT_COMMAND, PIT_CMD_CH0_RATE);
+    outportb(PIT_CHANNEL0, (uint8)(divisor & 0xFF));
+    outportb(PIT_CHANNEL0, (uint8)((divisor >> 8) & 0xFF));
+}
+
+
+void pit_set_oneshot(uint16 count) {
+    outportb(PIT_COMMAND, PIT_CMD_CH0_ONESHOT);
+    outportb(PIT_CHANNEL0, (uint8)(count & 0xFF));
+    outportb(PIT_CHANNEL0, (uint8)((count >> 8) & 0xFF));
+}
+
+
+uint64 pit_measure_tsc(uint16 count) {
+    // Gate channel 2 on with the speaker output disconnected
+    uint8 gate = inportb(PIT_GATE_PORT);
+    outportb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+
+    outportb(PIT_COMMAND, PIT_CMD_CH2_ONESHOT);
+    outportb(PIT_CHANNEL2, (uint8)(count & 0xFF));
+    outportb(PIT_CHANNEL2, (uint8)((count >> 8) & 0xFF));
+
+    // OUT2 (bit 5) goes high at terminal count
+    uint64 start = read_tsc();
+    while (!(inportb(PIT_GATE_PORT) & 0x20))
+        ;
+    uint64 end = read_tsc();
+
+    outportb(PIT_GATE_PORT, gate);
+    return end - start;
+}
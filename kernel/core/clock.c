@@ -0,0 +1,175 @@
+#include "clock.h"
+#include "timer.h"
+#include "pit.h"
+#include "scheduler.h"
+#include "video.h"
+
+/* TSC calibration window: 10ms of PIT cycles */
+#define CALIBRATE_PIT_COUNT (PIT_BASE_HZ / 100)
+#define CALIBRATE_NS        10000000
+
+/* ns = (cycles * mult) >> CLOCK_SHIFT */
+#define CLOCK_SHIFT         24
+
+/* PIT cycles per timer tick */
+#define PIT_TICK_COUNT      (PIT_BASE_HZ / TIMER_HZ)
+
+/* Global clock state */
+static struct {
+    const clock_event_t* event;     /* Active clock event device */
+    uint64_t tsc_base;              /* TSC at clock_init() */
+    uint64_t last_tick_tsc;         /* TSC at the last accounted tick */
+    uint32_t cycles_per_tick;       /* TSC cycles per timer tick */
+    uint32_t mult;                  /* TSC to ns multiplier */
+    uint32_t oneshot_ticks;         /* Programmed one-shot length, 0 = periodic */
+    clock_stats_t stats;
+} g_clock;
+
+static inline uint64_t read_tsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* 64-by-32 division without libgcc: two divl steps */
+static uint64_t div_u64_u32(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo;
+    asm("divl %2" : "=a"(q_lo), "+d"(r) : "rm"(d), "a"(lo));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+/* (a * mul) >> shift with a 96-bit intermediate */
+static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, uint32_t shift) {
+    uint64_t lo = (uint64_t)(uint32_t)a * mul;
+    uint64_t hi = (uint64_t)(uint32_t)(a >> 32) * mul;
+    return (lo >> shift) + (hi << (32 - shift));
+}
+
+/* ============== PIT clock event ============== */
+
+static void pit_event_periodic(void) {
+    pit_set_periodic(TIMER_HZ);
+}
+
+static void pit_event_oneshot(uint32_t ticks) {
+    pit_set_oneshot((uint16)(ticks * PIT_TICK_COUNT));
+}
+
+static const clock_event_t pit_clock_event = {
+    .name = "pit",
+    .max_oneshot = PIT_MAX_COUNT / PIT_TICK_COUNT,
+    .set_periodic = pit_event_periodic,
+    .set_oneshot = pit_event_oneshot,
+};
+
+/* ============== Public API ============== */
+
+int clock_init(void) {
+    if (g_clock.stats.initialized) {
+        return 0;
+    }
+
+    uint64_t cycles = pit_measure_tsc(CALIBRATE_PIT_COUNT);
+    if (cycles == 0 || cycles > 0xFFFFFFFFull) {
+        debug_print("Clock: TSC calibration failed\n");
+        return -1;
+    }
+
+    g_clock.stats.tsc_khz = (uint32_t)cycles / (CALIBRATE_NS / 1000000);
+    g_clock.cycles_per_tick = (uint32_t)div_u64_u32(cycles * 100, TIMER_HZ);
+    g_clock.mult = (uint32_t)div_u64_u32((uint64_t)CALIBRATE_NS << CLOCK_SHIFT, (uint32_t)cycles);
+    g_clock.tsc_base = read_tsc();
+    g_clock.last_tick_tsc = g_clock.tsc_base;
+
+    g_clock.event = &pit_clock_event;
+    g_clock.event->set_periodic();
+    g_clock.oneshot_ticks = 0;
+    g_clock.stats.initialized = 1;
+
+    debug_print("Clock: TSC ");
+    debug_print_hex(g_clock.stats.tsc_khz);
+    debug_print(" kHz, timer via ");
+    debug_print(g_clock.event->name);
+    debug_print("\n");
+
+    return 0;
+}
+
+uint32_t clock_event_elapsed(void) {
+    if (!g_clock.stats.initialized) {
+        return 1;
+    }
+
+    uint64_t now = read_tsc();
+
+    if (!g_clock.oneshot_ticks) {
+        g_clock.last_tick_tsc = now;
+        return 1;
+    }
+
+    /* Back from tickless idle: count whole ticks by the TSC, since a
+     * tick already pending when the one-shot was armed lands here too */
+    uint32_t elapsed = (uint32_t)div_u64_u32(now - g_clock.last_tick_tsc, g_clock.cycles_per_tick);
+    if (elapsed > g_clock.oneshot_ticks) {
+        elapsed = g_clock.oneshot_ticks;
+    }
+    g_clock.last_tick_tsc += (uint64_t)elapsed * g_clock.cycles_per_tick;
+    if (elapsed > 1) {
+        g_clock.stats.ticks_skipped += elapsed - 1;
+    }
+
+    g_clock.oneshot_ticks = 0;
+    g_clock.event->set_periodic();
+    return elapsed;
+}
+
+void clock_idle(void) {
+    asm volatile("cli");
+    g_clock.stats.idle_entries++;
+
+    /* Only skip ticks when nothing but the caller wants the CPU */
+    if (g_clock.stats.initialized && !g_clock.oneshot_ticks &&
+        scheduler_runnable_count() <= 1) {
+        uint32_t ticks = timer_idle_ticks(g_clock.event->max_oneshot);
+        if (ticks > 1) {
+            g_clock.event->set_oneshot(ticks);
+            g_clock.oneshot_ticks = ticks;
+            g_clock.stats.oneshots++;
+        }
+    }
+
+    /* sti takes effect after hlt starts, so no wakeup is lost */
+    asm volatile("sti; hlt");
+}
+
+uint64_t clock_monotonic_ns(void) {
+    if (!g_clock.stats.initialized) {
+        return 0;
+    }
+    return mul_u64_u32_shr(read_tsc() - g_clock.tsc_base, g_clock.mult, CLOCK_SHIFT);
+}
+
+void clock_udelay(uint32_t us) {
+    uint32_t khz = g_clock.stats.tsc_khz ? g_clock.stats.tsc_khz : 1000000;
+    uint64_t cycles = (uint64_t)us * (khz / 1000);
+    uint64_t start = read_tsc();
+
+    while (read_tsc() - start < cycles) {
+        asm volatile("pause");
+    }
+}
+
+uint32_t clock_ns_to_ms(uint64_t ns) {
+    uint64_t ms = div_u64_u32(ns, 1000000);
+    return ms > 0xFFFFFFFFull ? 0xFFFFFFFF : (uint32_t)ms;
+}
+
+void clock_get_stats(clock_stats_t* stats) {
+    if (stats) {
+        *stats = g_clock.stats;
+    }
+}
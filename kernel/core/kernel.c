@@ -4,12 +4,21 @@
 #include "idt.h"
 #include "isr.h"
 #include "memory.h"
+#include "kheap.h"
 #include "multiboot.h"
 #include "video.h"
 #include "keyboard.h"
 #include "sound.h"
 #include "task.h"
 #include "process.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "clock.h"
+#include "fpu.h"
+#include "workqueue.h"
+#include "kstack.h"
+#include "lapic.h"
+#include "smp.h"
 #include "syscall.h"
 #include "usermode.h"
 #include "shm.h"
@@ -27,6 +36,8 @@
 
 volatile uint64 g_timer_ticks = 0;
 
+static ktimer_t g_heap_rebalance_timer;
+
 
 
 void kernel_panic(const char* message) {
@@ -46,12 +57,14 @@ void kernel_panic(const char* message) {
    Timer IRQ
    ========================= */
 
+static void heap_rebalance_timer(void* data) {
+    (void)data;
+    kheap_rebalance();
+}
+
 void timer_interrupt_handler(REGISTERS* r) {
     (void)r;
     g_timer_ticks++;
-    
-    // Update input manager tick
-    input_tick();
 }
 
 void kmain(uint32 magic, multiboot_info_t* mbi) {
@@ -71,6 +84,12 @@ void kmain(uint32 magic, multiboot_info_t* mbi) {
     memory_init(mbi);
     paging_init();
     paging_enable();
+    kstack_init();
+    lapic_init();
+    
+    timer_init();
+    clock_init();
+    fpu_init();
 
     keyboard_init();
     syscall_init();
@@ -97,8 +116,16 @@ void kmain(uint32 magic, multiboot_info_t* mbi) {
     html_init();
     layout_init();
 
+    scheduler_init();
     task_init();
+    workqueue_init();
     process_init();
+    memory_cow_selftest();
+    smp_init();
+
+    // Trim kmalloc depot magazines no CPU has needed for a second
+    ktimer_init(&g_heap_rebalance_timer, heap_rebalance_timer, NULL);
+    ktimer_start(&g_heap_rebalance_timer, TIMER_HZ, TIMER_HZ);
 
     // Initialize desktop (registers input listener)
     desktop_init();
@@ -114,6 +141,6 @@ void kmain(uint32 magic, multiboot_info_t* mbi) {
     // Input is handled via input_manager listeners, just need to draw
     for (;;) {
         desktop_draw();
-        asm volatile("hlt");
+        clock_idle();
     }
 }
\ No newline at end of file
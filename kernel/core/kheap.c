@@ -2,13 +2,62 @@
 #include "string.h"
 #include "video.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "smp.h"
 
 /* Global heap state */
 static kheap_state_t g_heap;
 
+/* Guards g_heap; irqsave since IRQ handlers allocate too */
+static spinlock_t g_heap_lock = SPINLOCK_INIT;
+static lock_stats_t g_heap_lock_stats;
+
+/* A magazine: a stack of parked class blocks */
+typedef struct kheap_magazine {
+    struct kheap_magazine* next;    /* Depot list link */
+    uint32_t rounds;                /* Blocks held */
+    kheap_block_t* blocks[KHEAP_MAG_ROUNDS];
+} kheap_magazine_t;
+
+/* One CPU's magazines for one class. previous is always either empty or
+ * full, so a miss on loaded can be served by swapping the two. */
+typedef struct {
+    kheap_magazine_t* loaded;
+    kheap_magazine_t* previous;
+} kheap_mag_cache_t;
+
+/* Per-CPU state, only touched by its own CPU with interrupts off. The
+ * counters are folded into the totals by kheap_get_state(). Aligned so
+ * CPUs never share a cache line. */
+typedef struct {
+    kheap_mag_cache_t caches[KHEAP_NUM_CLASSES];
+    uint32_t allocs;
+    uint32_t frees;
+    size_t bytes_allocated;
+    size_t bytes_freed;
+} __attribute__((aligned(64))) kheap_cpu_t;
+
+/* Depot: full magazines per class and a shared stack of empty ones
+ * (guarded by g_heap_lock) */
+static struct {
+    kheap_magazine_t* full[KHEAP_NUM_CLASSES];
+    uint32_t full_count[KHEAP_NUM_CLASSES];
+    uint32_t full_min[KHEAP_NUM_CLASSES];   /* Low watermark since the last rebalance */
+    kheap_magazine_t* empty;
+} g_depot;
+
+static kheap_magazine_t g_magazines[KHEAP_MAG_COUNT];
+static kheap_cpu_t g_heap_cpus[SMP_MAX_CPUS];
+static kheap_state_t g_heap_view;
+
 /* Block header size */
 #define HEADER_SIZE sizeof(kheap_block_t)
 
+/* Boundary tag after each block's data: a copy of the block size, so the
+ * physically preceding block can be found from any header */
+#define FOOTER_SIZE sizeof(size_t)
+#define BLOCK_OVERHEAD (HEADER_SIZE + FOOTER_SIZE)
+
 /* Align size up to KHEAP_BLOCK_SIZE */
 static inline size_t align_up(size_t size) {
     return (size + KHEAP_BLOCK_SIZE - 1) & ~(KHEAP_BLOCK_SIZE - 1);
@@ -29,6 +78,31 @@ static inline int is_in_heap(void* ptr) {
     return ptr >= g_heap.heap_start && ptr < g_heap.heap_end;
 }
 
+/* Get pointer to a block's footer tag */
+static inline size_t* block_footer(kheap_block_t* block) {
+    return (size_t*)((uint8_t*)block + HEADER_SIZE + block->size);
+}
+
+/* Write the footer tag after resizing a block */
+static inline void set_footer(kheap_block_t* block) {
+    *block_footer(block) = block->size;
+}
+
+/* Physically following block, or NULL at the end of the heap */
+static inline kheap_block_t* phys_next(kheap_block_t* block) {
+    void* next = (uint8_t*)block + BLOCK_OVERHEAD + block->size;
+    return is_in_heap(next) ? (kheap_block_t*)next : NULL;
+}
+
+/* Physically preceding block, or NULL at the start of the heap */
+static inline kheap_block_t* phys_prev(kheap_block_t* block) {
+    if ((void*)block <= g_heap.heap_start) {
+        return NULL;
+    }
+    size_t prev_size = *(size_t*)((uint8_t*)block - FOOTER_SIZE);
+    return (kheap_block_t*)((uint8_t*)block - BLOCK_OVERHEAD - prev_size);
+}
+
 /* Remove block from a list */
 static void list_remove(kheap_block_t** list, kheap_block_t* block) {
     if (block->prev) {
@@ -74,58 +148,300 @@ static kheap_block_t* find_best_fit(size_t size) {
     return best;
 }
 
-/* Split a block if it's large enough */
+/* Split a block if it's large enough, returning the tail to the free list */
 static void split_block(kheap_block_t* block, size_t size) {
-    size_t remaining = block->size - size - HEADER_SIZE;
-    
     /* Only split if remaining space is useful */
-    if (remaining >= KHEAP_MIN_BLOCK) {
-        kheap_block_t* new_block = (kheap_block_t*)((uint8_t*)block + HEADER_SIZE + size);
-        new_block->magic = KHEAP_MAGIC;
-        new_block->flags = KHEAP_FLAG_FREE;
-        new_block->size = remaining;
-        
-        /* Insert new block after the current one in free list */
-        new_block->next = block->next;
-        new_block->prev = block;
-        if (block->next) {
-            block->next->prev = new_block;
-        }
-        block->next = new_block;
-        
-        /* Resize current block */
-        block->size = size;
+    if (block->size < size + BLOCK_OVERHEAD + KHEAP_MIN_BLOCK) {
+        return;
+    }
+    
+    kheap_block_t* new_block = (kheap_block_t*)((uint8_t*)block + BLOCK_OVERHEAD + size);
+    new_block->magic = KHEAP_MAGIC;
+    new_block->flags = KHEAP_FLAG_FREE;
+    new_block->size = block->size - size - BLOCK_OVERHEAD;
+    new_block->next = NULL;
+    new_block->prev = NULL;
+    set_footer(new_block);
+    
+    /* Resize current block */
+    block->size = size;
+    set_footer(block);
+    
+    /* The tail may border another free block (e.g. shrinking realloc) */
+    kheap_block_t* after = phys_next(new_block);
+    if (after && after->flags == KHEAP_FLAG_FREE) {
+        list_remove(&g_heap.free_list, after);
+        new_block->size += BLOCK_OVERHEAD + after->size;
+        set_footer(new_block);
     }
+    
+    list_push_front(&g_heap.free_list, new_block);
+}
+
+/* Map a request size to the smallest class that holds it (-1 = large) */
+static inline int size_to_class(size_t size) {
+    if (size <= KHEAP_SLAB_MIN) {
+        return 0;
+    }
+    if (size > KHEAP_SLAB_MAX) {
+        return -1;
+    }
+    /* Index of the highest set bit of (size - 1), rebased so 16 -> 0 */
+    return (32 - __builtin_clz(size - 1)) - 4;
 }
 
-/* Coalesce with adjacent free blocks */
-static void coalesce(kheap_block_t* block) {
-    /* Try to coalesce with next block */
-    if (block->next && block->next->flags == KHEAP_FLAG_FREE) {
-        kheap_block_t* next = block->next;
+/* Map a block size to the largest class it can serve */
+static inline int block_to_class(size_t size) {
+    if (size >= KHEAP_SLAB_MAX) {
+        return KHEAP_NUM_CLASSES - 1;
+    }
+    return (31 - __builtin_clz(size)) - 4;
+}
+
+/* Merge a free block with its free physical neighbours.
+ * Parked class blocks are not KHEAP_FLAG_FREE and are left alone. */
+static kheap_block_t* coalesce(kheap_block_t* block) {
+    kheap_block_t* next = phys_next(block);
+    if (next && next->flags == KHEAP_FLAG_FREE) {
         list_remove(&g_heap.free_list, next);
-        block->size += HEADER_SIZE + next->size;
-        block->next = next->next;
-        if (next->next) {
-            next->next->prev = block;
-        }
+        block->size += BLOCK_OVERHEAD + next->size;
     }
     
-    /* Try to coalesce with prev block */
-    if (block->prev && block->prev->flags == KHEAP_FLAG_FREE) {
-        kheap_block_t* prev = block->prev;
+    kheap_block_t* prev = phys_prev(block);
+    if (prev && prev->flags == KHEAP_FLAG_FREE) {
         list_remove(&g_heap.free_list, prev);
-        prev->size += HEADER_SIZE + block->size;
-        prev->next = block->next;
-        if (block->next) {
-            block->next->prev = prev;
+        prev->size += BLOCK_OVERHEAD + block->size;
+        block = prev;
+    }
+    
+    set_footer(block);
+    return block;
+}
+
+/* Release a free block to the general free list */
+static void release_block(kheap_block_t* block) {
+    block->flags = KHEAP_FLAG_FREE;
+    block = coalesce(block);
+    list_push_front(&g_heap.free_list, block);
+}
+
+/* Blocks per magazine for a class: fewer for big blocks, so one CPU
+ * cannot sit on much memory */
+static inline uint32_t mag_capacity(int class_index) {
+    uint32_t capacity = KHEAP_MAG_BYTES / ((uint32_t)KHEAP_SLAB_MIN << class_index);
+    return capacity < KHEAP_MAG_ROUNDS ? capacity : KHEAP_MAG_ROUNDS;
+}
+
+/* Move a magazine's blocks onto their class list */
+static void mag_flush(kheap_magazine_t* mag, int class_index) {
+    kheap_class_t* cls = &g_heap.classes[class_index];
+    while (mag->rounds) {
+        list_push_front(&cls->free_list, mag->blocks[--mag->rounds]);
+        cls->cached++;
+    }
+}
+
+static kheap_magazine_t* depot_get_full(int class_index) {
+    kheap_magazine_t* mag = g_depot.full[class_index];
+    if (mag) {
+        g_depot.full[class_index] = mag->next;
+        g_depot.full_count[class_index]--;
+        if (g_depot.full_count[class_index] < g_depot.full_min[class_index]) {
+            g_depot.full_min[class_index] = g_depot.full_count[class_index];
         }
-        /* Block is now part of prev, so prev is the coalesced block */
+    }
+    return mag;
+}
+
+static void depot_put_full(int class_index, kheap_magazine_t* mag) {
+    mag->next = g_depot.full[class_index];
+    g_depot.full[class_index] = mag;
+    g_depot.full_count[class_index]++;
+}
+
+static kheap_magazine_t* depot_get_empty(void) {
+    kheap_magazine_t* mag = g_depot.empty;
+    if (mag) {
+        g_depot.empty = mag->next;
+    }
+    return mag;
+}
+
+static void depot_put_empty(kheap_magazine_t* mag) {
+    mag->next = g_depot.empty;
+    g_depot.empty = mag;
+}
+
+/* Flush every class cache back to the general heap. Magazines loaded on
+ * a CPU belong to that CPU and are left alone. */
+static void reclaim_classes(void) {
+    for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+        kheap_class_t* cls = &g_heap.classes[i];
+        while (g_depot.full[i]) {
+            kheap_magazine_t* mag = depot_get_full(i);
+            mag_flush(mag, i);
+            depot_put_empty(mag);
+        }
+        while (cls->free_list) {
+            kheap_block_t* block = cls->free_list;
+            list_remove(&cls->free_list, block);
+            release_block(block);
+        }
+        cls->cached = 0;
+    }
+    g_heap.reclaims++;
+}
+
+/* Take a block of at least size bytes from the general heap */
+static kheap_block_t* alloc_from_heap(size_t size) {
+    kheap_block_t* block = find_best_fit(size);
+    if (!block) {
+        /* Cached class blocks may be hiding the space we need */
+        reclaim_classes();
+        block = find_best_fit(size);
+        if (!block) {
+            return NULL;
+        }
+    }
+    
+    /* Remove from free list */
+    list_remove(&g_heap.free_list, block);
+    
+    /* Split if block is much larger */
+    split_block(block, size);
+    
+    return block;
+}
+
+/* Top a magazine up to count blocks from the class list. If that is
+ * empty only one block is carved: carving ahead would scatter class
+ * blocks across the heap and fragment it. */
+static void mag_fill(kheap_magazine_t* mag, int class_index, uint32_t count) {
+    kheap_class_t* cls = &g_heap.classes[class_index];
+    while (mag->rounds < count && cls->free_list) {
+        kheap_block_t* block = cls->free_list;
+        list_remove(&cls->free_list, block);
+        cls->cached--;
+        cls->hits++;
+        mag->blocks[mag->rounds++] = block;
+    }
+    
+    if (mag->rounds == 0) {
+        kheap_block_t* block = alloc_from_heap(cls->size);
+        if (block) {
+            block->flags = KHEAP_FLAG_SLAB;
+            cls->misses++;
+            mag->blocks[mag->rounds++] = block;
+        }
+    }
+}
+
+static inline void mag_swap(kheap_mag_cache_t* cache) {
+    kheap_magazine_t* mag = cache->loaded;
+    cache->loaded = cache->previous;
+    cache->previous = mag;
+}
+
+/* Both magazines are empty: trade the spare for a full one from the
+ * depot, or fill the loaded one halfway from the class list */
+static void mag_reload(kheap_mag_cache_t* cache, int class_index) {
+    kheap_magazine_t* full = depot_get_full(class_index);
+    if (full) {
+        if (cache->previous) {
+            depot_put_empty(cache->previous);
+        }
+        cache->previous = cache->loaded;
+        cache->loaded = full;
+    } else {
+        if (!cache->loaded) {
+            cache->loaded = depot_get_empty();
+            if (!cache->loaded) {
+                return;
+            }
+        }
+        mag_fill(cache->loaded, class_index, (mag_capacity(class_index) + 1) / 2);
+    }
+    g_heap.depot_refills++;
+}
+
+/* Both magazines are full: hand the spare to the depot for an empty one,
+ * or flush the loaded one if the pool has no empties left */
+static void mag_unload(kheap_mag_cache_t* cache, int class_index) {
+    kheap_magazine_t* empty = depot_get_empty();
+    if (empty) {
+        if (cache->previous) {
+            depot_put_full(class_index, cache->previous);
+            g_heap.depot_drains++;
+        }
+        cache->previous = cache->loaded;
+        cache->loaded = empty;
+    } else if (cache->loaded) {
+        mag_flush(cache->loaded, class_index);
+    }
+}
+
+/* Pop a block from the calling CPU's magazines (interrupts off) */
+static kheap_block_t* mag_alloc(kheap_cpu_t* cpu, int class_index) {
+    kheap_mag_cache_t* cache = &cpu->caches[class_index];
+    
+    if (!cache->loaded || cache->loaded->rounds == 0) {
+        if (cache->previous && cache->previous->rounds > 0) {
+            mag_swap(cache);
+        } else {
+            spin_lock(&g_heap_lock);
+            mag_reload(cache, class_index);
+            spin_unlock(&g_heap_lock);
+            if (!cache->loaded || cache->loaded->rounds == 0) {
+                return NULL;
+            }
+        }
+    }
+    
+    kheap_magazine_t* mag = cache->loaded;
+    return mag->blocks[--mag->rounds];
+}
+
+/* Push a block onto the calling CPU's magazines (interrupts off).
+ * Returns 0 if no magazine could take it. */
+static int mag_free(kheap_cpu_t* cpu, kheap_block_t* block, int class_index) {
+    kheap_mag_cache_t* cache = &cpu->caches[class_index];
+    
+    if (!cache->loaded || cache->loaded->rounds >= mag_capacity(class_index)) {
+        if (cache->previous && cache->previous->rounds == 0) {
+            mag_swap(cache);
+        } else {
+            spin_lock(&g_heap_lock);
+            mag_unload(cache, class_index);
+            spin_unlock(&g_heap_lock);
+            if (!cache->loaded) {
+                return 0;
+            }
+        }
+    }
+    
+    cache->loaded->blocks[cache->loaded->rounds++] = block;
+    return 1;
+}
+
+/* Copy the heap state into view, adding the per-CPU counters (lock held) */
+static void fold_cpu_stats(kheap_state_t* view) {
+    *view = g_heap;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        kheap_cpu_t* cpu = &g_heap_cpus[i];
+        view->mag_allocs += cpu->allocs;
+        view->mag_frees += cpu->frees;
+        view->num_allocs += cpu->allocs;
+        view->num_frees += cpu->frees;
+        view->total_allocated += cpu->bytes_allocated - cpu->bytes_freed;
+        view->total_freed += cpu->bytes_freed;
     }
 }
 
 kheap_state_t* kheap_get_state(void) {
-    return &g_heap;
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    fold_cpu_stats(&g_heap_view);
+    spin_unlock_irqrestore(&g_heap_lock, flags);
+    return &g_heap_view;
 }
 
 int kheap_init(void* start, size_t size) {
@@ -138,8 +454,8 @@ int kheap_init(void* start, size_t size) {
     }
     
     /* Align start address */
-    uint32_t aligned_start = ((uint32_t)start + KHEAP_BLOCK_SIZE - 1) & ~(KHEAP_BLOCK_SIZE - 1);
-    size_t aligned_size = size - (aligned_start - (uint32_t)start);
+    uintptr_t aligned_start = ((uintptr_t)start + KHEAP_BLOCK_SIZE - 1) & ~(KHEAP_BLOCK_SIZE - 1);
+    size_t aligned_size = size - (aligned_start - (uintptr_t)start);
     aligned_size &= ~(KHEAP_BLOCK_SIZE - 1);
     
     /* Initialize heap state */
@@ -150,17 +466,40 @@ int kheap_init(void* start, size_t size) {
     g_heap.total_freed = 0;
     g_heap.num_allocs = 0;
     g_heap.num_frees = 0;
+    g_heap.large_allocs = 0;
+    g_heap.reclaims = 0;
+    g_heap.mag_allocs = 0;
+    g_heap.mag_frees = 0;
+    g_heap.depot_refills = 0;
+    g_heap.depot_drains = 0;
+    g_heap.depot_trims = 0;
     g_heap.used_list = NULL;
     
+    /* Every magazine starts out empty in the depot */
+    memset(&g_depot, 0, sizeof(g_depot));
+    memset(g_heap_cpus, 0, sizeof(g_heap_cpus));
+    for (int i = 0; i < KHEAP_MAG_COUNT; i++) {
+        g_magazines[i].rounds = 0;
+        depot_put_empty(&g_magazines[i]);
+    }
+    
+    /* Set up size classes */
+    for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+        memset(&g_heap.classes[i], 0, sizeof(kheap_class_t));
+        g_heap.classes[i].size = (size_t)KHEAP_SLAB_MIN << i;
+    }
+    
     /* Create initial free block spanning entire heap */
     kheap_block_t* initial = (kheap_block_t*)aligned_start;
     initial->magic = KHEAP_MAGIC;
     initial->flags = KHEAP_FLAG_FREE;
-    initial->size = aligned_size - HEADER_SIZE;
+    initial->size = aligned_size - BLOCK_OVERHEAD;
     initial->next = NULL;
     initial->prev = NULL;
+    set_footer(initial);
     
     g_heap.free_list = initial;
+    spin_init(&g_heap_lock, "kheap", &g_heap_lock_stats);
     g_heap.initialized = 1;
     
     debug_print("kheap: initialized at 0x");
@@ -172,16 +511,35 @@ int kheap_init(void* start, size_t size) {
     return 0;
 }
 
-void* kmalloc(size_t size) {
+static void* kmalloc_locked(size_t size) {
     if (!g_heap.initialized || size == 0) {
         return NULL;
     }
     
-    /* Align size */
-    size = align_up(size);
+    kheap_block_t* block;
+    int class_index = size_to_class(size);
+    
+    if (class_index >= 0) {
+        /* Small request: pop from the class list or carve a new block */
+        kheap_class_t* cls = &g_heap.classes[class_index];
+        size = cls->size;
+        
+        if (cls->free_list) {
+            block = cls->free_list;
+            list_remove(&cls->free_list, block);
+            cls->cached--;
+            cls->hits++;
+        } else {
+            block = alloc_from_heap(size);
+            cls->misses++;
+        }
+    } else {
+        /* Align size */
+        size = align_up(size);
+        block = alloc_from_heap(size);
+        g_heap.large_allocs++;
+    }
     
-    /* Find best fit block */
-    kheap_block_t* block = find_best_fit(size);
     if (!block) {
         debug_print("kheap: out of memory for size ");
         debug_print_hex(size);
@@ -189,17 +547,15 @@ void* kmalloc(size_t size) {
         return NULL;
     }
     
-    /* Remove from free list */
-    list_remove(&g_heap.free_list, block);
-    
-    /* Split if block is much larger */
-    split_block(block, size);
-    
     /* Mark as used */
     block->flags = KHEAP_FLAG_USED;
-    
-    /* Add to used list */
-    list_push_front(&g_heap.used_list, block);
+    if (class_index >= 0) {
+        block->flags |= KHEAP_FLAG_SLAB;
+    } else {
+        /* Only large blocks are listed: class blocks may be freed into a
+         * magazine, which must not touch shared lists */
+        list_push_front(&g_heap.used_list, block);
+    }
     
     /* Update stats */
     g_heap.total_allocated += block->size;
@@ -208,15 +564,12 @@ void* kmalloc(size_t size) {
     return block_to_data(block);
 }
 
-void kfree(void* ptr) {
-    if (!ptr || !g_heap.initialized) {
-        return;
-    }
-    
+/* Validate a pointer passed to kfree, returning its block or NULL */
+static kheap_block_t* free_target(void* ptr) {
     /* Check pointer is in heap */
     if (!is_in_heap(ptr)) {
         debug_print("kheap: invalid free pointer\n");
-        return;
+        return NULL;
     }
     
     /* Get block header */
@@ -225,30 +578,158 @@ void kfree(void* ptr) {
     /* Validate block */
     if (block->magic != KHEAP_MAGIC) {
         debug_print("kheap: bad magic on free - heap corruption!\n");
-        return;
+        return NULL;
     }
     
-    if (block->flags == KHEAP_FLAG_FREE) {
+    if (!(block->flags & KHEAP_FLAG_USED)) {
         debug_print("kheap: double free detected!\n");
-        return;
+        return NULL;
     }
     
-    /* Remove from used list */
-    list_remove(&g_heap.used_list, block);
+    return block;
+}
+
+static void kfree_locked(void* ptr) {
+    if (!ptr || !g_heap.initialized) {
+        return;
+    }
     
-    /* Mark as free */
-    block->flags = KHEAP_FLAG_FREE;
+    kheap_block_t* block = free_target(ptr);
+    if (!block) {
+        return;
+    }
     
     /* Update stats */
     g_heap.total_allocated -= block->size;
     g_heap.total_freed += block->size;
     g_heap.num_frees++;
     
-    /* Coalesce with adjacent free blocks */
-    coalesce(block);
+    /* Class blocks go back on their class list without coalescing */
+    if (block->flags & KHEAP_FLAG_SLAB) {
+        kheap_class_t* cls = &g_heap.classes[block_to_class(block->size)];
+        block->flags = KHEAP_FLAG_SLAB;
+        list_push_front(&cls->free_list, block);
+        cls->cached++;
+        cls->frees++;
+        return;
+    }
     
-    /* Add to free list */
-    list_push_front(&g_heap.free_list, block);
+    list_remove(&g_heap.used_list, block);
+    release_block(block);
+}
+
+/* Resize a block without moving it; returns 0 if it has to move */
+static int resize_locked(kheap_block_t* block, size_t size) {
+    /* Class blocks are never split; reuse them while they still fit */
+    if (block->flags & KHEAP_FLAG_SLAB) {
+        return size <= block->size;
+    }
+    
+    if (size <= block->size && block->size - size < KHEAP_MIN_BLOCK) {
+        /* If size is similar, keep the block */
+        return 1;
+    }
+    
+    if (size < block->size) {
+        /* If new size is smaller, try to split */
+        g_heap.total_allocated -= block->size;
+        split_block(block, size);
+        g_heap.total_allocated += block->size;
+        return 1;
+    }
+    
+    /* Grow in place by absorbing a free physical neighbour */
+    kheap_block_t* next = phys_next(block);
+    if (next && next->flags == KHEAP_FLAG_FREE &&
+        block->size + BLOCK_OVERHEAD + next->size >= size) {
+        list_remove(&g_heap.free_list, next);
+        g_heap.total_allocated -= block->size;
+        block->size += BLOCK_OVERHEAD + next->size;
+        set_footer(block);
+        split_block(block, size);
+        g_heap.total_allocated += block->size;
+        return 1;
+    }
+    
+    return 0;
+}
+
+void* kmalloc(size_t size) {
+    if (!g_heap.initialized || size == 0) {
+        return NULL;
+    }
+    
+    /* Fast path: the calling CPU's magazines, no lock */
+    int class_index = size_to_class(size);
+    if (class_index >= 0) {
+        uint32_t flags = local_irq_save();
+        kheap_cpu_t* cpu = &g_heap_cpus[smp_cpu_id()];
+        kheap_block_t* block = mag_alloc(cpu, class_index);
+        if (block) {
+            block->flags = KHEAP_FLAG_USED | KHEAP_FLAG_SLAB;
+            cpu->allocs++;
+            cpu->bytes_allocated += block->size;
+            local_irq_restore(flags);
+            return block_to_data(block);
+        }
+        local_irq_restore(flags);
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    void* ptr = kmalloc_locked(size);
+    spin_unlock_irqrestore(&g_heap_lock, flags);
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (!ptr || !g_heap.initialized) {
+        return;
+    }
+    
+    kheap_block_t* block = free_target(ptr);
+    if (!block) {
+        return;
+    }
+    
+    /* Fast path: class blocks go to the calling CPU's magazines, which
+     * need not be the CPU that allocated them */
+    if (block->flags & KHEAP_FLAG_SLAB) {
+        uint32_t flags = local_irq_save();
+        kheap_cpu_t* cpu = &g_heap_cpus[smp_cpu_id()];
+        if (mag_free(cpu, block, block_to_class(block->size))) {
+            block->flags = KHEAP_FLAG_SLAB;
+            cpu->frees++;
+            cpu->bytes_freed += block->size;
+            local_irq_restore(flags);
+            return;
+        }
+        local_irq_restore(flags);
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    kfree_locked(ptr);
+    spin_unlock_irqrestore(&g_heap_lock, flags);
+}
+
+void kheap_rebalance(void) {
+    if (!g_heap.initialized) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+        /* Magazines the depot never dipped into since the last call are
+         * not part of any CPU's working set */
+        uint32_t idle = g_depot.full_min[i];
+        while (idle--) {
+            kheap_magazine_t* mag = depot_get_full(i);
+            mag_flush(mag, i);
+            depot_put_empty(mag);
+            g_heap.depot_trims++;
+        }
+        g_depot.full_min[i] = g_depot.full_count[i];
+    }
+    spin_unlock_irqrestore(&g_heap_lock, flags);
 }
 
 void* krealloc(void* ptr, size_t size) {
@@ -273,18 +754,15 @@ void* krealloc(void* ptr, size_t size) {
     
     size = align_up(size);
     
-    /* If size is similar, return same pointer */
-    if (size <= block->size && block->size - size < KHEAP_MIN_BLOCK) {
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    int resized = resize_locked(block, size);
+    spin_unlock_irqrestore(&g_heap_lock, flags);
+    if (resized) {
         return ptr;
     }
     
-    /* If new size is smaller, try to split */
-    if (size < block->size) {
-        split_block(block, size);
-        return ptr;
-    }
-    
-    /* Need to allocate new block */
+    /* Need to allocate new block; class sizes go through the magazines
+     * like any other allocation */
     void* new_ptr = kmalloc(size);
     if (!new_ptr) {
         return NULL;
@@ -316,7 +794,27 @@ void* kcalloc(size_t num, size_t size) {
     return ptr;
 }
 
-int kheap_check_integrity(void) {
+/* Every block parked in a magazine must be an unused class block */
+static int check_magazine(kheap_magazine_t* mag, int class_index) {
+    if (!mag) {
+        return 0;
+    }
+    if (mag->rounds > mag_capacity(class_index)) {
+        debug_print("kheap: magazine overfilled\n");
+        return -1;
+    }
+    for (uint32_t r = 0; r < mag->rounds; r++) {
+        kheap_block_t* block = mag->blocks[r];
+        if (!is_in_heap(block) || block->magic != KHEAP_MAGIC || block->flags != KHEAP_FLAG_SLAB ||
+            block->size < g_heap.classes[class_index].size) {
+            debug_print("kheap: corruption in magazine\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int check_integrity_locked(void) {
     if (!g_heap.initialized) {
         return 0;
     }
@@ -328,7 +826,7 @@ int kheap_check_integrity(void) {
             debug_print("kheap: corruption in free list\n");
             return -1;
         }
-        if (block->flags != KHEAP_FLAG_FREE) {
+        if (block->flags & KHEAP_FLAG_USED) {
             debug_print("kheap: used block in free list\n");
             return -1;
         }
@@ -346,7 +844,7 @@ int kheap_check_integrity(void) {
             debug_print("kheap: corruption in used list\n");
             return -1;
         }
-        if (block->flags != KHEAP_FLAG_USED) {
+        if (!(block->flags & KHEAP_FLAG_USED)) {
             debug_print("kheap: free block in used list\n");
             return -1;
         }
@@ -357,45 +855,142 @@ int kheap_check_integrity(void) {
         block = block->next;
     }
     
+    /* Walk the heap physically: tags must agree and no two free
+     * blocks may be adjacent */
+    int prev_free = 0;
+    block = (kheap_block_t*)g_heap.heap_start;
+    while (block) {
+        if (block->magic != KHEAP_MAGIC) {
+            debug_print("kheap: bad magic in heap walk\n");
+            return -1;
+        }
+        if ((uint8_t*)block + BLOCK_OVERHEAD + block->size > (uint8_t*)g_heap.heap_end) {
+            debug_print("kheap: block overruns heap end\n");
+            return -1;
+        }
+        if (*block_footer(block) != block->size) {
+            debug_print("kheap: footer mismatch\n");
+            return -1;
+        }
+        int is_free = block->flags == KHEAP_FLAG_FREE;
+        if (is_free && prev_free) {
+            debug_print("kheap: uncoalesced free neighbours\n");
+            return -1;
+        }
+        prev_free = is_free;
+        block = phys_next(block);
+    }
+    
+    /* Check magazines, on the CPUs and in the depot */
+    for (int c = 0; c < SMP_MAX_CPUS; c++) {
+        for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+            kheap_mag_cache_t* cache = &g_heap_cpus[c].caches[i];
+            if (check_magazine(cache->loaded, i) != 0 || check_magazine(cache->previous, i) != 0) {
+                return -1;
+            }
+        }
+    }
+    for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+        for (kheap_magazine_t* mag = g_depot.full[i]; mag; mag = mag->next) {
+            if (check_magazine(mag, i) != 0) {
+                return -1;
+            }
+        }
+    }
+    
+    /* Check class lists */
+    for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+        block = g_heap.classes[i].free_list;
+        while (block) {
+            if (block->magic != KHEAP_MAGIC || block->flags != KHEAP_FLAG_SLAB) {
+                debug_print("kheap: corruption in class list\n");
+                return -1;
+            }
+            if (block->size < g_heap.classes[i].size) {
+                debug_print("kheap: undersized block in class list\n");
+                return -1;
+            }
+            block = block->next;
+        }
+    }
+    
     return 0;
 }
 
+int kheap_check_integrity(void) {
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    int result = check_integrity_locked();
+    spin_unlock_irqrestore(&g_heap_lock, flags);
+    return result;
+}
+
 void kheap_dump(void) {
+    uint32_t flags = spin_lock_irqsave(&g_heap_lock);
+    fold_cpu_stats(&g_heap_view);
     debug_print("\n=== Kernel Heap Dump ===\n");
     debug_print("Start: 0x");
-    debug_print_hex((uint32_t)g_heap.heap_start);
+    debug_print_hex((uint32_t)(uintptr_t)g_heap.heap_start);
     debug_print(" End: 0x");
-    debug_print_hex((uint32_t)g_heap.heap_end);
+    debug_print_hex((uint32_t)(uintptr_t)g_heap.heap_end);
     debug_print("\nTotal: ");
     debug_print_hex(g_heap.total_size);
     debug_print(" Allocated: ");
-    debug_print_hex(g_heap.total_allocated);
+    debug_print_hex(g_heap_view.total_allocated);
     debug_print("\nAllocs: ");
-    debug_print_hex(g_heap.num_allocs);
+    debug_print_hex(g_heap_view.num_allocs);
     debug_print(" Frees: ");
-    debug_print_hex(g_heap.num_frees);
+    debug_print_hex(g_heap_view.num_frees);
+    debug_print(" Large: ");
+    debug_print_hex(g_heap.large_allocs);
+    debug_print("\nMagazine allocs: ");
+    debug_print_hex(g_heap_view.mag_allocs);
+    debug_print(" frees: ");
+    debug_print_hex(g_heap_view.mag_frees);
+    debug_print("\nDepot refills: ");
+    debug_print_hex(g_heap.depot_refills);
+    debug_print(" drains: ");
+    debug_print_hex(g_heap.depot_drains);
+    debug_print(" trims: ");
+    debug_print_hex(g_heap.depot_trims);
     debug_print("\n");
     
+    debug_print("Size classes (size hits misses cached depot):\n");
+    for (int i = 0; i < KHEAP_NUM_CLASSES; i++) {
+        kheap_class_t* cls = &g_heap.classes[i];
+        debug_print("  ");
+        debug_print_hex(cls->size);
+        debug_print(" ");
+        debug_print_hex(cls->hits);
+        debug_print(" ");
+        debug_print_hex(cls->misses);
+        debug_print(" ");
+        debug_print_hex(cls->cached);
+        debug_print(" ");
+        debug_print_hex(g_depot.full_count[i]);
+        debug_print("\n");
+    }
+    
     debug_print("Free blocks:\n");
     kheap_block_t* block = g_heap.free_list;
     while (block) {
         debug_print("  0x");
-        debug_print_hex((uint32_t)block);
+        debug_print_hex((uint32_t)(uintptr_t)block);
         debug_print(" size ");
         debug_print_hex(block->size);
         debug_print("\n");
         block = block->next;
     }
     
-    debug_print("Used blocks:\n");
+    debug_print("Used large blocks:\n");
     block = g_heap.used_list;
     while (block) {
         debug_print("  0x");
-        debug_print_hex((uint32_t)block);
+        debug_print_hex((uint32_t)(uintptr_t)block);
         debug_print(" size ");
         debug_print_hex(block->size);
         debug_print("\n");
         block = block->next;
     }
     debug_print("========================\n");
-}
\ No newline at end of file
+    spin_unlock_irqrestore(&g_heap_lock, flags);
+}
@@ -0,0 +1,273 @@
+#include "kstack.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "vmm.h"
+#include "video.h"
+
+#define KSTACK_PAGE_SIZE    4096
+#define KSTACK_FILL         0x57ACC0DE      /* Untouched stack word */
+#define SLOT_NONE           0xFFFF
+
+/* Per-slot state; slots are linked into the free or cache list */
+typedef struct {
+    uint16_t pages;             /* Mapped pages, 0 = slot unmapped */
+    uint16_t next;              /* List link */
+    uint8_t in_use;             /* Handed out by kstack_alloc()? */
+} kstack_slot_t;
+
+/* Global kernel stack state */
+static struct {
+    kstack_slot_t slots[KSTACK_SLOTS];
+    uint16_t free_slots;        /* Unmapped slots */
+    uint16_t cache;             /* Mapped idle slots, most recent first */
+    kstack_stats_t stats;
+    spinlock_t lock;
+} g_kstack = { .lock = SPINLOCK_INIT };
+
+/* Tasks are created and reaped from different tasks and CPUs: keep lists consistent */
+static inline uint32_t slots_lock(void) {
+    return spin_lock_irqsave(&g_kstack.lock);
+}
+
+static inline void slots_unlock(uint32_t flags) {
+    spin_unlock_irqrestore(&g_kstack.lock, flags);
+}
+
+/* Lowest mapped address of a slot's stack */
+static inline uint32_t slot_stack(uint32_t index) {
+    return KSTACK_REGION_BASE + (index + 1) * KSTACK_SLOT_SIZE -
+           g_kstack.slots[index].pages * KSTACK_PAGE_SIZE;
+}
+
+/* Slot of a live stack, or -1 */
+static int slot_of(void* stack) {
+    uint32_t addr = (uint32_t)stack;
+    if (addr < KSTACK_REGION_BASE || addr >= KSTACK_REGION_BASE + KSTACK_REGION_SIZE) {
+        return -1;
+    }
+
+    uint32_t index = (addr - KSTACK_REGION_BASE) / KSTACK_SLOT_SIZE;
+    if (!g_kstack.slots[index].in_use || slot_stack(index) != addr) {
+        return -1;
+    }
+    return (int)index;
+}
+
+static void slot_fill(uint32_t index) {
+    uint32_t* word = (uint32_t*)slot_stack(index);
+    uint32_t count = g_kstack.slots[index].pages * KSTACK_PAGE_SIZE / sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        word[i] = KSTACK_FILL;
+    }
+}
+
+static void slot_unmap(uint32_t index) {
+    page_directory_t* dir = get_kernel_page_directory();
+    uint32_t va = slot_stack(index);
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch);
+
+    for (uint32_t i = 0; i < g_kstack.slots[index].pages; i++, va += KSTACK_PAGE_SIZE) {
+        uint32_t phys;
+        if (vmm_get_physical(dir, va, &phys) == 0) {
+            map_page_in_directory_batch(dir, va, 0, 0, &batch);
+            free_page((void*)(phys & VMM_PAGE_MASK));
+        }
+    }
+    vmm_tlb_batch_flush(&batch);
+
+    g_kstack.stats.mapped_pages -= g_kstack.slots[index].pages;
+    g_kstack.slots[index].pages = 0;
+}
+
+/* Back the top pages of a slot with fresh frames */
+static int slot_map(uint32_t index, uint32_t pages) {
+    page_directory_t* dir = get_kernel_page_directory();
+    uint32_t top = KSTACK_REGION_BASE + (index + 1) * KSTACK_SLOT_SIZE;
+
+    for (uint32_t i = 1; i <= pages; i++) {
+        void* frame = allocate_page();
+        if (!frame) {
+            g_kstack.slots[index].pages = (uint16_t)(i - 1);
+            g_kstack.stats.mapped_pages += i - 1;
+            slot_unmap(index);
+            return -1;
+        }
+        /* Slot was unmapped: nothing stale to flush */
+        map_page_in_directory(dir, top - i * KSTACK_PAGE_SIZE, (uint32_t)frame,
+                              VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_GLOBAL);
+    }
+
+    g_kstack.slots[index].pages = (uint16_t)pages;
+    g_kstack.stats.mapped_pages += pages;
+    return 0;
+}
+
+int kstack_init(void) {
+    if (g_kstack.stats.initialized) {
+        return 0;
+    }
+
+    /* The region must not overlap the identity map of RAM */
+    if (memory_get_end() > KSTACK_REGION_BASE) {
+        debug_print("kstack: region overlaps RAM, disabled\n");
+        return -1;
+    }
+
+    /* Create the page tables now so every directory copied from the
+     * kernel one shares them and sees stacks mapped later */
+    page_directory_t* dir = get_kernel_page_directory();
+    for (uint32_t va = KSTACK_REGION_BASE; va < KSTACK_REGION_BASE + KSTACK_REGION_SIZE;
+         va += 0x400000) {
+        map_page_in_directory(dir, va, 0, 0);
+    }
+
+    for (uint32_t i = 0; i < KSTACK_SLOTS; i++) {
+        g_kstack.slots[i].pages = 0;
+        g_kstack.slots[i].in_use = 0;
+        g_kstack.slots[i].next = (i + 1 < KSTACK_SLOTS) ? (uint16_t)(i + 1) : SLOT_NONE;
+    }
+    g_kstack.free_slots = 0;
+    g_kstack.cache = SLOT_NONE;
+    g_kstack.stats.initialized = 1;
+
+    debug_print("kstack: ");
+    debug_print_hex(KSTACK_SLOTS);
+    debug_print(" guarded slots at 0x");
+    debug_print_hex(KSTACK_REGION_BASE);
+    debug_print("\n");
+
+    return 0;
+}
+
+void* kstack_alloc(uint32_t size) {
+    if (!g_kstack.stats.initialized) {
+        return NULL;
+    }
+    if (size == 0) {
+        size = KSTACK_DEFAULT_SIZE;
+    }
+    if (size > KSTACK_MAX_SIZE) {
+        return NULL;
+    }
+    uint32_t pages = (size + KSTACK_PAGE_SIZE - 1) / KSTACK_PAGE_SIZE;
+
+    uint32_t flags = slots_lock();
+
+    /* Reuse a cached stack of the same size */
+    uint16_t prev = SLOT_NONE;
+    for (uint16_t i = g_kstack.cache; i != SLOT_NONE; prev = i, i = g_kstack.slots[i].next) {
+        if (g_kstack.slots[i].pages != pages) {
+            continue;
+        }
+        if (prev == SLOT_NONE) {
+            g_kstack.cache = g_kstack.slots[i].next;
+        } else {
+            g_kstack.slots[prev].next = g_kstack.slots[i].next;
+        }
+        g_kstack.slots[i].in_use = 1;
+        g_kstack.stats.cached--;
+        g_kstack.stats.in_use++;
+        g_kstack.stats.allocs++;
+        g_kstack.stats.cache_hits++;
+        slots_unlock(flags);
+
+        slot_fill(i);
+        return (void*)slot_stack(i);
+    }
+
+    /* Out of fresh slots: give up the most recently cached stack */
+    if (g_kstack.free_slots == SLOT_NONE && g_kstack.cache != SLOT_NONE) {
+        uint16_t victim = g_kstack.cache;
+        g_kstack.cache = g_kstack.slots[victim].next;
+        g_kstack.stats.cached--;
+        slot_unmap(victim);
+        g_kstack.slots[victim].next = g_kstack.free_slots;
+        g_kstack.free_slots = victim;
+    }
+
+    uint16_t index = g_kstack.free_slots;
+    if (index == SLOT_NONE) {
+        slots_unlock(flags);
+        return NULL;
+    }
+    g_kstack.free_slots = g_kstack.slots[index].next;
+
+    if (slot_map(index, pages) != 0) {
+        g_kstack.slots[index].next = g_kstack.free_slots;
+        g_kstack.free_slots = index;
+        slots_unlock(flags);
+        return NULL;
+    }
+    g_kstack.slots[index].in_use = 1;
+    g_kstack.stats.in_use++;
+    g_kstack.stats.allocs++;
+    slots_unlock(flags);
+
+    slot_fill(index);
+    return (void*)slot_stack(index);
+}
+
+void kstack_free(void* stack) {
+    uint32_t used = kstack_high_water(stack);
+
+    uint32_t flags = slots_lock();
+    int index = slot_of(stack);
+    if (index < 0) {
+        slots_unlock(flags);
+        debug_print("kstack: freeing unknown stack\n");
+        return;
+    }
+
+    if (used > g_kstack.stats.max_used) {
+        g_kstack.stats.max_used = used;
+    }
+    g_kstack.slots[index].in_use = 0;
+    g_kstack.stats.in_use--;
+
+    if (g_kstack.stats.cached < KSTACK_CACHE_MAX) {
+        g_kstack.slots[index].next = g_kstack.cache;
+        g_kstack.cache = (uint16_t)index;
+        g_kstack.stats.cached++;
+    } else {
+        slot_unmap(index);
+        g_kstack.slots[index].next = g_kstack.free_slots;
+        g_kstack.free_slots = (uint16_t)index;
+    }
+    slots_unlock(flags);
+}
+
+uint32_t kstack_size(void* stack) {
+    int index = slot_of(stack);
+    return index < 0 ? 0 : g_kstack.slots[index].pages * KSTACK_PAGE_SIZE;
+}
+
+uint32_t kstack_high_water(void* stack) {
+    uint32_t size = kstack_size(stack);
+    uint32_t* word = (uint32_t*)stack;
+    uint32_t count = size / sizeof(uint32_t);
+
+    /* Stacks grow down: the first overwritten word from the bottom
+     * marks the deepest point reached */
+    uint32_t untouched = 0;
+    while (untouched < count && word[untouched] == KSTACK_FILL) {
+        untouched++;
+    }
+    return size - untouched * sizeof(uint32_t);
+}
+
+int kstack_is_guard(uint32_t addr) {
+    if (!g_kstack.stats.initialized ||
+        addr < KSTACK_REGION_BASE || addr >= KSTACK_REGION_BASE + KSTACK_REGION_SIZE) {
+        return 0;
+    }
+
+    uint32_t index = (addr - KSTACK_REGION_BASE) / KSTACK_SLOT_SIZE;
+    return addr < slot_stack(index);
+}
+
+void kstack_get_stats(kstack_stats_t* stats) {
+    if (stats) {
+        *stats = g_kstack.stats;
+    }
+}
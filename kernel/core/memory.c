@@ -5,12 +5,14 @@
 #include "io_ports.h"
 #include "kernel.h"
 #include "multiboot.h"
+#include "pmm.h"
+#include "kheap.h"
+#include "usermode.h"
+#include "vmm.h"  // struct page_directory
 
 
 #define PAGE_SIZE 4096
-#define MEMORY_SIZE 0x400000  // 4MB - limited by single page table (1024 entries * 4KB)
-#define BITMAP_SIZE (MEMORY_SIZE / PAGE_SIZE / 8)
-#define TOTAL_PAGES (MEMORY_SIZE / PAGE_SIZE)
+#define LARGE_PAGE_SIZE 0x400000  // 4MB PSE page / one page table's worth
 
 #define PAGE_DIRECTORY_SIZE 1024
 #define PAGE_TABLE_SIZE 1024
@@ -18,20 +20,32 @@
 #define PAGE_PRESENT    0x1
 #define PAGE_WRITE      0x2
 #define PAGE_USER       0x4
+#define PAGE_LARGE      0x80   // PDE maps a 4MB page (needs CR4.PSE)
+#define PAGE_GLOBAL     0x100  // Kept in the TLB across CR3 loads (needs CR4.PGE)
+#define PAGE_COW        0x200  // Available bit: read-only until first write
+#define PAGE_FRAME_MASK 0xFFFFF000
 
-// Page directory structure
-struct page_directory {
-    uint32_t entries[PAGE_DIRECTORY_SIZE];
-    uint32_t* tables[PAGE_DIRECTORY_SIZE];  // Physical addresses of page tables
-} __attribute__((aligned(4096)));
+#define PF_PRESENT      0x1    // Page fault error code bits
+#define PF_WRITE        0x2
 
-typedef struct page_directory page_directory_t;
+#define CR4_PSE         0x10
+#define CR4_PGE         0x80
+#define CR0_WP          0x10000  // Kernel writes honour read-only PTEs too
+
+// Kernel heap size scales with RAM: a quarter of it, within these bounds
+#define HEAP_RAM_DIVISOR 4
+#define HEAP_MIN_SIZE    0x400000
+#define HEAP_MAX_SIZE    0x10000000
+
+#define ALIGN_PAGE(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 
-static uint8_t memory_bitmap[BITMAP_SIZE];
 static page_directory_t kernel_page_directory __attribute__((aligned(4096)));
 uint32_t first_page_table[PAGE_TABLE_SIZE] __attribute__((aligned(4096)));
 
 static uint32_t memory_end = 0;
+static uint32_t heap_size = 0;
+static uint32_t cow_faults = 0;
+static uint32_t cow_copies = 0;
 static uint8_t memory_initialized = 0;
 static uint8_t paging_initialized = 0;
 
@@ -80,55 +94,48 @@ void multiboot_parse_memory_map(multiboot_info_t *mbi) {
     debug_print("\n\n");
 }
 
-int is_page_used(size_t page) {
-    return memory_bitmap[page / 8] & (1 << (page % 8));
-}
+// Hand the bootloader's available regions to the PMM (everything else stays used)
+static void pmm_seed_from_multiboot(multiboot_info_t *mbi) {
+    pmm_mark_range_used(0, PMM_ADDR_TO_FRAME(memory_end));
 
-int no_free_pages() {
-    for (int i = 0; i < TOTAL_PAGES; i++) {
-        if (!is_page_used(i)) {
-            return 0;
-        }
+    if (!(mbi->flags & (1 << 6))) {
+        // No map: assume one region from 1MB up to mem_upper
+        pmm_mark_range_free(PMM_ADDR_TO_FRAME(0x100000), PMM_ADDR_TO_FRAME(memory_end - 0x100000));
+        return;
     }
-    return 1;
-}
 
-void set_page_used(size_t page) {
-    memory_bitmap[page / 8] |= (1 << (page % 8));
-}
-
-void set_page_free(size_t page) {
-    memory_bitmap[page / 8] &= ~(1 << (page % 8));
-}
+    multiboot_mmap_entry_t *mmap = (multiboot_mmap_entry_t *)mbi->mmap_addr;
+    multiboot_mmap_entry_t *mmap_end = (multiboot_mmap_entry_t *)(mbi->mmap_addr + mbi->mmap_length);
 
-void *get_free_page() {
-    for (int i = 1; i < TOTAL_PAGES; i++) {
-        if (!is_page_used(i)) {
-            set_page_used(i);
-            return (void *)(i * PAGE_SIZE);
+    while (mmap < mmap_end) {
+        if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap->base_addr < memory_end) {
+            uint64 end = mmap->base_addr + mmap->length;
+            if (end > memory_end) {
+                end = memory_end;
+            }
+            // Only whole frames inside the region are usable
+            uint32_t first = (uint32_t)((mmap->base_addr + PAGE_SIZE - 1) / PAGE_SIZE);
+            uint32_t last = (uint32_t)(end / PAGE_SIZE);
+            if (last > first) {
+                pmm_mark_range_free(first, last - first);
+            }
         }
+        mmap = (multiboot_mmap_entry_t *)((uint32_t)mmap + mmap->size + sizeof(mmap->size));
     }
-    return NULL;
 }
 
 void *allocate_page() {
-    if (no_free_pages()) {
+    uint32_t frame = pmm_alloc_frame();
+    if (frame == 0) {
         debug_print("ERROR: No free pages available - OOM\n");
         return NULL;
     }
 
-    void *page = get_free_page();
-    if (page == NULL) {
-        debug_print("ERROR: Failed to get a free page - OOM\n");
-        return NULL;
-    }
-
-    return page;
+    return (void *)PMM_FRAME_TO_ADDR(frame);
 }
 
 void free_page(void *ptr) {
-    size_t page = (size_t)ptr / PAGE_SIZE;
-    set_page_free(page);
+    pmm_free_frame(PMM_ADDR_TO_FRAME(ptr));
 }
 
 void paging_init() {
@@ -144,27 +151,36 @@ void paging_init() {
     memset(&kernel_page_directory, 0, sizeof(kernel_page_directory));
     memset(first_page_table, 0, sizeof(first_page_table));
     
-    // Map enough memory for the heap and kernel code
-    // The heap is limited to MEMORY_SIZE, so we need to map at least that much
-    uint32_t pages_to_map = MEMORY_SIZE / PAGE_SIZE;
-    
-    // Can't map more than one page table can handle (1024 entries = 4MB)
-    if (pages_to_map > PAGE_TABLE_SIZE) {
-        pages_to_map = PAGE_TABLE_SIZE;
-    }
-    
-    debug_print("Mapping ");
-    debug_print_hex(pages_to_map);
-    debug_print(" pages\n");
-    
-    for (uint32_t i = 0; i < pages_to_map; i++) {
+    // The first 4MB uses 4KB pages so the user window inside it can be
+    // remapped page by page
+    // Kernel pages below the user window are the same in every address
+    // space, so they are global and survive CR3 switches
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; i++) {
         uint32_t phys_addr = i * PAGE_SIZE;
         first_page_table[i] = phys_addr | PAGE_PRESENT | PAGE_WRITE;
+        if (phys_addr < USER_SPACE_START) {
+            first_page_table[i] |= PAGE_GLOBAL;
+        }
     }
     
     kernel_page_directory.entries[0] = ((uint32_t)first_page_table) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
     kernel_page_directory.tables[0] = first_page_table;
     
+    // Identity map the rest of RAM with 4MB pages (kernel only)
+    uint32_t large_pages = (memory_end + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+    if (large_pages > PAGE_DIRECTORY_SIZE) {
+        large_pages = PAGE_DIRECTORY_SIZE;
+    }
+    
+    debug_print("Mapping ");
+    debug_print_hex(large_pages);
+    debug_print(" x 4MB\n");
+    
+    for (uint32_t i = 1; i < large_pages; i++) {
+        kernel_page_directory.entries[i] = (i * LARGE_PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | PAGE_GLOBAL;
+        kernel_page_directory.tables[i] = NULL;
+    }
+    
     paging_initialized = 1;
     debug_print("Paging structures initialized\n");
 }
@@ -176,13 +192,26 @@ void paging_enable() {
     
     debug_print("Enabling paging...\n");
     
+    // 4MB pages in the identity map need page size extensions; global
+    // kernel pages need PGE
+    asm volatile(
+        "mov %%cr4, %%eax\n"
+        "or %0, %%eax\n"
+        "mov %%eax, %%cr4\n"
+        :
+        : "i" (CR4_PSE | CR4_PGE)
+        : "eax"
+    );
+    
+    // WP makes kernel writes to copy-on-write pages fault as well
     asm volatile(
         "mov %0, %%cr3\n"
         "mov %%cr0, %%eax\n"
         "or $0x80000000, %%eax\n"
+        "or %1, %%eax\n"
         "mov %%eax, %%cr0\n"
         : 
-        : "r" (&kernel_page_directory)
+        : "r" (&kernel_page_directory), "i" (CR0_WP)
         : "eax"
     );
     
@@ -196,10 +225,9 @@ page_directory_t* get_kernel_page_directory(void) {
 
 // Create a new page directory for a process
 page_directory_t* create_page_directory(void) {
-    // Allocate page directory structure
-    // Note: kmalloc is provided by kheap.c
-    extern void* kmalloc(size_t size);
-    page_directory_t* dir = (page_directory_t*)kmalloc(sizeof(page_directory_t));
+    // Whole frames: the directory's address goes into CR3 as it is,
+    // so it must be page aligned (a kmalloc block is not)
+    page_directory_t* dir = vmm_alloc_directory();
     if (!dir) {
         debug_print("ERROR: Failed to allocate page directory\n");
         return NULL;
@@ -209,8 +237,6 @@ page_directory_t* create_page_directory(void) {
     debug_print_hex((uint32_t)dir);
     debug_print("\n");
     
-    memset(dir, 0, sizeof(page_directory_t));
-    
     // Copy kernel mappings from the kernel page directory
     // This ensures kernel code is accessible from all processes
     // Important: Only copy the entries (which contain physical addresses),
@@ -221,8 +247,11 @@ page_directory_t* create_page_directory(void) {
             // Copy kernel page directory entries (these contain physical addresses)
             dir->entries[dir_index] = kernel_page_directory.entries[dir_index];
             // Extract the physical address from the entry and get its virtual pointer
-            uint32_t phys_addr = kernel_page_directory.entries[dir_index] & 0xFFFFF000;
-            dir->tables[dir_index] = (uint32_t*)phys_addr;
+            // (4MB pages have no table behind them)
+            if (!(dir->entries[dir_index] & PAGE_LARGE)) {
+                uint32_t phys_addr = kernel_page_directory.entries[dir_index] & 0xFFFFF000;
+                dir->tables[dir_index] = (uint32_t*)phys_addr;
+            }
             entries_copied++;
         }
     }
@@ -234,6 +263,242 @@ page_directory_t* create_page_directory(void) {
     return dir;
 }
 
+// Copy a page table for a new directory, sharing its user pages
+// copy-on-write. With protect the source loses write access as well;
+// changed translations it had are queued on batch (when given).
+static uint32_t* share_page_table(uint32_t* table, int protect, uint32_t base,
+                                  vmm_tlb_batch_t* batch, uint32_t* shared) {
+    uint32_t* copy = (uint32_t*)allocate_page();
+    if (!copy) {
+        kernel_panic("Failed to allocate page table");
+    }
+    
+    for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
+        uint32_t pte = table[i];
+        if ((pte & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER) &&
+            (pte & (PAGE_WRITE | PAGE_COW))) {
+            // Drop write access; the first writer copies
+            if (pmm_frame_ref(PMM_ADDR_TO_FRAME(pte & PAGE_FRAME_MASK)) != 0) {
+                pte = (pte & ~PAGE_WRITE) | PAGE_COW;
+                if (pte != table[i] && batch) {
+                    vmm_tlb_batch_add(batch, base + i * PAGE_SIZE, 0);
+                }
+                if (protect) {
+                    table[i] = pte;
+                }
+                (*shared)++;
+            } else if (pte & PAGE_WRITE) {
+                // Count saturated: give the copy its own page now
+                void* page = allocate_page();
+                if (!page) {
+                    kernel_panic("Failed to copy page for new directory");
+                }
+                memcpy(page, (void*)(pte & PAGE_FRAME_MASK), PAGE_SIZE);
+                pte = (uint32_t)page | (pte & 0xFFF);
+            }
+            // Pinned pages (the zero page) are already read-only COW
+        }
+        copy[i] = pte;
+    }
+    return copy;
+}
+
+// Clone a page directory, sharing user pages copy-on-write
+// Tables holding user pages are copied; the pages themselves are not.
+// The kernel directory's tables are shared by every directory made by
+// create_page_directory(), so they are never write-protected: a parent
+// still using one gets a private copy first. The kernel directory keeps
+// writing its own pages in place.
+page_directory_t* clone_page_directory(page_directory_t* parent) {
+    if (!parent) {
+        return create_page_directory();
+    }
+    
+    page_directory_t* dir = create_page_directory();
+    if (!dir) {
+        return NULL;
+    }
+    
+    uint32_t shared = 0;
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch);
+    for (int dir_index = 0; dir_index < PAGE_DIRECTORY_SIZE; dir_index++) {
+        uint32_t* table = parent->tables[dir_index];
+        if (!table || (parent->entries[dir_index] & PAGE_LARGE)) {
+            continue;
+        }
+        
+        // Kernel-only tables stay shared with the kernel directory
+        int has_user = 0;
+        for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
+            if ((table[i] & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER)) {
+                has_user = 1;
+                break;
+            }
+        }
+        if (!has_user) {
+            continue;
+        }
+        
+        uint32_t base = (uint32_t)dir_index * PAGE_TABLE_SIZE * PAGE_SIZE;
+        int protect = 1;
+        if (table == kernel_page_directory.tables[dir_index]) {
+            if (parent == &kernel_page_directory) {
+                protect = 0;
+            } else {
+                table = share_page_table(table, 0, base, &batch, &shared);
+                parent->entries[dir_index] = ((uint32_t)table) | (parent->entries[dir_index] & 0xFFF);
+                parent->tables[dir_index] = table;
+            }
+        }
+        
+        uint32_t* new_table = share_page_table(table, protect, base, protect ? &batch : NULL, &shared);
+        dir->entries[dir_index] = ((uint32_t)new_table) | (parent->entries[dir_index] & 0xFFF);
+        dir->tables[dir_index] = new_table;
+    }
+    
+    // The parent lost write access to every shared page, on whichever
+    // CPUs have its directory loaded
+    vmm_tlb_shootdown(&batch);
+    
+    debug_print("Shared ");
+    debug_print_hex(shared);
+    debug_print(" pages copy-on-write\n");
+    
+    return dir;
+}
+
+// Free a directory made by create_page_directory() or
+// clone_page_directory(); it must not be loaded on any CPU
+void destroy_page_directory(page_directory_t* dir) {
+    if (!dir || dir == &kernel_page_directory) {
+        return;
+    }
+    
+    for (int dir_index = 0; dir_index < PAGE_DIRECTORY_SIZE; dir_index++) {
+        uint32_t* table = dir->tables[dir_index];
+        if (!table || (dir->entries[dir_index] & PAGE_LARGE) ||
+            table == kernel_page_directory.tables[dir_index]) {
+            continue;
+        }
+        
+        // Writable and copy-on-write user pages each hold a reference
+        for (int i = 0; i < PAGE_TABLE_SIZE; i++) {
+            uint32_t pte = table[i];
+            if ((pte & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER) &&
+                (pte & (PAGE_WRITE | PAGE_COW))) {
+                pmm_frame_unref(PMM_ADDR_TO_FRAME(pte & PAGE_FRAME_MASK));
+            }
+        }
+        free_page(table);
+    }
+    vmm_free_directory(dir);
+}
+
+// Boot check of the clone path: a directory still sharing the kernel's
+// user window is cloned, then parent and child each write the same page.
+// Both must get their own copy and the kernel's page must stay intact.
+// Run with interrupts off, before other CPUs are started.
+int memory_cow_selftest(void) {
+    volatile uint32_t* page = (volatile uint32_t*)allocate_user_memory(PAGE_SIZE);
+    page[0] = 0x1111;
+    
+    page_directory_t* parent = create_page_directory();
+    page_directory_t* child = parent ? clone_page_directory(parent) : NULL;
+    if (!child) {
+        destroy_page_directory(parent);
+        debug_print("COW self-test: out of memory\n");
+        return -1;
+    }
+    
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    uint32_t copies = cow_copies;
+    
+    switch_page_directory(child);
+    page[0] = 0x2222;
+    switch_page_directory(parent);
+    uint32_t parent_saw = page[0];
+    page[0] = 0x3333;
+    switch_page_directory((page_directory_t*)(cr3 & PAGE_FRAME_MASK));
+    
+    uint32_t index = ((uint32_t)page / PAGE_SIZE) % PAGE_TABLE_SIZE;
+    int ok = parent_saw == 0x1111 && page[0] == 0x1111 &&
+             cow_copies - copies == 2 && (first_page_table[index] & PAGE_WRITE);
+    
+    destroy_page_directory(child);
+    destroy_page_directory(parent);
+    
+    debug_print(ok ? "COW self-test: passed\n" : "COW self-test: FAILED\n");
+    return ok ? 0 : -1;
+}
+
+// Resolve a write fault on a copy-on-write page in the current directory
+int memory_handle_cow_fault(uint32_t fault_addr, uint32_t err_code) {
+    if ((err_code & (PF_PRESENT | PF_WRITE)) != (PF_PRESENT | PF_WRITE)) {
+        return -1;
+    }
+    
+    // Page directories are identity mapped, so CR3 is also a pointer
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    page_directory_t* dir = (page_directory_t*)(cr3 & PAGE_FRAME_MASK);
+    
+    uint32_t dir_index = fault_addr / (PAGE_SIZE * PAGE_TABLE_SIZE);
+    uint32_t table_index = (fault_addr / PAGE_SIZE) % PAGE_TABLE_SIZE;
+    uint32_t* table = dir->tables[dir_index];
+    if (!table || (dir->entries[dir_index] & PAGE_LARGE)) {
+        return -1;
+    }
+    
+    uint32_t pte = table[table_index];
+    if ((pte & PAGE_PRESENT) && (pte & PAGE_WRITE)) {
+        // Already writable: another CPU resolved it, or this TLB still
+        // held the read-only entry. Drop the stale entry and retry.
+        asm volatile("invlpg (%0)" :: "r"(fault_addr) : "memory");
+        return 0;
+    }
+    if (!(pte & PAGE_PRESENT) || !(pte & PAGE_COW)) {
+        return -1;
+    }
+    
+    cow_faults++;
+    uint32_t frame = PMM_ADDR_TO_FRAME(pte & PAGE_FRAME_MASK);
+    uint32_t flags = (pte & 0xFFF & ~PAGE_COW) | PAGE_WRITE;
+    
+    if (pmm_frame_refcount(frame) > 1) {
+        // Still shared: give this mapping its own copy
+        void* copy = allocate_page();
+        if (!copy) {
+            return -1;
+        }
+        if (frame == pmm_zero_frame()) {
+            memset(copy, 0, PAGE_SIZE);
+        } else {
+            memcpy(copy, (void*)PMM_FRAME_TO_ADDR(frame), PAGE_SIZE);
+        }
+        pmm_frame_unref(frame);
+        table[table_index] = (uint32_t)copy | flags;
+        cow_copies++;
+    } else {
+        // Last reference: just take the page back
+        table[table_index] = PMM_FRAME_TO_ADDR(frame) | flags;
+    }
+    
+    asm volatile("invlpg (%0)" :: "r"(fault_addr) : "memory");
+    return 0;
+}
+
+// Get copy-on-write fault counters
+void memory_get_cow_stats(uint32_t* faults, uint32_t* copies) {
+    if (faults) {
+        *faults = cow_faults;
+    }
+    if (copies) {
+        *copies = cow_copies;
+    }
+}
+
 // Switch to a different page directory
 void switch_page_directory(page_directory_t* dir) {
     if (!dir) {
@@ -244,7 +509,14 @@ void switch_page_directory(page_directory_t* dir) {
     // With identity paging (virt=phys), cast pointer to physical address
     uint32_t phys_addr = (uint32_t)dir;
     
-    // Load the physical address into CR3
+    // Reloading the same CR3 would only throw away the TLB
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    if ((cr3 & PAGE_FRAME_MASK) == phys_addr) {
+        return;
+    }
+    
+    // Load the physical address into CR3 (global kernel entries survive)
     asm volatile(
         "mov %0, %%cr3\n"
         :
@@ -253,8 +525,10 @@ void switch_page_directory(page_directory_t* dir) {
     );
 }
 
-// Map a page in a specific directory
-void map_page_in_directory(page_directory_t* dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags) {
+// Map a page in a specific directory, queueing a flush if it replaced
+// a live translation
+void map_page_in_directory_batch(page_directory_t* dir, uint32_t virt_addr, uint32_t phys_addr,
+                                 uint32_t flags, vmm_tlb_batch_t* batch) {
     if (!dir) {
         kernel_panic("Attempted to map page in NULL directory");
     }
@@ -266,27 +540,49 @@ void map_page_in_directory(page_directory_t* dir, uint32_t virt_addr, uint32_t p
     // Invariant: dir->tables[dir_index] and dir->entries[dir_index] should be consistent
     // Either both NULL/zero or both set
     if (dir->tables[dir_index] == NULL) {
-        // Verify consistency - entry should also be empty
-        if (dir->entries[dir_index] != 0) {
+        uint32_t entry = dir->entries[dir_index];
+        
+        // Verify consistency - entry should be empty or a 4MB page
+        if (entry != 0 && !(entry & PAGE_LARGE)) {
             kernel_panic("Page directory inconsistent: entry set but table NULL");
         }
         
-        // Allocate a new page table
-        // Note: kmalloc is provided by kheap.c
-        extern void* kmalloc(size_t size);
-        uint32_t* new_table = (uint32_t*)kmalloc(PAGE_TABLE_SIZE * sizeof(uint32_t));
+        // Allocate a new page table (page-aligned, identity mapped)
+        uint32_t* new_table = (uint32_t*)allocate_page();
         if (!new_table) {
             kernel_panic("Failed to allocate page table");
         }
         memset(new_table, 0, PAGE_TABLE_SIZE * sizeof(uint32_t));
         
+        // Splitting a 4MB page: keep the other 1023 pages mapped as before
+        if (entry & PAGE_LARGE) {
+            uint32_t base = entry & 0xFFC00000;
+            uint32_t page_flags = entry & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER | PAGE_GLOBAL);
+            for (uint32_t i = 0; i < PAGE_TABLE_SIZE; i++) {
+                new_table[i] = (base + i * PAGE_SIZE) | page_flags;
+            }
+        }
+        
         // Update directory entry
         dir->entries[dir_index] = ((uint32_t)new_table) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
         dir->tables[dir_index] = new_table;
     }
     
     // Map the page in the table
+    uint32_t old = dir->tables[dir_index][table_index];
     dir->tables[dir_index][table_index] = phys_addr | flags;
+    
+    if (old & PAGE_PRESENT) {
+        vmm_tlb_batch_add(batch, virt_addr, old & PAGE_GLOBAL);
+    }
+}
+
+// Map a page in a specific directory
+void map_page_in_directory(page_directory_t* dir, uint32_t virt_addr, uint32_t phys_addr, uint32_t flags) {
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch);
+    map_page_in_directory_batch(dir, virt_addr, phys_addr, flags, &batch);
+    vmm_tlb_batch_flush(&batch);
 }
 
 // Get the detected memory end address
@@ -299,31 +595,92 @@ int memory_is_initialized(void) {
     return memory_initialized;
 }
 
-void memory_init(multiboot_info_t *mbi) {
-    memset(memory_bitmap, 0, BITMAP_SIZE);
+// Get the kernel heap size chosen at boot
+uint32_t memory_get_heap_size(void) {
+    return heap_size;
+}
 
-    for (int i = 0; i < TOTAL_PAGES; i++) {
-        set_page_free(i);
-    }
-    
+void memory_init(multiboot_info_t *mbi) {
     multiboot_parse_memory_map(mbi);
     
+    if (memory_end == 0 && (mbi->flags & 0x1)) {
+        // Fall back to the basic mem_upper field (KB above 1MB)
+        memory_end = 0x100000 + mbi->mem_upper * 1024;
+    }
+    memory_end &= ~(PAGE_SIZE - 1);
+    
     uint32_t kernel_start = (uint32_t)&__kernel_section_start;
     uint32_t kernel_end = (uint32_t)&__kernel_section_end;
     
-    uint32_t kernel_start_page = kernel_start / PAGE_SIZE;
-    uint32_t kernel_end_page = (kernel_end + PAGE_SIZE - 1) / PAGE_SIZE;
+    // Boot-time structures go above both the kernel and the identity-mapped
+    // user window so allocate_user_memory() never touches them
+    uint32_t placement = ALIGN_PAGE(kernel_end);
+    if (placement < USER_SPACE_END + 1) {
+        placement = ALIGN_PAGE(USER_SPACE_END + 1);
+    }
+    uint32_t boot_start = placement;
+    
+    uint8_t* pmm_bitmap = (uint8_t*)placement;
+    placement += ALIGN_PAGE(PMM_BITMAP_SIZE(memory_end));
     
-    for (uint32_t i = 0; i <= kernel_end_page; i++) {
-        set_page_used(i);
+    uint8_t* buddy_meta = (uint8_t*)placement;
+    placement += ALIGN_PAGE(PMM_BUDDY_META_SIZE(memory_end));
+    
+    uint8_t* frame_refs = (uint8_t*)placement;
+    placement += ALIGN_PAGE(PMM_REFS_SIZE(memory_end));
+    
+    heap_size = memory_end / HEAP_RAM_DIVISOR;
+    if (heap_size < HEAP_MIN_SIZE) {
+        heap_size = HEAP_MIN_SIZE;
+    }
+    if (heap_size > HEAP_MAX_SIZE) {
+        heap_size = HEAP_MAX_SIZE;
+    }
+    heap_size &= ~(PAGE_SIZE - 1);
+    void* heap_start = (void*)placement;
+    placement += heap_size;
+    
+    if (placement > memory_end) {
+        kernel_panic("Not enough memory for kernel heap");
+    }
+    
+    if (pmm_init(memory_end, pmm_bitmap) != 0) {
+        kernel_panic("Failed to initialize physical memory manager");
+    }
+    pmm_seed_from_multiboot(mbi);
+    
+    // The boot structures must sit in RAM the firmware reported as usable
+    for (uint32_t frame = PMM_ADDR_TO_FRAME(boot_start); frame < PMM_ADDR_TO_FRAME(placement); frame++) {
+        if (!pmm_is_frame_free(frame)) {
+            kernel_panic("Boot allocations overlap reserved memory");
+        }
+    }
+    
+    // Reserve low memory, the kernel, the user window and the boot structures
+    pmm_mark_range_used(0, PMM_ADDR_TO_FRAME(placement));
+    
+    if (pmm_buddy_init(buddy_meta) != 0) {
+        kernel_panic("Failed to initialize buddy allocator");
+    }
+    
+    if (pmm_refs_init(frame_refs) != 0) {
+        kernel_panic("Failed to initialize frame reference counts");
+    }
+    
+    if (kheap_init(heap_start, heap_size) != 0) {
+        kernel_panic("Failed to initialize kernel heap");
     }
     
     debug_print("Memory initialized\n");
-    debug_print("Kernel pages marked as used: ");
-    debug_print_hex(kernel_start_page);
+    debug_print("Kernel: ");
+    debug_print_hex(kernel_start);
     debug_print(" - ");
-    debug_print_hex(kernel_end_page);
+    debug_print_hex(kernel_end);
+    debug_print("\nBoot structures: ");
+    debug_print_hex(boot_start);
+    debug_print(" - ");
+    debug_print_hex(placement);
     debug_print("\n");
     
     memory_initialized = 1;
-}
\ No newline at end of file
+}
@@ -2,23 +2,260 @@
 #include "string.h"
 #include "video.h"
 #include "kernel.h"
+#include "spinlock.h"
 
 /* Global PMM state */
 static struct {
-    uint8_t* bitmap;          /* Bitmap: 1 = used, 0 = free */
+    uint32_t* bitmap;         /* Bitmap: 1 = used, 0 = free */
     uint32_t total_frames;    /* Total number of frames */
     uint32_t free_frames;     /* Number of free frames */
     uint32_t used_frames;     /* Number of used frames */
     uint32_t bitmap_size;     /* Size of bitmap in bytes */
+    uint32_t bitmap_words;    /* Size of bitmap in 32-bit words */
+    uint32_t next_free;       /* Word to start the next single-frame search */
+    uint16_t* refs;           /* Extra references per frame (NULL = off) */
+    uint32_t shared_frames;   /* Frames with at least one extra reference */
+    uint32_t zero_frame;      /* Pinned all-zero frame for lazy mappings */
     uint8_t initialized;      /* Is PMM initialized? */
 } g_pmm;
 
+/* Guards g_pmm and g_buddy; irqsave since the fault handler allocates */
+static spinlock_t g_pmm_lock = SPINLOCK_INIT;
+static lock_stats_t g_pmm_lock_stats;
+
 /* Bitmap manipulation macros */
-#define BITMAP_INDEX(frame) ((frame) / 8)
-#define BITMAP_OFFSET(frame) ((frame) % 8)
-#define BITMAP_GET(frame) (g_pmm.bitmap[BITMAP_INDEX(frame)] & (1 << BITMAP_OFFSET(frame)))
-#define BITMAP_SET(frame) (g_pmm.bitmap[BITMAP_INDEX(frame)] |= (1 << BITMAP_OFFSET(frame)))
-#define BITMAP_CLEAR(frame) (g_pmm.bitmap[BITMAP_INDEX(frame)] &= ~(1 << BITMAP_OFFSET(frame)))
+#define BITMAP_WORD_BITS 32
+#define BITMAP_FULL 0xFFFFFFFF
+#define BITMAP_INDEX(frame) ((frame) / BITMAP_WORD_BITS)
+#define BITMAP_OFFSET(frame) ((frame) % BITMAP_WORD_BITS)
+#define BITMAP_GET(frame) (g_pmm.bitmap[BITMAP_INDEX(frame)] & (1u << BITMAP_OFFSET(frame)))
+#define BITMAP_SET(frame) (g_pmm.bitmap[BITMAP_INDEX(frame)] |= (1u << BITMAP_OFFSET(frame)))
+#define BITMAP_CLEAR(frame) (g_pmm.bitmap[BITMAP_INDEX(frame)] &= ~(1u << BITMAP_OFFSET(frame)))
+
+/* Count set bits (no popcnt instruction or libgcc in the kernel) */
+static inline uint32_t popcount32(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+
+/* Bitmap word as seen by the allocator: frame 0 is never handed out
+ * because 0 is the failure return value */
+static inline uint32_t alloc_word(uint32_t index) {
+    return index == 0 ? (g_pmm.bitmap[0] | 1) : g_pmm.bitmap[index];
+}
+
+/* Set or clear a run of bits a word at a time, keeping counters in sync */
+static void bitmap_fill(uint32_t start, uint32_t count, int used) {
+    if (start >= g_pmm.total_frames) {
+        return;
+    }
+    if (count > g_pmm.total_frames - start) {
+        count = g_pmm.total_frames - start;
+    }
+    
+    uint32_t end = start + count;
+    while (start < end) {
+        uint32_t index = BITMAP_INDEX(start);
+        uint32_t offset = BITMAP_OFFSET(start);
+        uint32_t bits = BITMAP_WORD_BITS - offset;
+        if (bits > end - start) {
+            bits = end - start;
+        }
+        
+        uint32_t mask = (bits == BITMAP_WORD_BITS) ? BITMAP_FULL : (((1u << bits) - 1) << offset);
+        uint32_t old = g_pmm.bitmap[index];
+        uint32_t changed;
+        
+        if (used) {
+            changed = popcount32(mask & ~old);
+            g_pmm.bitmap[index] = old | mask;
+            g_pmm.used_frames += changed;
+            g_pmm.free_frames -= changed;
+        } else {
+            changed = popcount32(mask & old);
+            g_pmm.bitmap[index] = old & ~mask;
+            g_pmm.used_frames -= changed;
+            g_pmm.free_frames += changed;
+        }
+        
+        start += bits;
+    }
+}
+
+/* Find a free frame in words [from, to), or 0 */
+static uint32_t scan_words(uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        uint32_t word = alloc_word(i);
+        if (word != BITMAP_FULL) {
+            /* bsf on the inverted word gives the lowest clear bit */
+            uint32_t frame = i * BITMAP_WORD_BITS + (uint32_t)__builtin_ctz(~word);
+            if (frame < g_pmm.total_frames) {
+                return frame;
+            }
+        }
+    }
+    return 0;
+}
+
+/* ============== Buddy allocator ============== */
+
+/*
+ * Free blocks of 2^order frames (order 0..PMM_BUDDY_MAX_ORDER) are kept
+ * on per-order doubly linked lists threaded through a per-frame metadata
+ * array. The bitmap stays authoritative: every buddy allocation or free
+ * also sets or clears the bitmap bits, so pmm_is_frame_free() and the
+ * counters are unaffected. Frame 0 is never put on a list.
+ */
+
+#define BUDDY_NONE       0xFFFFFFFF
+#define BUDDY_FREE_HEAD  0x1
+
+static struct {
+    pmm_buddy_frame_t* frames;                 /* Per-frame metadata */
+    uint32_t free_lists[PMM_BUDDY_ORDERS];     /* Head frame per order */
+    pmm_buddy_stats_t stats;
+    uint8_t enabled;
+} g_buddy;
+
+/* Smallest order whose block holds count frames */
+static inline uint32_t order_for(uint32_t count) {
+    return count <= 1 ? 0 : 32 - (uint32_t)__builtin_clz(count - 1);
+}
+
+static inline int buddy_is_free_head(uint32_t frame, uint32_t order) {
+    return frame < g_pmm.total_frames &&
+           (g_buddy.frames[frame].flags & BUDDY_FREE_HEAD) &&
+           g_buddy.frames[frame].order == order;
+}
+
+static void buddy_push(uint32_t frame, uint32_t order) {
+    pmm_buddy_frame_t* meta = &g_buddy.frames[frame];
+    meta->order = (uint8_t)order;
+    meta->flags = BUDDY_FREE_HEAD;
+    meta->prev = BUDDY_NONE;
+    meta->next = g_buddy.free_lists[order];
+    if (meta->next != BUDDY_NONE) {
+        g_buddy.frames[meta->next].prev = frame;
+    }
+    g_buddy.free_lists[order] = frame;
+    g_buddy.stats.free_blocks[order]++;
+}
+
+static void buddy_unlink(uint32_t frame) {
+    pmm_buddy_frame_t* meta = &g_buddy.frames[frame];
+    if (meta->prev != BUDDY_NONE) {
+        g_buddy.frames[meta->prev].next = meta->next;
+    } else {
+        g_buddy.free_lists[meta->order] = meta->next;
+    }
+    if (meta->next != BUDDY_NONE) {
+        g_buddy.frames[meta->next].prev = meta->prev;
+    }
+    g_buddy.stats.free_blocks[meta->order]--;
+    meta->flags = 0;
+    meta->next = BUDDY_NONE;
+    meta->prev = BUDDY_NONE;
+}
+
+/* Take a free block of exactly 2^order frames, splitting larger ones */
+static uint32_t buddy_take(uint32_t order) {
+    uint32_t k = order;
+    while (k <= PMM_BUDDY_MAX_ORDER && g_buddy.free_lists[k] == BUDDY_NONE) {
+        k++;
+    }
+    if (k > PMM_BUDDY_MAX_ORDER) {
+        return BUDDY_NONE;
+    }
+    
+    uint32_t frame = g_buddy.free_lists[k];
+    buddy_unlink(frame);
+    
+    /* Return the upper halves to the lower orders */
+    while (k > order) {
+        k--;
+        buddy_push(frame + (1u << k), k);
+        g_buddy.stats.splits++;
+    }
+    return frame;
+}
+
+/* Return a block to the free lists, merging with free buddies */
+static void buddy_put(uint32_t frame, uint32_t order) {
+    while (order < PMM_BUDDY_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1u << order);
+        if (!buddy_is_free_head(buddy, order)) {
+            break;
+        }
+        buddy_unlink(buddy);
+        frame &= ~(1u << order);
+        order++;
+        g_buddy.stats.merges++;
+    }
+    buddy_push(frame, order);
+}
+
+/* Put a run of frames on the free lists as maximal aligned blocks */
+static void buddy_put_run(uint32_t start, uint32_t count) {
+    if (start == 0 && count > 0) {
+        start++;
+        count--;
+    }
+    while (count > 0) {
+        uint32_t order = start ? (uint32_t)__builtin_ctz(start) : PMM_BUDDY_MAX_ORDER;
+        if (order > PMM_BUDDY_MAX_ORDER) {
+            order = PMM_BUDDY_MAX_ORDER;
+        }
+        while ((1u << order) > count) {
+            order--;
+        }
+        buddy_put(start, order);
+        start += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+/* Pull one free frame out of whichever free block contains it */
+static void buddy_reserve(uint32_t frame) {
+    for (uint32_t k = 0; k <= PMM_BUDDY_MAX_ORDER; k++) {
+        uint32_t head = frame & ~((1u << k) - 1);
+        if (!buddy_is_free_head(head, k)) {
+            continue;
+        }
+        
+        buddy_unlink(head);
+        
+        /* Split down to the frame, keeping the halves it is not in */
+        while (k > 0) {
+            k--;
+            uint32_t half = 1u << k;
+            if (frame >= head + half) {
+                buddy_push(head, k);
+                head += half;
+            } else {
+                buddy_push(head + half, k);
+            }
+            g_buddy.stats.splits++;
+        }
+        return;
+    }
+}
+
+/* Is every frame in [start, start + count) free in the bitmap? */
+static int range_is_free(uint32_t start, uint32_t count) {
+    for (uint32_t f = start; f < start + count; f++) {
+        if (BITMAP_OFFSET(f) == 0 && f + BITMAP_WORD_BITS <= start + count) {
+            if (g_pmm.bitmap[BITMAP_INDEX(f)] != 0) {
+                return 0;
+            }
+            f += BITMAP_WORD_BITS - 1;
+        } else if (BITMAP_GET(f)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
 int pmm_init(uint32_t mem_size, void* bitmap) {
     if (g_pmm.initialized) {
@@ -31,12 +268,13 @@ int pmm_init(uint32_t mem_size, void* bitmap) {
         return -1;
     }
     
-    /* Calculate bitmap size (one bit per frame) */
-    g_pmm.bitmap_size = (g_pmm.total_frames + 7) / 8;
+    /* Calculate bitmap size (one bit per frame, whole words) */
+    g_pmm.bitmap_words = (g_pmm.total_frames + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    g_pmm.bitmap_size = g_pmm.bitmap_words * sizeof(uint32_t);
     
     /* Use provided bitmap or allocate from kernel */
     if (bitmap) {
-        g_pmm.bitmap = (uint8_t*)bitmap;
+        g_pmm.bitmap = (uint32_t*)bitmap;
     } else {
         /* This would need a simple allocator before PMM is ready */
         debug_print("PMM: No bitmap provided, cannot initialize\n");
@@ -46,8 +284,15 @@ int pmm_init(uint32_t mem_size, void* bitmap) {
     /* Clear bitmap - all frames initially free */
     memset(g_pmm.bitmap, 0, g_pmm.bitmap_size);
     
+    /* Bits past the last frame read as used so word scans skip them */
+    if (g_pmm.total_frames % BITMAP_WORD_BITS) {
+        g_pmm.bitmap[g_pmm.bitmap_words - 1] = BITMAP_FULL << (g_pmm.total_frames % BITMAP_WORD_BITS);
+    }
+    
     g_pmm.free_frames = g_pmm.total_frames;
     g_pmm.used_frames = 0;
+    g_pmm.next_free = 0;
+    spin_init(&g_pmm_lock, "pmm", &g_pmm_lock_stats);
     g_pmm.initialized = 1;
     
     debug_print("PMM: initialized with ");
@@ -59,100 +304,415 @@ int pmm_init(uint32_t mem_size, void* bitmap) {
     return 0;
 }
 
-void pmm_mark_used(uint32_t frame) {
+static void mark_used_locked(uint32_t frame) {
     if (frame >= g_pmm.total_frames) {
         return;
     }
     
     if (!BITMAP_GET(frame)) {
+        if (g_buddy.enabled) {
+            buddy_reserve(frame);
+        }
         BITMAP_SET(frame);
         g_pmm.used_frames++;
         g_pmm.free_frames--;
     }
 }
 
-void pmm_mark_free(uint32_t frame) {
+void pmm_mark_used(uint32_t frame) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    mark_used_locked(frame);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+/* A freed frame starts over with no extra references. Any left mean a
+ * mapping still shares it (a caller bug), but the next owner must not
+ * inherit them and copy or unref on its first COW fault. */
+static void drop_refs_locked(uint32_t frame) {
+    if (!g_pmm.refs || g_pmm.refs[frame] == 0) {
+        return;
+    }
+    
+    debug_print("PMM: freeing frame 0x");
+    debug_print_hex(frame);
+    debug_print(" with references left\n");
+    g_pmm.refs[frame] = 0;
+    g_pmm.shared_frames--;
+}
+
+static void mark_free_locked(uint32_t frame) {
     if (frame >= g_pmm.total_frames) {
         return;
     }
     
     if (BITMAP_GET(frame)) {
+        drop_refs_locked(frame);
         BITMAP_CLEAR(frame);
         g_pmm.used_frames--;
         g_pmm.free_frames++;
+        if (g_buddy.enabled && frame != 0) {
+            buddy_put(frame, 0);
+        }
     }
 }
 
+void pmm_mark_free(uint32_t frame) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    mark_free_locked(frame);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+static void mark_range_used_locked(uint32_t start, uint32_t count) {
+    if (g_buddy.enabled) {
+        for (uint32_t f = start; f < start + count && f < g_pmm.total_frames; f++) {
+            if (!BITMAP_GET(f)) {
+                buddy_reserve(f);
+            }
+        }
+    }
+    bitmap_fill(start, count, 1);
+}
+
 void pmm_mark_range_used(uint32_t start, uint32_t count) {
-    for (uint32_t i = 0; i < count; i++) {
-        pmm_mark_used(start + i);
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    mark_range_used_locked(start, count);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+static void mark_range_free_locked(uint32_t start, uint32_t count) {
+    if (!g_buddy.enabled) {
+        if (g_pmm.refs) {
+            for (uint32_t f = start; f - start < count && f < g_pmm.total_frames; f++) {
+                if (BITMAP_GET(f)) {
+                    drop_refs_locked(f);
+                }
+            }
+        }
+        bitmap_fill(start, count, 0);
+        return;
+    }
+    
+    if (start >= g_pmm.total_frames) {
+        return;
+    }
+    if (count > g_pmm.total_frames - start) {
+        count = g_pmm.total_frames - start;
+    }
+    
+    /* Only frames that were in use go back on the free lists */
+    uint32_t end = start + count;
+    uint32_t f = start;
+    while (f < end) {
+        if (!BITMAP_GET(f)) {
+            f++;
+            continue;
+        }
+        uint32_t run = f;
+        while (f < end && BITMAP_GET(f)) {
+            drop_refs_locked(f);
+            f++;
+        }
+        bitmap_fill(run, f - run, 0);
+        buddy_put_run(run, f - run);
     }
 }
 
 void pmm_mark_range_free(uint32_t start, uint32_t count) {
-    for (uint32_t i = 0; i < count; i++) {
-        pmm_mark_free(start + i);
-    }
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    mark_range_free_locked(start, count);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
 }
 
-uint32_t pmm_alloc_frame(void) {
+static uint32_t alloc_order_locked(uint32_t order);
+
+static uint32_t alloc_frame_locked(void) {
     if (!g_pmm.initialized || g_pmm.free_frames == 0) {
         return 0;
     }
     
-    /* Search for a free frame */
-    for (uint32_t i = 1; i < g_pmm.total_frames; i++) { /* Skip frame 0 */
-        if (!BITMAP_GET(i)) {
-            BITMAP_SET(i);
-            g_pmm.used_frames++;
-            g_pmm.free_frames--;
-            return i;
-        }
+    if (g_buddy.enabled) {
+        return alloc_order_locked(0);
+    }
+    
+    /* Search from the rotating hint, then wrap around */
+    uint32_t frame = scan_words(g_pmm.next_free, g_pmm.bitmap_words);
+    if (frame == 0) {
+        frame = scan_words(0, g_pmm.next_free);
+    }
+    if (frame == 0) {
+        return 0; /* No free frame found */
     }
     
-    return 0; /* No free frame found */
+    BITMAP_SET(frame);
+    g_pmm.used_frames++;
+    g_pmm.free_frames--;
+    g_pmm.next_free = BITMAP_INDEX(frame);
+    return frame;
 }
 
-uint32_t pmm_alloc_frames(uint32_t count) {
-    if (!g_pmm.initialized || g_pmm.free_frames < count) {
+uint32_t pmm_alloc_frame(void) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint32_t frame = alloc_frame_locked();
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return frame;
+}
+
+static uint32_t alloc_frames_locked(uint32_t count) {
+    if (!g_pmm.initialized || count == 0 || g_pmm.free_frames < count) {
         return 0;
     }
     
+    /* Round up to a buddy block and give back the unused tail */
+    uint32_t order = order_for(count);
+    if (g_buddy.enabled && order <= PMM_BUDDY_MAX_ORDER) {
+        uint32_t frame = buddy_take(order);
+        if (frame == BUDDY_NONE) {
+            return 0;
+        }
+        g_buddy.stats.allocs++;
+        bitmap_fill(frame, count, 1);
+        buddy_put_run(frame + count, (1u << order) - count);
+        return frame;
+    }
+    
+    if (g_buddy.enabled) {
+        g_buddy.stats.fallbacks++;
+    }
+    
     uint32_t consecutive = 0;
     uint32_t start_frame = 0;
     
-    /* Search for contiguous free frames */
-    for (uint32_t i = 1; i < g_pmm.total_frames && consecutive < count; i++) {
-        if (!BITMAP_GET(i)) {
+    /* Search for contiguous free frames, a whole word at a time where possible */
+    for (uint32_t i = 0; i < g_pmm.bitmap_words; i++) {
+        uint32_t word = alloc_word(i);
+        
+        if (word == BITMAP_FULL) {
+            consecutive = 0;
+            continue;
+        }
+        
+        if (word == 0) {
             if (consecutive == 0) {
-                start_frame = i;
+                start_frame = i * BITMAP_WORD_BITS;
             }
-            consecutive++;
+            consecutive += BITMAP_WORD_BITS;
         } else {
-            consecutive = 0;
-            start_frame = 0;
+            for (uint32_t bit = 0; bit < BITMAP_WORD_BITS; bit++) {
+                if (word & (1u << bit)) {
+                    consecutive = 0;
+                    continue;
+                }
+                if (consecutive == 0) {
+                    start_frame = i * BITMAP_WORD_BITS + bit;
+                }
+                if (++consecutive >= count) {
+                    break;
+                }
+            }
         }
+        
+        /* Found enough contiguous frames */
+        if (consecutive >= count) {
+            mark_range_used_locked(start_frame, count);
+            return start_frame;
+        }
+    }
+    
+    return 0; /* Not enough contiguous frames */
+}
+
+uint32_t pmm_alloc_frames(uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint32_t frame = alloc_frames_locked(count);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return frame;
+}
+
+int pmm_buddy_init(void* meta) {
+    if (!g_pmm.initialized || !meta) {
+        return -1;
+    }
+    if (g_buddy.enabled) {
+        return 0;
     }
     
-    /* Found enough contiguous frames */
-    if (consecutive >= count) {
-        for (uint32_t i = 0; i < count; i++) {
-            BITMAP_SET(start_frame + i);
+    g_buddy.frames = (pmm_buddy_frame_t*)meta;
+    memset(g_buddy.frames, 0, g_pmm.total_frames * sizeof(pmm_buddy_frame_t));
+    memset(&g_buddy.stats, 0, sizeof(g_buddy.stats));
+    for (uint32_t k = 0; k < PMM_BUDDY_ORDERS; k++) {
+        g_buddy.free_lists[k] = BUDDY_NONE;
+    }
+    
+    /* Seed the free lists from the bitmap with maximal aligned blocks */
+    uint32_t f = 1;
+    while (f < g_pmm.total_frames) {
+        if (BITMAP_OFFSET(f) == 0 && g_pmm.bitmap[BITMAP_INDEX(f)] == BITMAP_FULL) {
+            f += BITMAP_WORD_BITS;
+            continue;
+        }
+        if (BITMAP_GET(f)) {
+            f++;
+            continue;
+        }
+        
+        uint32_t order = (uint32_t)__builtin_ctz(f);
+        if (order > PMM_BUDDY_MAX_ORDER) {
+            order = PMM_BUDDY_MAX_ORDER;
         }
-        g_pmm.used_frames += count;
-        g_pmm.free_frames -= count;
-        return start_frame;
+        while (order > 0 && (f + (1u << order) > g_pmm.total_frames ||
+                             !range_is_free(f, 1u << order))) {
+            order--;
+        }
+        buddy_push(f, order);
+        f += 1u << order;
     }
     
-    return 0; /* Not enough contiguous frames */
+    g_buddy.enabled = 1;
+    
+    debug_print("PMM: buddy allocator enabled, max order ");
+    debug_print_hex(PMM_BUDDY_MAX_ORDER);
+    debug_print("\n");
+    
+    return 0;
+}
+
+static uint32_t alloc_order_locked(uint32_t order) {
+    if (!g_buddy.enabled || order > PMM_BUDDY_MAX_ORDER) {
+        return 0;
+    }
+    
+    uint32_t frame = buddy_take(order);
+    if (frame == BUDDY_NONE) {
+        return 0;
+    }
+    
+    g_buddy.stats.allocs++;
+    bitmap_fill(frame, 1u << order, 1);
+    return frame;
+}
+
+uint32_t pmm_alloc_order(uint32_t order) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint32_t frame = alloc_order_locked(order);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return frame;
+}
+
+void pmm_free_order(uint32_t frame, uint32_t order) {
+    if (order > PMM_BUDDY_MAX_ORDER) {
+        return;
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    g_buddy.stats.frees++;
+    mark_range_free_locked(frame, 1u << order);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+void pmm_get_buddy_stats(pmm_buddy_stats_t* stats) {
+    if (stats) {
+        *stats = g_buddy.stats;
+        stats->enabled = g_buddy.enabled;
+    }
 }
 
 void pmm_free_frame(uint32_t frame) {
     pmm_mark_free(frame);
 }
 
+/* ============== Frame reference counts ============== */
+
+/*
+ * Only references beyond the owner are stored, so allocation never has
+ * to touch the array and a zero-filled array is valid at init. Counts
+ * that reach REFS_PINNED stay there.
+ */
+#define REFS_PINNED 0xFFFF
+
+int pmm_refs_init(void* refs) {
+    if (!g_pmm.initialized || !refs) {
+        return -1;
+    }
+    
+    g_pmm.refs = (uint16_t*)refs;
+    memset(g_pmm.refs, 0, g_pmm.total_frames * sizeof(uint16_t));
+    g_pmm.shared_frames = 0;
+    
+    g_pmm.zero_frame = pmm_alloc_frame();
+    if (g_pmm.zero_frame == 0) {
+        return -1;
+    }
+    memset((void*)(uintptr_t)PMM_FRAME_TO_ADDR(g_pmm.zero_frame), 0, PMM_PAGE_SIZE);
+    g_pmm.refs[g_pmm.zero_frame] = REFS_PINNED;
+    g_pmm.shared_frames++;
+    return 0;
+}
+
+uint32_t pmm_zero_frame(void) {
+    return g_pmm.zero_frame;
+}
+
+static uint32_t frame_ref_locked(uint32_t frame) {
+    if (!g_pmm.refs || frame == 0 || frame >= g_pmm.total_frames || !BITMAP_GET(frame)) {
+        return 0;
+    }
+    if (g_pmm.refs[frame] == REFS_PINNED) {
+        return 0;
+    }
+    
+    if (g_pmm.refs[frame]++ == 0) {
+        g_pmm.shared_frames++;
+    }
+    return (uint32_t)g_pmm.refs[frame] + 1;
+}
+
+uint32_t pmm_frame_ref(uint32_t frame) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint32_t refs = frame_ref_locked(frame);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return refs;
+}
+
+static uint32_t frame_unref_locked(uint32_t frame) {
+    if (frame == 0 || frame >= g_pmm.total_frames || !BITMAP_GET(frame)) {
+        return 0;
+    }
+    
+    if (g_pmm.refs && g_pmm.refs[frame] > 0) {
+        if (g_pmm.refs[frame] == REFS_PINNED) {
+            return REFS_PINNED + 1;
+        }
+        if (--g_pmm.refs[frame] == 0) {
+            g_pmm.shared_frames--;
+        }
+        return (uint32_t)g_pmm.refs[frame] + 1;
+    }
+    
+    mark_free_locked(frame);
+    return 0;
+}
+
+uint32_t pmm_frame_unref(uint32_t frame) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint32_t refs = frame_unref_locked(frame);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return refs;
+}
+
+uint32_t pmm_frame_refcount(uint32_t frame) {
+    if (frame >= g_pmm.total_frames || !BITMAP_GET(frame)) {
+        return 0;
+    }
+    return g_pmm.refs ? (uint32_t)g_pmm.refs[frame] + 1 : 1;
+}
+
 void pmm_free_frames(uint32_t start, uint32_t count) {
-    pmm_mark_range_free(start, count);
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    if (g_buddy.enabled) {
+        g_buddy.stats.frees++;
+    }
+    mark_range_free_locked(start, count);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
 }
 
 int pmm_is_frame_free(uint32_t frame) {
@@ -173,6 +733,7 @@ void pmm_get_stats(pmm_stats_t* stats) {
     stats->reserved_frames = 0; /* Not tracked separately */
     stats->total_memory = (g_pmm.total_frames * PMM_PAGE_SIZE) / 1024;
     stats->free_memory = (g_pmm.free_frames * PMM_PAGE_SIZE) / 1024;
+    stats->shared_frames = g_pmm.shared_frames;
     stats->initialized = g_pmm.initialized;
 }
 
@@ -188,6 +749,19 @@ void pmm_dump(void) {
     debug_print_hex(g_pmm.bitmap_size);
     debug_print(" bytes\n");
     
+    if (g_buddy.enabled) {
+        debug_print("Buddy splits: ");
+        debug_print_hex(g_buddy.stats.splits);
+        debug_print(" merges: ");
+        debug_print_hex(g_buddy.stats.merges);
+        debug_print("\nFree blocks per order:");
+        for (uint32_t k = 0; k < PMM_BUDDY_ORDERS; k++) {
+            debug_print(" ");
+            debug_print_hex(g_buddy.stats.free_blocks[k]);
+        }
+        debug_print("\n");
+    }
+    
     /* Show first 64 frames as sample */
     debug_print("First 64 frames: ");
     for (int i = 0; i < 64 && i < (int)g_pmm.total_frames; i++) {
@@ -201,17 +775,27 @@ void pmm_dump(void) {
     debug_print("\n================================\n");
 }
 
-uint32_t pmm_get_free_frames(uint32_t* frames, uint32_t count) {
+static uint32_t get_free_frames_locked(uint32_t* frames, uint32_t count) {
     if (!frames || count == 0) {
         return 0;
     }
     
     uint32_t found = 0;
-    for (uint32_t i = 1; i < g_pmm.total_frames && found < count; i++) {
-        if (!BITMAP_GET(i)) {
-            frames[found++] = i;
+    for (uint32_t i = 0; i < g_pmm.bitmap_words && found < count; i++) {
+        uint32_t word = alloc_word(i);
+        while (word != BITMAP_FULL && found < count) {
+            uint32_t bit = (uint32_t)__builtin_ctz(~word);
+            frames[found++] = i * BITMAP_WORD_BITS + bit;
+            word |= 1u << bit;
         }
     }
     
+    return found;
+}
+
+uint32_t pmm_get_free_frames(uint32_t* frames, uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&g_pmm_lock);
+    uint32_t found = get_free_frames_locked(frames, count);
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
     return found;
 }
\ No newline at end of file
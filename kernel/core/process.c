@@ -10,24 +10,60 @@
 #define MAX_PROCESSES 32
 #define USER_STACK_SIZE 4096
 
+// PID -> process hash (open addressing, linear probing). Twice the
+// process limit keeps probe sequences short
+#define PID_HASH_BITS 6
+#define PID_HASH_SIZE (1 << PID_HASH_BITS)   // 2 * MAX_PROCESSES
+#define PID_HASH_MASK (PID_HASH_SIZE - 1)
+
 static process_t* current_process = NULL;
 static process_t* process_list_head = NULL;
 static uint32 next_pid = 0;
+static uint32 process_count = 0;
+static process_t* pid_hash[PID_HASH_SIZE];
+
+// Fibonacci hashing spreads sequential PIDs across the table
+static inline uint32 pid_slot(uint32 pid) {
+    return (pid * 2654435769u) >> (32 - PID_HASH_BITS);
+}
+
+static void pid_hash_insert(process_t* proc) {
+    uint32 slot = pid_slot(proc->pid);
+    while (pid_hash[slot]) {
+        slot = (slot + 1) & PID_HASH_MASK;
+    }
+    pid_hash[slot] = proc;
+}
 
 // Get current process
+// This is the owner of the loaded page directory: kernel tasks run in
+// whatever address space is loaded, so it is not necessarily the caller's
 process_t* process_get_current(void) {
     return current_process;
 }
 
+// Get the process of the task running on this CPU
+process_t* process_get_running(void) {
+    task_t* task = task_get_current();
+    return task ? (process_t*)task->process : NULL;
+}
+
 // Initialize process subsystem
 void process_init(void) {
     current_process = NULL;
     process_list_head = NULL;
     next_pid = 0;
+    process_count = 0;
+    memset(pid_hash, 0, sizeof(pid_hash));
 }
 
 // Process creation with user space support
 process_t* process_create(void (*entry_point)(void), uint32 is_user_mode) {
+    // The PID hash relies on this limit to always have free slots
+    if (process_count >= MAX_PROCESSES) {
+        return NULL;
+    }
+    
     // Allocate process structure
     process_t* new_process = (process_t*)kmalloc(sizeof(process_t));
     if (!new_process) {
@@ -40,8 +76,9 @@ process_t* process_create(void (*entry_point)(void), uint32 is_user_mode) {
     // Initialize message queue for IPC (Step 5)
     message_queue_init(&new_process->inbox);
     
-    // Create page directory for this process
-    new_process->page_dir = create_page_directory();
+    // Create page directory for this process, sharing the parent's
+    // user pages copy-on-write instead of starting from scratch
+    new_process->page_dir = clone_page_directory(current_process ? current_process->page_dir : NULL);
     if (!new_process->page_dir) {
         kfree(new_process);
         return NULL;
@@ -67,7 +104,6 @@ process_t* process_create(void (*entry_point)(void), uint32 is_user_mode) {
         // First process
         process_list_head = new_process;
         new_process->next = new_process; // Points to itself
-        current_process = new_process;
     } else {
         // Insert at end of circular list
         process_t* last = process_list_head;
@@ -77,11 +113,15 @@ process_t* process_create(void (*entry_point)(void), uint32 is_user_mode) {
         last->next = new_process;
         new_process->next = process_list_head;
     }
+    pid_hash_insert(new_process);
+    process_count++;
     
     return new_process;
 }
 
 // Switch to a different process (changes address space)
+// Called by the timer tick when the next task belongs to another process;
+// current_process is the owner of the loaded directory
 void process_switch(process_t* next) {
     if (!next) {
         return;
@@ -95,18 +135,20 @@ void process_switch(process_t* next) {
 }
 
 // Find a process by PID (Step 5 - needed for IPC)
+// O(1) expected: every SYS_SEND looks up its target here
 process_t* process_find_by_pid(uint32 pid) {
-    if (!process_list_head) {
-        return NULL;
-    }
+    uint32 slot = pid_slot(pid);
     
-    process_t* proc = process_list_head;
-    do {
+    for (uint32 probes = 0; probes < PID_HASH_SIZE; probes++) {
+        process_t* proc = pid_hash[slot];
+        if (!proc) {
+            return NULL;  // Not found
+        }
         if (proc->pid == pid) {
             return proc;
         }
-        proc = proc->next;
-    } while (proc != process_list_head);
+        slot = (slot + 1) & PID_HASH_MASK;
+    }
     
     return NULL;  // Not found
 }
@@ -0,0 +1,94 @@
+#include "sched_trace.h"
+#include "video.h"
+
+/* Global trace ring */
+static struct {
+    sched_trace_event_t ring[SCHED_TRACE_SIZE];
+    volatile uint32_t head;     /* Events claimed so far */
+} g_trace;
+
+static inline uint64_t read_tsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+void sched_trace(uint8_t event, uint32_t task_id, uint8_t arg) {
+    uint32_t seq = __sync_fetch_and_add(&g_trace.head, 1);
+    sched_trace_event_t* ev = &g_trace.ring[seq & SCHED_TRACE_MASK];
+
+    /* Readers skip the slot until the sequence number is published */
+    ev->seq = 0;
+    asm volatile("" : : : "memory");
+    ev->tsc = read_tsc();
+    ev->task_id = (uint16_t)task_id;
+    ev->event = event;
+    ev->arg = arg;
+    asm volatile("" : : : "memory");
+    ev->seq = seq + 1;
+}
+
+uint32_t sched_trace_snapshot(sched_trace_event_t* out, uint32_t max) {
+    if (!out || max == 0) {
+        return 0;
+    }
+
+    uint32_t head = g_trace.head;
+    uint32_t avail = head < SCHED_TRACE_SIZE ? head : SCHED_TRACE_SIZE;
+    if (max > avail) {
+        max = avail;
+    }
+
+    uint32_t copied = 0;
+    for (uint32_t seq = head - max; seq != head; seq++) {
+        const sched_trace_event_t* ev = &g_trace.ring[seq & SCHED_TRACE_MASK];
+        out[copied] = *ev;
+        asm volatile("" : : : "memory");
+        /* Keep it only if nobody reused the slot while we copied */
+        if (out[copied].seq == seq + 1 && ev->seq == seq + 1) {
+            copied++;
+        }
+    }
+    return copied;
+}
+
+uint32_t sched_trace_count(void) {
+    return g_trace.head;
+}
+
+const char* sched_trace_event_name(uint8_t event) {
+    switch (event) {
+        case SCHED_EV_SWITCH_IN:  return "in";
+        case SCHED_EV_SWITCH_OUT: return "out";
+        case SCHED_EV_WAKE:       return "wake";
+        case SCHED_EV_BLOCK:      return "block";
+        case SCHED_EV_SLEEP:      return "sleep";
+        case SCHED_EV_EXIT:       return "exit";
+        default:                  return "?";
+    }
+}
+
+void sched_trace_dump(void) {
+    static sched_trace_event_t events[SCHED_TRACE_SIZE];
+    uint32_t count = sched_trace_snapshot(events, SCHED_TRACE_SIZE);
+
+    debug_print("\n=== Scheduler Trace (");
+    debug_print_hex(count);
+    debug_print(" events, TSC delta / task / event / arg) ===\n");
+
+    uint64_t prev = count ? events[0].tsc : 0;
+    for (uint32_t i = 0; i < count; i++) {
+        sched_trace_event_t* ev = &events[i];
+        uint64_t delta = ev->tsc - prev;
+        prev = ev->tsc;
+
+        debug_print_hex(delta > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)delta);
+        debug_print(" ");
+        debug_print_hex(ev->task_id);
+        debug_print(" ");
+        debug_print(sched_trace_event_name(ev->event));
+        debug_print(" ");
+        debug_print_hex(ev->arg);
+        debug_print("\n");
+    }
+}
@@ -3,20 +3,56 @@
 #include "string.h"
 #include "video.h"
 #include "kernel.h"
+#include "clock.h"
+#include "timer.h"
+#include "fpu.h"
+#include "sched_trace.h"
+#include "smp.h"
+#include "spinlock.h"
+
+/* Per-CPU run queues */
+typedef struct {
+    sched_task_t* current;                    /* Running on this CPU */
+    sched_task_t* run_queues[SCHED_PRIORITY_LEVELS]; /* Priority queues */
+    sched_task_t* run_tails[SCHED_PRIORITY_LEVELS];  /* Last task per queue */
+    uint32_t ready_bitmap;                    /* Bit p set = queue p non-empty */
+    uint32_t nr_ready;                        /* Queued tasks, the running one included */
+    sched_task_t* prev;                       /* Switched away from, stack still live */
+    sched_task_t* handoff;                    /* Run next, ahead of the queues */
+    uint8_t need_resched;                     /* Switch at the next schedule */
+    uint8_t resched_reason;                   /* sched_out_reason_t for the trace */
+} sched_rq_t;
 
 /* Global scheduler state */
 static struct {
-    sched_task_t* current;                    /* Currently running task */
-    sched_task_t* run_queues[SCHED_PRIORITY_LEVELS]; /* Priority queues */
+    sched_rq_t rqs[SMP_MAX_CPUS];
     sched_task_t task_pool[SCHED_MAX_TASKS];  /* Task pool */
     sched_stats_t stats;
     uint64_t ticks;                           /* Total timer ticks */
+    uint32_t online_mask;                     /* CPUs scheduling from their queues */
+    ticket_lock_t lock;
+    lock_stats_t lock_stats;
     uint8_t initialized;
 } g_sched;
 
 /* External timer ticks from kernel */
 extern volatile uint64 g_timer_ticks;
 
+/* One lock covers every run queue: wakeups, steals and migrations touch
+ * two of them. Every CPU's tick takes it, so it is a ticket lock to keep
+ * a busy CPU from starving the others. Interrupts stay off while held. */
+static inline uint32_t sched_lock(void) {
+    return ticket_lock_irqsave(&g_sched.lock);
+}
+
+static inline void sched_unlock(uint32_t flags) {
+    ticket_unlock_irqrestore(&g_sched.lock, flags);
+}
+
+static inline sched_rq_t* this_rq(void) {
+    return &g_sched.rqs[smp_cpu_id()];
+}
+
 /* Find a free slot in the task pool */
 static sched_task_t* find_free_slot(void) {
     for (int i = 0; i < SCHED_MAX_TASKS; i++) {
@@ -28,30 +64,46 @@ static sched_task_t* find_free_slot(void) {
     return NULL;
 }
 
-/* Add task to the end of a priority queue */
-static void enqueue_task(sched_task_t* stask) {
-    if (!stask) return;
-    
+/* Queue index for a task (out-of-range priorities run as normal) */
+static inline int task_queue(sched_task_t* stask) {
     int prio = stask->priority;
     if (prio >= SCHED_PRIORITY_LEVELS) {
         prio = SCHED_PRIORITY_NORMAL;
     }
+    return prio;
+}
+
+/* Wake latency and CPU accounting are measured in nanoseconds */
+static inline uint64_t sched_clock(void) {
+    return clock_monotonic_ns();
+}
+
+/* Ask a CPU for a switch at its next schedule, remembering why */
+static inline void request_resched(sched_rq_t* rq, uint8_t reason) {
+    rq->need_resched = 1;
+    rq->resched_reason = reason;
+}
+
+/* Add task to the end of a priority queue of its CPU */
+static void enqueue_task(sched_task_t* stask) {
+    if (!stask) return;
+    
+    sched_rq_t* rq = &g_sched.rqs[stask->cpu];
+    int prio = task_queue(stask);
     
     stask->next = NULL;
-    stask->prev = NULL;
+    stask->prev = rq->run_tails[prio];
     
-    if (!g_sched.run_queues[prio]) {
-        g_sched.run_queues[prio] = stask;
+    if (!rq->run_queues[prio]) {
+        rq->run_queues[prio] = stask;
+        rq->ready_bitmap |= 1u << prio;
     } else {
-        /* Find end of queue */
-        sched_task_t* current = g_sched.run_queues[prio];
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = stask;
-        stask->prev = current;
+        rq->run_tails[prio]->next = stask;
     }
+    rq->run_tails[prio] = stask;
+    stask->ready_stamp = sched_clock();
     
+    rq->nr_ready++;
     g_sched.stats.ready_tasks++;
 }
 
@@ -59,84 +111,224 @@ static void enqueue_task(sched_task_t* stask) {
 static void dequeue_task(sched_task_t* stask) {
     if (!stask) return;
     
-    int prio = stask->priority;
-    if (prio >= SCHED_PRIORITY_LEVELS) {
-        prio = SCHED_PRIORITY_NORMAL;
-    }
+    sched_rq_t* rq = &g_sched.rqs[stask->cpu];
+    int prio = task_queue(stask);
     
     if (stask->prev) {
         stask->prev->next = stask->next;
+    } else if (rq->run_queues[prio] == stask) {
+        rq->run_queues[prio] = stask->next;
     } else {
-        g_sched.run_queues[prio] = stask->next;
+        return; /* Not queued */
     }
     
     if (stask->next) {
         stask->next->prev = stask->prev;
+    } else {
+        rq->run_tails[prio] = stask->prev;
+    }
+    
+    if (!rq->run_queues[prio]) {
+        rq->ready_bitmap &= ~(1u << prio);
     }
     
     stask->next = NULL;
     stask->prev = NULL;
     
+    if (rq->nr_ready > 0) {
+        rq->nr_ready--;
+    }
     if (g_sched.stats.ready_tasks > 0) {
         g_sched.stats.ready_tasks--;
     }
 }
 
-/* Find highest priority ready task */
-static sched_task_t* find_next_task(void) {
-    for (int prio = SCHED_PRIORITY_LEVELS - 1; prio >= 0; prio--) {
-        if (g_sched.run_queues[prio]) {
-            return g_sched.run_queues[prio];
+/* Find highest priority ready task: the top set bit picks the queue */
+static sched_task_t* find_next_task(sched_rq_t* rq) {
+    if (!rq->ready_bitmap) {
+        return NULL;
+    }
+    return rq->run_queues[31 - __builtin_clz(rq->ready_bitmap)];
+}
+
+/* Least loaded online CPU in an affinity mask */
+static uint32_t pick_cpu(uint32_t affinity) {
+    uint32_t best = 0;
+    uint32_t best_load = 0xFFFFFFFF;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!(affinity & g_sched.online_mask & (1u << cpu))) {
+            continue;
+        }
+        if (g_sched.rqs[cpu].nr_ready < best_load) {
+            best = cpu;
+            best_load = g_sched.rqs[cpu].nr_ready;
         }
     }
-    return NULL;
+    return best;
+}
+
+/* Move a queued task that no CPU is running to another run queue */
+static void migrate_task(sched_task_t* stask, uint32_t cpu) {
+    uint64_t stamp = stask->ready_stamp;
+    dequeue_task(stask);
+    stask->cpu = cpu;
+    enqueue_task(stask);
+    stask->ready_stamp = stamp;
+}
+
+/* Pull the best task this CPU may run off another CPU's queues; ties go
+ * to the busier queue. Idle-priority tasks are never worth moving. */
+static sched_task_t* steal_task(uint32_t cpu) {
+    sched_task_t* best = NULL;
+    uint32_t best_load = 0;
+    
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        sched_rq_t* rq = &g_sched.rqs[i];
+        if (i == cpu || !(g_sched.online_mask & (1u << i)) || rq->nr_ready < 2) {
+            continue;
+        }
+        for (int prio = SCHED_PRIORITY_LEVELS - 1; prio > SCHED_PRIORITY_IDLE; prio--) {
+            if (best && (prio < (int)best->priority ||
+                         (prio == (int)best->priority && rq->nr_ready <= best_load))) {
+                break;
+            }
+            sched_task_t* t = rq->run_queues[prio];
+            while (t && (t == rq->current || t->on_cpu || !(t->affinity & (1u << cpu)))) {
+                t = t->next;
+            }
+            if (t) {
+                best = t;
+                best_load = rq->nr_ready;
+                break;
+            }
+        }
+    }
+    
+    if (best) {
+        migrate_task(best, cpu);
+        g_sched.stats.steals++;
+    }
+    return best;
 }
 
 /* Find sched_task for a given task_t */
 static sched_task_t* find_sched_task(task_t* task) {
     if (!task) return NULL;
     
-    for (int i = 0; i < SCHED_MAX_TASKS; i++) {
-        if (g_sched.task_pool[i].task == task) {
-            return &g_sched.task_pool[i];
-        }
+    /* scheduler_add_task() links the task back to its slot */
+    sched_task_t* stask = (sched_task_t*)task->sched_data;
+    if (stask && stask->task == task) {
+        return stask;
     }
     return NULL;
 }
 
+/* Make a woken task ready and preempt if it outranks its CPU's current one */
+static void make_ready(sched_task_t* stask) {
+    /* Affinity changed while it slept: wake up somewhere allowed */
+    if (!(stask->affinity & (1u << stask->cpu)) && !stask->on_cpu) {
+        stask->cpu = pick_cpu(stask->affinity);
+    }
+    
+    stask->state = SCHED_STATE_READY;
+    stask->wake_stamp = sched_clock();
+    enqueue_task(stask);
+    g_sched.stats.wakeups++;
+    sched_trace(SCHED_EV_WAKE, stask->task->id, (uint8_t)stask->priority);
+    
+    sched_rq_t* rq = &g_sched.rqs[stask->cpu];
+    if (rq->current && stask->priority > rq->current->priority) {
+        request_resched(rq, SCHED_OUT_PREEMPT);
+        g_sched.stats.preemptions++;
+    }
+}
+
+/* Fold one wake-to-run sample into the stats */
+static void record_wake_latency(sched_task_t* stask) {
+    if (!stask->wake_stamp) {
+        return;
+    }
+    
+    uint64_t delta = sched_clock() - stask->wake_stamp;
+    uint32_t lat = delta > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)delta;
+    stask->wake_stamp = 0;
+    
+    g_sched.stats.wake_latency_last = lat;
+    if (lat > g_sched.stats.wake_latency_max) {
+        g_sched.stats.wake_latency_max = lat;
+    }
+    int32_t diff = (int32_t)(lat - g_sched.stats.wake_latency_avg);
+    g_sched.stats.wake_latency_avg += diff / 8;
+}
+
+/* Take a ready or running task off the run queues (lock held) */
+static void block_task(sched_task_t* stask, void* reason) {
+    if (stask->state != SCHED_STATE_READY && stask->state != SCHED_STATE_RUNNING) {
+        return;
+    }
+    
+    sched_rq_t* rq = &g_sched.rqs[stask->cpu];
+    if (stask == rq->current) {
+        request_resched(rq, SCHED_OUT_BLOCK);
+    }
+    
+    stask->state = SCHED_STATE_BLOCKED;
+    stask->wait_data = reason;
+    dequeue_task(stask);
+    g_sched.stats.blocked_tasks++;
+    sched_trace(SCHED_EV_BLOCK, stask->task->id, 0);
+}
+
+/* Sleep timer expiry (timer IRQ context) */
+static void sleep_expired(void* data) {
+    sched_task_t* stask = (sched_task_t*)data;
+    uint32_t flags = sched_lock();
+    if (stask->state == SCHED_STATE_SLEEPING) {
+        stask->wake_time = 0;
+        make_ready(stask);
+    }
+    sched_unlock(flags);
+}
+
 int scheduler_init(void) {
     if (g_sched.initialized) {
         return 0;
     }
     
+    /* Clears every run queue as well */
     memset(&g_sched, 0, sizeof(g_sched));
-    g_sched.current = NULL;
+    ticket_init(&g_sched.lock, "sched", &g_sched.lock_stats);
     g_sched.ticks = 0;
     
-    /* Clear run queues */
-    for (int i = 0; i < SCHED_PRIORITY_LEVELS; i++) {
-        g_sched.run_queues[i] = NULL;
-    }
-    
     /* Clear task pool */
     for (int i = 0; i < SCHED_MAX_TASKS; i++) {
         g_sched.task_pool[i].task = NULL;
         g_sched.task_pool[i].state = SCHED_STATE_TERMINATED;
     }
     
+    /* The boot CPU schedules from the start; APs join in smp_init() */
+    g_sched.online_mask = 1u << smp_cpu_id();
     g_sched.initialized = 1;
     
     debug_print("Scheduler: initialized\n");
     return 0;
 }
 
+void scheduler_cpu_online(void) {
+    uint32_t flags = sched_lock();
+    g_sched.online_mask |= 1u << smp_cpu_id();
+    sched_unlock(flags);
+}
+
 int scheduler_add_task(task_t* task, process_t* process, sched_priority_t priority) {
     if (!g_sched.initialized || !task) {
         return -1;
     }
     
+    uint32_t flags = sched_lock();
     sched_task_t* stask = find_free_slot();
     if (!stask) {
+        sched_unlock(flags);
         debug_print("Scheduler: no free task slots\n");
         return -1;
     }
@@ -151,13 +343,44 @@ int scheduler_add_task(task_t* task, process_t* process, sched_priority_t priori
     stask->wait_data = NULL;
     stask->next = NULL;
     stask->prev = NULL;
+    stask->run_stamp = 0;
+    stask->cpu_ns = 0;
+    stask->wait_ns = 0;
+    stask->switches = 0;
+    stask->preempted = 0;
+    stask->cpu = 0;
+    stask->affinity = SCHED_AFFINITY_BSP;
+    stask->on_cpu = 0;
+    ktimer_init(&stask->sleep_timer, sleep_expired, stask);
     
     /* Link task back to scheduler info */
     task->sched_data = stask;
     
-    enqueue_task(stask);
+    /* A CPU registering the context it runs in (boot and idle tasks)
+     * keeps running it, pinned to itself */
+    sched_rq_t* rq;
+    if (task == task_get_current()) {
+        stask->cpu = smp_cpu_id();
+        stask->affinity = 1u << stask->cpu;
+        stask->on_cpu = 1;
+        rq = &g_sched.rqs[stask->cpu];
+        enqueue_task(stask);
+        if (!rq->current) {
+            stask->state = SCHED_STATE_RUNNING;
+            stask->run_stamp = sched_clock();
+            rq->current = stask;
+        }
+    } else {
+        rq = &g_sched.rqs[stask->cpu];
+        enqueue_task(stask);
+    }
     g_sched.stats.total_tasks++;
     
+    if (rq->current && stask->priority > rq->current->priority) {
+        request_resched(rq, SCHED_OUT_PREEMPT);
+    }
+    sched_unlock(flags);
+    
     debug_print("Scheduler: added task at priority ");
     debug_print_hex(priority);
     debug_print("\n");
@@ -171,79 +394,272 @@ void scheduler_remove_task(task_t* task) {
     sched_task_t* stask = find_sched_task(task);
     if (!stask) return;
     
+    ktimer_cancel(&stask->sleep_timer);
+    
+    uint32_t flags = sched_lock();
+    sched_rq_t* rq = &g_sched.rqs[stask->cpu];
     dequeue_task(stask);
+    if (rq->current == stask) {
+        rq->current = NULL;
+    }
+    if (rq->prev == stask) {
+        rq->prev = NULL;
+    }
+    task->sched_data = NULL;
     stask->task = NULL;
+    
+    /* scheduler_exit() already stopped counting a zombie */
+    int counted = stask->state != SCHED_STATE_ZOMBIE;
     stask->state = SCHED_STATE_TERMINATED;
     
-    if (g_sched.stats.total_tasks > 0) {
+    if (counted && g_sched.stats.total_tasks > 0) {
         g_sched.stats.total_tasks--;
     }
+    sched_unlock(flags);
 }
 
 sched_task_t* scheduler_get_current(void) {
-    return g_sched.current;
+    return this_rq()->current;
 }
 
-void scheduler_yield(void) {
-    if (!g_sched.initialized || !g_sched.current) {
-        return;
+task_t* scheduler_schedule(void) {
+    if (!g_sched.initialized) {
+        return NULL;
     }
     
-    sched_task_t* current = g_sched.current;
-    sched_task_t* next = find_next_task();
+    uint32_t flags = sched_lock();
+    uint32_t cpu = smp_cpu_id();
+    sched_rq_t* rq = &g_sched.rqs[cpu];
+    sched_task_t* current = rq->current;
     
-    /* No other task to run */
-    if (!next || next == current) {
-        return;
+    /* A task parked through task_t (IPC wait) leaves the run queues */
+    if (current && current->state == SCHED_STATE_RUNNING && current->task &&
+        (current->task->state == TASK_WAITING || current->task->state == TASK_BLOCKED)) {
+        block_task(current, NULL);
+    }
+    
+    if (current && current->state == SCHED_STATE_RUNNING && !rq->need_resched) {
+        sched_unlock(flags);
+        return current->task;
+    }
+    rq->need_resched = 0;
+    
+    /* Why the current task is giving up the CPU, for the trace */
+    uint8_t reason = rq->resched_reason;
+    if (current && current->state != SCHED_STATE_RUNNING && current->state != SCHED_STATE_READY) {
+        reason = current->state == SCHED_STATE_ZOMBIE ? SCHED_OUT_EXIT : SCHED_OUT_BLOCK;
     }
+    rq->resched_reason = SCHED_OUT_YIELD;
     
     /* Move current task to end of its queue */
-    if (current->state == SCHED_STATE_RUNNING) {
+    if (current && current->state == SCHED_STATE_RUNNING) {
         current->state = SCHED_STATE_READY;
         dequeue_task(current);
         enqueue_task(current);
+        if (current->task->state == TASK_RUNNING) {
+            current->task->state = TASK_READY;
+        }
+    }
+    
+    /* A direct handoff beats the priority order, if still runnable here */
+    sched_task_t* next = rq->handoff;
+    rq->handoff = NULL;
+    if (next && (next->state != SCHED_STATE_READY || next->cpu != cpu)) {
+        next = NULL;
+    }
+    if (!next) {
+        next = find_next_task(rq);
+    }
+    
+    /* Nothing but idle work here: help out a busier CPU */
+    if ((!next || next->priority == SCHED_PRIORITY_IDLE) && g_sched.online_mask != (1u << cpu)) {
+        sched_task_t* stolen = steal_task(cpu);
+        if (stolen) {
+            next = stolen;
+        }
+    }
+    if (!next) {
+        /* Nothing runnable: stay put until an interrupt wakes someone */
+        sched_unlock(flags);
+        return current ? current->task : NULL;
     }
     
-    /* Switch to next task */
     next->state = SCHED_STATE_RUNNING;
     next->time_slice = SCHED_TIME_SLICE;
-    g_sched.current = next;
+    next->task->state = TASK_RUNNING;
+    record_wake_latency(next);
+    
+    if (next != current) {
+        uint64_t now = sched_clock();
+        if (current && current->task) {
+            current->cpu_ns += now - current->run_stamp;
+            if (reason == SCHED_OUT_SLICE || reason == SCHED_OUT_PREEMPT) {
+                current->preempted++;
+            }
+            sched_trace(SCHED_EV_SWITCH_OUT, current->task->id, reason);
+        }
+        next->wait_ns += now - next->ready_stamp;
+        next->run_stamp = now;
+        next->switches++;
+        next->on_cpu = 1;
+        sched_trace(SCHED_EV_SWITCH_IN, next->task->id, (uint8_t)next->priority);
+        g_sched.stats.context_switches++;
+        
+        /* Its stack stays in use until the switch completes */
+        rq->prev = current;
+    }
+    rq->current = next;
+    sched_unlock(flags);
+    
+    return next->task;
+}
+
+int scheduler_finish_switch(void) {
+    sched_rq_t* rq = this_rq();
+    if (!rq->prev) {
+        return 0;
+    }
+    
+    uint32_t flags = sched_lock();
+    sched_task_t* prev = rq->prev;
+    int exited = 0;
+    rq->prev = NULL;
+    if (prev) {
+        prev->on_cpu = 0;
+        exited = prev->state == SCHED_STATE_ZOMBIE;
+        
+        /* Its affinity changed while it ran: move it now its stack is free */
+        if (prev->task && prev->state == SCHED_STATE_READY &&
+            !(prev->affinity & (1u << prev->cpu))) {
+            migrate_task(prev, pick_cpu(prev->affinity));
+            g_sched.stats.migrations++;
+        }
+    }
+    sched_unlock(flags);
+    return exited;
+}
+
+int scheduler_task_on_cpu(task_t* task) {
+    sched_task_t* stask = find_sched_task(task);
+    if (!stask) {
+        return 0;
+    }
     
-    g_sched.stats.context_switches++;
+    uint32_t flags = sched_lock();
+    int busy = stask->on_cpu;
+    sched_unlock(flags);
+    return busy;
+}
+
+void scheduler_yield(void) {
+    sched_rq_t* rq = this_rq();
+    if (!g_sched.initialized || !rq->current) {
+        return;
+    }
+    
+    /* Switch now if anyone else is queued here; otherwise wait for
+     * the timer IRQ, which may bring wakeups or steal work */
+    uint32_t flags = sched_lock();
+    request_resched(rq, SCHED_OUT_YIELD);
+    int others = rq->nr_ready > 1;
+    sched_unlock(flags);
+    if (others) {
+        task_switch();
+    } else {
+        asm volatile("sti; hlt");
+    }
+}
+
+void scheduler_block_task(task_t* task, void* reason) {
+    sched_task_t* stask = find_sched_task(task);
+    if (!stask) {
+        return;
+    }
     
-    /* Context switch would happen here */
-    /* For now, we just update the current pointer */
-    /* Real implementation would save/restore registers */
+    uint32_t flags = sched_lock();
+    block_task(stask, reason);
+    sched_unlock(flags);
 }
 
 void scheduler_block(void* reason) {
-    if (!g_sched.current) return;
+    sched_task_t* current = this_rq()->current;
+    if (!current) return;
     
-    g_sched.current->state = SCHED_STATE_BLOCKED;
-    g_sched.current->wait_data = reason;
-    dequeue_task(g_sched.current);
-    g_sched.stats.blocked_tasks++;
+    scheduler_block_task(current->task, reason);
     
-    scheduler_yield();
+    /* Idle here until woken and scheduled again */
+    while (current->state == SCHED_STATE_BLOCKED) {
+        asm volatile("sti; hlt");
+    }
 }
 
 void scheduler_wake(task_t* task) {
     sched_task_t* stask = find_sched_task(task);
-    if (!stask || stask->state != SCHED_STATE_BLOCKED) {
+    if (!stask) {
         return;
     }
     
-    stask->state = SCHED_STATE_READY;
-    stask->wait_data = NULL;
-    enqueue_task(stask);
+    uint32_t flags = sched_lock();
+    if (stask->state == SCHED_STATE_BLOCKED) {
+        stask->wait_data = NULL;
+        make_ready(stask);
+        
+        if (g_sched.stats.blocked_tasks > 0) {
+            g_sched.stats.blocked_tasks--;
+        }
+    }
+    sched_unlock(flags);
+}
+
+int scheduler_handoff(task_t* task) {
+    sched_task_t* stask = find_sched_task(task);
+    if (!stask || !g_sched.initialized) {
+        return 0;
+    }
+    
+    uint32_t flags = sched_lock();
+    uint32_t cpu = smp_cpu_id();
+    sched_rq_t* rq = &g_sched.rqs[cpu];
+    sched_task_t* current = rq->current;
+    int direct = 0;
+    
+    if (stask->state == SCHED_STATE_BLOCKED) {
+        /* Still switching out somewhere else: its stack is not free yet */
+        direct = current && stask != current && !stask->on_cpu &&
+                 (stask->affinity & (1u << cpu));
+        if (direct) {
+            stask->cpu = cpu;
+        }
+        
+        stask->wait_data = NULL;
+        if (task->state == TASK_WAITING || task->state == TASK_BLOCKED) {
+            task->state = TASK_READY;
+        }
+        make_ready(stask);
+        if (g_sched.stats.blocked_tasks > 0) {
+            g_sched.stats.blocked_tasks--;
+        }
+    }
+    
+    if (direct) {
+        rq->handoff = stask;
+        request_resched(rq, SCHED_OUT_HANDOFF);
+        g_sched.stats.handoffs++;
+    }
+    
+    /* A caller that blocked itself has to go as well */
+    int leave = direct || (current && current->state == SCHED_STATE_BLOCKED);
+    sched_unlock(flags);
     
-    if (g_sched.stats.blocked_tasks > 0) {
-        g_sched.stats.blocked_tasks--;
+    if (leave) {
+        task_switch();
     }
+    return direct;
 }
 
 void scheduler_sleep(uint32_t ms) {
-    if (!g_sched.current || ms == 0) {
+    sched_task_t* current = this_rq()->current;
+    if (!current || ms == 0) {
         return;
     }
     
@@ -251,58 +667,79 @@ void scheduler_sleep(uint32_t ms) {
         ms = SCHED_MAX_SLEEP_MS;
     }
     
-    uint64_t wake_tick = g_sched.ticks + scheduler_ms_to_ticks(ms);
-    g_sched.current->state = SCHED_STATE_SLEEPING;
-    g_sched.current->wake_time = (uint32_t)wake_tick;
-    dequeue_task(g_sched.current);
+    uint32_t ticks = (uint32_t)scheduler_ms_to_ticks(ms);
+    if (ticks == 0) {
+        ticks = 1;
+    }
     
-    scheduler_yield();
+    /* Armed under the lock so no tick can switch away before it is set */
+    uint32_t flags = sched_lock();
+    current->state = SCHED_STATE_SLEEPING;
+    current->wake_time = (uint32_t)(g_sched.ticks + ticks);
+    dequeue_task(current);
+    request_resched(&g_sched.rqs[current->cpu], SCHED_OUT_BLOCK);
+    sched_trace(SCHED_EV_SLEEP, current->task->id, 0);
+    ktimer_start(&current->sleep_timer, ticks, 0);
+    sched_unlock(flags);
+    
+    while (current->state == SCHED_STATE_SLEEPING) {
+        asm volatile("sti; hlt");
+    }
 }
 
-void scheduler_tick(void) {
-    g_sched.ticks++;
-    g_sched.stats.timer_ticks++;
-    
-    /* Wake up sleeping tasks */
-    for (int i = 0; i < SCHED_MAX_TASKS; i++) {
-        sched_task_t* stask = &g_sched.task_pool[i];
-        if (stask->state == SCHED_STATE_SLEEPING && 
-            stask->wake_time <= (uint32_t)g_sched.ticks) {
-            stask->state = SCHED_STATE_READY;
-            stask->wake_time = 0;
-            enqueue_task(stask);
-        }
+void scheduler_tick(uint32_t ticks) {
+    uint32_t flags = sched_lock();
+    sched_rq_t* rq = this_rq();
+    
+    /* The boot CPU's timer is the system tick */
+    if (smp_cpu_id() == 0) {
+        g_sched.ticks += ticks;
+        g_sched.stats.timer_ticks += ticks;
     }
     
+    /* Sleepers are woken by their timers (timer_tick runs first) */
+    
     /* Check time slice */
-    if (g_sched.current) {
-        g_sched.current->total_cpu_time++;
+    sched_task_t* current = rq->current;
+    if (current) {
+        current->total_cpu_time += ticks;
         
-        if (g_sched.current->time_slice > 0) {
-            g_sched.current->time_slice--;
+        if (current->time_slice > ticks) {
+            current->time_slice -= ticks;
+        } else {
+            current->time_slice = 0;
         }
         
-        if (g_sched.current->time_slice == 0) {
-            scheduler_yield();
+        if (current->time_slice == 0) {
+            request_resched(rq, SCHED_OUT_SLICE);
         }
     }
+    sched_unlock(flags);
 }
 
 void scheduler_set_priority(task_t* task, sched_priority_t priority) {
     sched_task_t* stask = find_sched_task(task);
     if (!stask) return;
     
-    /* Remove from old queue */
-    if (stask->state == SCHED_STATE_READY) {
+    uint32_t flags = sched_lock();
+    sched_rq_t* rq = &g_sched.rqs[stask->cpu];
+    
+    /* Remove from old queue (the running task stays queued too) */
+    int queued = stask->state == SCHED_STATE_READY || stask->state == SCHED_STATE_RUNNING;
+    if (queued) {
         dequeue_task(stask);
     }
     
     stask->priority = priority;
     
     /* Re-add to new queue */
-    if (stask->state == SCHED_STATE_READY) {
+    if (queued) {
         enqueue_task(stask);
+        if (rq->current && stask != rq->current && priority > rq->current->priority) {
+            request_resched(rq, SCHED_OUT_PREEMPT);
+        }
     }
+    sched_unlock(flags);
 }
 
 sched_priority_t scheduler_get_priority(task_t* task) {
@@ -311,19 +748,57 @@ sched_priority_t scheduler_get_priority(task_t* task) {
     return stask->priority;
 }
 
+int scheduler_set_affinity(task_t* task, uint32_t mask) {
+    sched_task_t* stask = find_sched_task(task);
+    if (!stask || !(mask & g_sched.online_mask)) {
+        return -1;
+    }
+    
+    uint32_t flags = sched_lock();
+    stask->affinity = mask;
+    if (!(mask & (1u << stask->cpu))) {
+        if (stask->on_cpu) {
+            /* Moved by scheduler_finish_switch() once switched out */
+            request_resched(&g_sched.rqs[stask->cpu], SCHED_OUT_YIELD);
+        } else if (stask->state == SCHED_STATE_READY) {
+            migrate_task(stask, pick_cpu(mask));
+            g_sched.stats.migrations++;
+        } else {
+            /* Not queued: the next wakeup lands on an allowed CPU */
+            stask->cpu = pick_cpu(mask);
+        }
+    }
+    sched_unlock(flags);
+    return 0;
+}
+
+uint32_t scheduler_get_affinity(task_t* task) {
+    sched_task_t* stask = find_sched_task(task);
+    return stask ? stask->affinity : SCHED_AFFINITY_BSP;
+}
+
 void scheduler_exit(int exit_code) {
     (void)exit_code;
     
-    if (!g_sched.current) return;
+    sched_task_t* current = this_rq()->current;
+    if (!current) return;
     
-    g_sched.current->state = SCHED_STATE_ZOMBIE;
-    dequeue_task(g_sched.current);
+    uint32_t flags = sched_lock();
+    current->state = SCHED_STATE_ZOMBIE;
+    dequeue_task(current);
+    fpu_task_exit(current->task);
+    request_resched(&g_sched.rqs[current->cpu], SCHED_OUT_EXIT);
+    sched_trace(SCHED_EV_EXIT, current->task->id, 0);
     
     if (g_sched.stats.total_tasks > 0) {
         g_sched.stats.total_tasks--;
     }
+    sched_unlock(flags);
     
-    scheduler_yield();
+    /* Never scheduled again */
+    for (;;) {
+        asm volatile("sti; hlt");
+    }
 }
 
 void scheduler_get_stats(sched_stats_t* stats) {
@@ -333,10 +808,42 @@ void scheduler_get_stats(sched_stats_t* stats) {
     }
 }
 
+uint32_t scheduler_get_task_stats(sched_task_stats_t* out, uint32_t max) {
+    if (!out) {
+        return 0;
+    }
+    
+    uint32_t flags = sched_lock();
+    uint64_t now = sched_clock();
+    uint32_t count = 0;
+    for (int i = 0; i < SCHED_MAX_TASKS && count < max; i++) {
+        sched_task_t* stask = &g_sched.task_pool[i];
+        if (!stask->task) {
+            continue;
+        }
+        
+        sched_task_stats_t* st = &out[count++];
+        st->task_id = stask->task->id;
+        st->cpu = stask->cpu;
+        st->priority = stask->priority;
+        st->state = stask->state;
+        st->cpu_ns = stask->cpu_ns;
+        /* Include the slice the running task is in the middle of */
+        if (stask == g_sched.rqs[stask->cpu].current) {
+            st->cpu_ns += now - stask->run_stamp;
+        }
+        st->wait_ns = stask->wait_ns;
+        st->switches = stask->switches;
+        st->preempted = stask->preempted;
+    }
+    sched_unlock(flags);
+    return count;
+}
+
 void scheduler_dump(void) {
     debug_print("\n=== Scheduler State ===\n");
-    debug_print("Current task: 0x");
-    debug_print_hex((uint32_t)g_sched.current);
+    debug_print("Online CPUs mask: 0x");
+    debug_print_hex(g_sched.online_mask);
     debug_print("\nTotal tasks: ");
     debug_print_hex(g_sched.stats.total_tasks);
     debug_print("\nReady tasks: ");
@@ -345,24 +852,68 @@ void scheduler_dump(void) {
     debug_print_hex(g_sched.stats.blocked_tasks);
     debug_print("\nContext switches: ");
     debug_print_hex(g_sched.stats.context_switches);
+    debug_print("\nPreemptions: ");
+    debug_print_hex(g_sched.stats.preemptions);
+    debug_print("\nWake latency avg/max (ns): ");
+    debug_print_hex(g_sched.stats.wake_latency_avg);
+    debug_print(" / ");
+    debug_print_hex(g_sched.stats.wake_latency_max);
+    debug_print("\nSteals / migrations: ");
+    debug_print_hex(g_sched.stats.steals);
+    debug_print(" / ");
+    debug_print_hex(g_sched.stats.migrations);
+    debug_print("\nHandoffs: ");
+    debug_print_hex(g_sched.stats.handoffs);
     debug_print("\nTimer ticks: ");
     debug_print_hex((uint32_t)g_sched.ticks);
     debug_print("\n");
     
-    /* Show tasks by priority */
-    for (int prio = SCHED_PRIORITY_LEVELS - 1; prio >= 0; prio--) {
-        if (g_sched.run_queues[prio]) {
-            debug_print("Priority ");
-            debug_print_hex(prio);
-            debug_print(": ");
-            sched_task_t* t = g_sched.run_queues[prio];
-            while (t) {
-                debug_print("0x");
-                debug_print_hex((uint32_t)t->task);
-                debug_print(" ");
-                t = t->next;
+    /* Per-task accounting: id, CPU ms, run-queue wait ms, preemptions */
+    for (int i = 0; i < SCHED_MAX_TASKS; i++) {
+        sched_task_t* stask = &g_sched.task_pool[i];
+        if (!stask->task) {
+            continue;
+        }
+        debug_print("  task ");
+        debug_print_hex(stask->task->id);
+        debug_print(" on cpu ");
+        debug_print_hex(stask->cpu);
+        debug_print(" cpu ms ");
+        debug_print_hex(clock_ns_to_ms(stask->cpu_ns));
+        debug_print(" wait ms ");
+        debug_print_hex(clock_ns_to_ms(stask->wait_ns));
+        debug_print(" preempted ");
+        debug_print_hex(stask->preempted);
+        debug_print("\n");
+    }
+    
+    /* Show each CPU's current task and queues by priority */
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sched_rq_t* rq = &g_sched.rqs[cpu];
+        if (!(g_sched.online_mask & (1u << cpu))) {
+            continue;
+        }
+        debug_print("CPU ");
+        debug_print_hex(cpu);
+        debug_print(" current 0x");
+        debug_print_hex((uint32_t)rq->current);
+        debug_print(" ready ");
+        debug_print_hex(rq->nr_ready);
+        debug_print("\n");
+        for (int prio = SCHED_PRIORITY_LEVELS - 1; prio >= 0; prio--) {
+            if (rq->run_queues[prio]) {
+                debug_print("  Priority ");
+                debug_print_hex(prio);
+                debug_print(": ");
+                sched_task_t* t = rq->run_queues[prio];
+                while (t) {
+                    debug_print("0x");
+                    debug_print_hex((uint32_t)t->task);
+                    debug_print(" ");
+                    t = t->next;
+                }
+                debug_print("\n");
             }
-            debug_print("\n");
         }
     }
     debug_print("=======================\n");
@@ -373,7 +924,7 @@ int scheduler_is_initialized(void) {
 }
 
 uint32_t scheduler_runnable_count(void) {
-    return g_sched.stats.ready_tasks;
+    return this_rq()->nr_ready;
 }
 
 uint64_t scheduler_get_ticks(void) {
@@ -381,11 +932,11 @@ uint64_t scheduler_get_ticks(void) {
 }
 
 uint32_t scheduler_ticks_to_ms(uint64_t ticks) {
-    /* Assuming 100Hz timer (10ms per tick) */
-    return (uint32_t)(ticks * 10);
+    /* Through nanoseconds: clock.c divides 64-bit values without libgcc */
+    return clock_ns_to_ms(ticks * (1000000000u / TIMER_HZ));
 }
 
 uint64_t scheduler_ms_to_ticks(uint32_t ms) {
-    /* Assuming 100Hz timer */
-    return ms / 10;
+    /* Whole seconds and the remainder separately keep this in 32 bits */
+    return (uint64_t)(ms / 1000) * TIMER_HZ + (ms % 1000) * TIMER_HZ / 1000;
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "smp.h"
+#include "lapic.h"
+#include "gdt.h"
+#include "idt.h"
+#include "isr.h"
+#include "fpu.h"
+#include "kstack.h"
+#include "memory.h"
+#include "clock.h"
+#include "string.h"
+#include "video.h"
+
+cpu_t g_cpus[SMP_MAX_CPUS];
+
+/* Read by the trampoline (asm/ap_boot.asm) */
+uint32_t smp_ap_cr3;                    /* Kernel page directory */
+volatile uint32_t smp_ap_next = 1;      /* Next CPU number to claim */
+uint32_t smp_ap_stacks[SMP_MAX_CPUS];   /* Boot stack tops, 0 = park */
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+
+/* The heap and task list are not SMP-safe yet: APs set up one at a time */
+static volatile uint32_t g_boot_lock;
+static uint32_t g_cpu_count = 1;
+
+uint32_t smp_init(void) {
+    cpu_t* bsp = &g_cpus[0];
+    bsp->index = 0;
+    bsp->apic_id = lapic_id();
+    bsp->online = 1;
+
+    if (!lapic_present()) {
+        debug_print("SMP: no local APIC, boot CPU only\n");
+        return g_cpu_count;
+    }
+
+    idt_set_entry(LAPIC_TIMER_VECTOR, (uint32_t)lapic_timer_with_task_switch, 0x08, 0x8E);
+    idt_set_entry(LAPIC_SPURIOUS_VECTOR, (uint32_t)lapic_spurious, 0x08, 0x8E);
+    idt_set_entry(LAPIC_TLB_VECTOR, (uint32_t)lapic_tlb_shootdown, 0x08, 0x8E);
+    lapic_timer_calibrate();
+
+    /* A boot stack for every CPU that might answer; unclaimed ones are
+     * given back once the APs have checked in */
+    for (uint32_t i = 1; i < SMP_MAX_CPUS; i++) {
+        void* stack = kstack_alloc(KSTACK_DEFAULT_SIZE);
+        g_cpus[i].boot_stack = stack;
+        smp_ap_stacks[i] = stack ? (uint32_t)stack + kstack_size(stack) : 0;
+    }
+    smp_ap_cr3 = (uint32_t)get_kernel_page_directory();
+    smp_ap_next = 1;
+    memcpy((void*)SMP_TRAMPOLINE_ADDR, smp_trampoline_start,
+           (uint32_t)(smp_trampoline_end - smp_trampoline_start));
+
+    lapic_start_aps(SMP_TRAMPOLINE_ADDR >> 12);
+
+    /* There is no CPU table to read (no ACPI): wait until every CPU that
+     * claimed a number is online, or the timeout */
+    for (uint32_t ms = 0; ms < SMP_BOOT_TIMEOUT_MS; ms++) {
+        clock_udelay(1000);
+
+        uint32_t claimed = smp_ap_next;
+        uint32_t online = 0;
+        for (uint32_t i = 1; i < SMP_MAX_CPUS; i++) {
+            online += g_cpus[i].online;
+        }
+        if (ms >= 10 && claimed - 1 == online) {
+            break;
+        }
+    }
+
+    /* Late CPUs now claim a number past the end and park */
+    uint32_t claimed = __sync_lock_test_and_set(&smp_ap_next, SMP_MAX_CPUS);
+    for (uint32_t i = 1; i < SMP_MAX_CPUS; i++) {
+        if (g_cpus[i].online) {
+            g_cpu_count++;
+        } else if (i >= claimed && g_cpus[i].boot_stack) {
+            kstack_free(g_cpus[i].boot_stack);
+            g_cpus[i].boot_stack = NULL;
+        }
+    }
+
+    debug_print("SMP: ");
+    debug_print_hex(g_cpu_count);
+    debug_print(" CPU(s) online\n");
+    return g_cpu_count;
+}
+
+uint32_t smp_cpu_count(void) {
+    return g_cpu_count;
+}
+
+void smp_ap_main(uint32_t index) {
+    cpu_t* cpu = &g_cpus[index];
+
+    load_gdt((uint32_t)&g_gdt_ptr);
+    load_idt((uint32_t)&g_idt_ptr);
+    tss_init_cpu(index, smp_ap_stacks[index]);
+
+    while (__sync_lock_test_and_set(&g_boot_lock, 1)) {
+        asm volatile("pause");
+    }
+
+    fpu_init_cpu();
+    lapic_enable();
+    cpu->index = index;
+    cpu->apic_id = lapic_id();
+
+    /* This context becomes the CPU's idle task */
+    if (task_init_cpu() != 0) {
+        debug_print("SMP: no memory for an idle task, CPU parked\n");
+        __sync_lock_release(&g_boot_lock);
+        for (;;) {
+            asm volatile("cli; hlt");
+        }
+    }
+    cpu->online = 1;
+
+    debug_print("SMP: CPU ");
+    debug_print_hex(index);
+    debug_print(" online, APIC id ");
+    debug_print_hex(cpu->apic_id);
+    debug_print("\n");
+
+    __sync_lock_release(&g_boot_lock);
+
+    lapic_timer_start();
+    for (;;) {
+        asm volatile("sti; hlt");
+    }
+}
@@ -3,48 +3,177 @@
 #include "string.h"
 #include "kernel.h"
 #include "video.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "clock.h"
+#include "fpu.h"
+#include "kstack.h"
+#include "workqueue.h"
+#include "smp.h"
+#include "lapic.h"
+#include "spinlock.h"
 
 // Forward declaration for process functions
 typedef struct process process_t;
 extern process_t* process_get_current(void);
 extern void process_switch(process_t* next);
 
-#define TASK_STACK_SIZE 4096
 #define MAX_TASKS 32
 #define TASK_YIELD_DELAY 100000  // Busy-wait iterations before yielding
 
-static task_t* current_task = NULL;
+// The running task and first-switch flag are per CPU (cpu_t in smp.h)
 static task_t* task_list_head = NULL;
 static uint32 next_task_id = 0;
-static int scheduler_started = 0;  // Flag to track if we've started scheduling
+static work_t reap_work;           // Frees exited tasks from a worker
+
+// The task list is walked by the timer IRQ and grown by APs coming up
+static spinlock_t task_list_lock = SPINLOCK_INIT;
+
+static inline uint32 list_lock(void) {
+    return spin_lock_irqsave(&task_list_lock);
+}
+
+static inline void list_unlock(uint32 flags) {
+    spin_unlock_irqrestore(&task_list_lock, flags);
+}
+
+// Task IDs are handed out on every CPU
+static inline uint32 alloc_task_id(void) {
+    return __sync_fetch_and_add(&next_task_id, 1);
+}
+
+static void task_reap(void* data);
+
+static task_switch_stats_t switch_stats;
+
+static inline uint64 read_tsc(void) {
+    uint32 lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64)hi << 32) | lo;
+}
 
 // Get current task
 task_t* task_get_current(void) {
-    return current_task;
+    return smp_this_cpu()->current_task;
+}
+
+// Is the task's stack in use by some CPU?
+// switch_to() moves current_task on before the old stack is left, so
+// once the scheduler runs ask it: a task is on its CPU until the switch
+// away from it completes
+static int task_is_running(task_t* task) {
+    if (scheduler_is_initialized() && task->sched_data) {
+        return scheduler_task_on_cpu(task);
+    }
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (g_cpus[i].current_task == task) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Get context switch statistics
+void task_get_switch_stats(task_switch_stats_t* stats) {
+    if (stats) {
+        *stats = switch_stats;
+    }
+}
+
+// Make next the running task: FPU trap, address space, accounting.
+// start is the TSC when the tick began deciding; the switch cost is
+// taken by task_switch_done() once the new stack is loaded
+static uint32 switch_to(cpu_t* cpu, task_t* next, uint64 start) {
+    task_t* prev = cpu->current_task;
+    
+    // Lazy FPU state can't follow a task to another CPU: write it back
+    // whenever there is another CPU. The affinity at this point is no
+    // guide, since it may be widened or the task stolen while it waits.
+    // Only a task that used the FPU in this slice pays for the save;
+    // the restore stays lazy
+    if (prev && prev != next && smp_cpu_count() > 1) {
+        fpu_task_save(prev);
+    }
+    
+    cpu->current_task = next;
+    fpu_task_switched(next);
+    
+    // Kernel tasks have no process: every directory maps the kernel the
+    // same way, so they keep whatever address space is loaded
+    process_t* proc = (process_t*)next->process;
+    if (proc && proc != process_get_current()) {
+        process_switch(proc);
+        switch_stats.cr3_switches++;
+    } else {
+        switch_stats.cr3_skipped++;
+    }
+    
+    cpu->switch_start = start;
+    return next->esp;
+}
+
+// Let the priority scheduler pick this CPU's next task
+static uint32 schedule_tick(cpu_t* cpu, uint32 current_esp, uint64 start) {
+    // Before the first switch we're not in a task context yet, so the
+    // interrupted ESP isn't saved anywhere
+    if (cpu->started) {
+        cpu->current_task->esp = current_esp;
+    }
+    
+    task_t* next_task = scheduler_schedule();
+    if (!next_task) {
+        return current_esp;
+    }
+    if (cpu->started && next_task == cpu->current_task) {
+        return current_esp;
+    }
+    
+    cpu->started = 1;
+    return switch_to(cpu, next_task, start);
 }
 
 // Scheduler tick - called from timer IRQ
 // Returns the ESP to use (either current or switched task)
 uint32 task_scheduler_tick(uint32 current_esp) {
-    // Increment timer ticks (for kernel use)
+    cpu_t* cpu = smp_this_cpu();
+    
+    // Ticks covered by this IRQ (more than one after tickless idle)
     extern volatile uint64 g_timer_ticks;
-    g_timer_ticks++;
+    uint32 elapsed = clock_event_elapsed();
+    g_timer_ticks += elapsed;
+    cpu->ticks++;
     
     // Send EOI to PIC
     extern void pic8259_eoi(int irq);
     pic8259_eoi(32); // IRQ0
     
+    // Expired kernel timers (wakes sleepers), then slice accounting
+    for (uint32 i = 0; i < elapsed; i++) {
+        timer_tick();
+    }
+    if (scheduler_is_initialized()) {
+        scheduler_tick(elapsed);
+    }
+    
+    task_t* current_task = cpu->current_task;
+    
     // If no tasks or only one task, return current ESP
     if (!current_task || !current_task->next || current_task->next == current_task) {
         return current_esp;
     }
+    uint64 start = read_tsc();
+    
+    // Priority scheduler decides when it is running
+    if (scheduler_is_initialized()) {
+        return schedule_tick(cpu, current_esp, start);
+    }
     
     // On first scheduler tick, we're not in a task context yet
     // So don't save the ESP - just switch to the first task
-    if (!scheduler_started) {
-        scheduler_started = 1;
+    if (!cpu->started) {
+        cpu->started = 1;
         current_task->state = TASK_RUNNING;
-        return current_task->esp;  // Return the first task's prepared ESP
+        return switch_to(cpu, current_task, start);  // The first task's prepared ESP
     }
     
     // Save current task's ESP
@@ -61,35 +190,146 @@ uint32 task_scheduler_tick(uint32 current_esp) {
         if (next_task == start_task) break; // Went full circle, stay on current
     }
     
-    // Check if we need to switch processes (address spaces)
-    // NOTE: For Step 4, we're keeping all processes in the same address space
-    // but the infrastructure is ready for per-process page directories
-    if (next_task->process != NULL && current_task->process != NULL &&
-        next_task->process != current_task->process) {
-        // Would switch to the next task's process here
-        // process_switch((process_t*)next_task->process);
-        // For now, we just track that we would switch but don't actually change CR3
+    // Switch to next task (and its address space)
+    next_task->state = TASK_RUNNING;
+    
+    // Return new task's ESP
+    return switch_to(cpu, next_task, start);
+}
+
+// Local APIC timer tick of an AP - called from lapic_timer_with_task_switch
+// The boot CPU owns the timer wheel; an AP only schedules its run queue
+uint32 task_ap_tick(uint32 current_esp) {
+    cpu_t* cpu = smp_this_cpu();
+    cpu->ticks++;
+    lapic_eoi();
+    
+    if (!cpu->current_task || !scheduler_is_initialized()) {
+        return current_esp;
     }
     
-    // Switch to next task
-    current_task = next_task;
-    current_task->state = TASK_RUNNING;
+    uint64 start = read_tsc();
+    scheduler_tick(1);
+    return schedule_tick(cpu, current_esp, start);
+}
+
+// Switch raised by the running task itself (task_switch_int): nothing
+// to account, just let the scheduler pick
+uint32 task_switch_now(uint32 current_esp) {
+    cpu_t* cpu = smp_this_cpu();
+    if (!cpu->started || !cpu->current_task || !scheduler_is_initialized()) {
+        return current_esp;
+    }
+    return schedule_tick(cpu, current_esp, read_tsc());
+}
+
+// Give up the CPU now rather than at the next timer tick. Returns once
+// the scheduler picks this task again; interrupts are as they were
+void task_switch(void) {
+    asm volatile("int %0" : : "i"(TASK_SWITCH_VECTOR) : "memory");
+}
+
+// Called by the timer stubs once they run on the new task's stack
+void task_switch_done(void) {
+    // An exited task's stack is free only now: the reaper may have
+    // passed over it already, so have it look again
+    if (scheduler_is_initialized() && scheduler_finish_switch()) {
+        work_queue(&reap_work, WORK_PRIO_LOW);
+    }
     
-    // Return new task's ESP
-    return current_task->esp;
+    // Close the switch cost measurement opened by switch_to()
+    cpu_t* cpu = smp_this_cpu();
+    if (!cpu->switch_start) {
+        return;
+    }
+    uint32 cycles = (uint32)(read_tsc() - cpu->switch_start);
+    cpu->switch_start = 0;
+    
+    switch_stats.switches++;
+    switch_stats.cycles_last = cycles;
+    if (cycles > switch_stats.cycles_max) {
+        switch_stats.cycles_max = cycles;
+    }
+    // Running average with 1/8 weight
+    switch_stats.cycles_avg += ((sint32)(cycles - switch_stats.cycles_avg)) / 8;
 }
 
 // Initialize task system
+// The boot context (kmain) becomes task 0 so it keeps running once other
+// tasks exist; its ESP is saved by the first timer tick like any other
 void task_init(void) {
-    current_task = NULL;
+    cpu_t* cpu = smp_this_cpu();
+    cpu->current_task = NULL;
+    cpu->started = 0;
     task_list_head = NULL;
     next_task_id = 0;
-    scheduler_started = 0;
+    work_init(&reap_work, task_reap, NULL);
+    
+    task_t* boot_task = (task_t*)kmalloc(sizeof(task_t));
+    if (boot_task) {
+        memset(boot_task, 0, sizeof(task_t));
+        if (fpu_task_init(boot_task, NULL) == 0) {
+            boot_task->id = alloc_task_id();
+            boot_task->state = TASK_RUNNING;
+            boot_task->next = boot_task;
+            task_list_head = boot_task;
+            cpu->current_task = boot_task;
+            cpu->idle_task = boot_task;
+            cpu->started = 1;
+            
+            if (scheduler_is_initialized()) {
+                scheduler_add_task(boot_task, NULL, SCHED_PRIORITY_NORMAL);
+            }
+        } else {
+            kfree(boot_task);
+        }
+    }
+    
     debug_print("Task system initialized\n");
 }
 
-// Create a new task
+// Turn the calling AP's boot context into its idle task, pinned to it;
+// its ESP is saved by the first LAPIC timer tick
+int task_init_cpu(void) {
+    cpu_t* cpu = smp_this_cpu();
+    
+    task_t* idle = (task_t*)kmalloc(sizeof(task_t));
+    if (!idle) {
+        return -1;
+    }
+    memset(idle, 0, sizeof(task_t));
+    if (fpu_task_init(idle, NULL) != 0) {
+        kfree(idle);
+        return -1;
+    }
+    idle->id = alloc_task_id();
+    idle->state = TASK_RUNNING;
+    
+    uint32 flags = list_lock();
+    task_t* last = task_list_head;
+    while (last->next != task_list_head) {
+        last = last->next;
+    }
+    last->next = idle;
+    idle->next = task_list_head;
+    list_unlock(flags);
+    
+    cpu->current_task = idle;
+    cpu->idle_task = idle;
+    cpu->started = 1;
+    
+    scheduler_cpu_online();
+    scheduler_add_task(idle, NULL, SCHED_PRIORITY_IDLE);
+    return 0;
+}
+
+// Create a new task with a stack of the default size
 task_t* task_create(void (*entry_point)(void)) {
+    return task_create_with_stack(entry_point, KSTACK_DEFAULT_SIZE);
+}
+
+// Create a new task on a guarded stack of stack_size bytes
+task_t* task_create_with_stack(void (*entry_point)(void), uint32 stack_size) {
     // Allocate task structure
     task_t* new_task = (task_t*)kmalloc(sizeof(task_t));
     if (!new_task) {
@@ -97,8 +337,8 @@ task_t* task_create(void (*entry_point)(void)) {
         return NULL;
     }
     
-    // Allocate stack
-    void* stack = kmalloc(TASK_STACK_SIZE);
+    // Allocate stack (page aligned, guard page below)
+    void* stack = kstack_alloc(stack_size);
     if (!stack) {
         kfree(new_task);
         debug_print("ERROR: Failed to allocate task stack\n");
@@ -107,13 +347,22 @@ task_t* task_create(void (*entry_point)(void)) {
     
     // Initialize task structure
     memset(new_task, 0, sizeof(task_t));
-    new_task->id = next_task_id++;
+    new_task->id = alloc_task_id();
     new_task->state = TASK_READY;
     new_task->process = NULL;  // Will be set by process_create if needed
+    new_task->stack = stack;
+    
+    // The FPU save area sits at the (page aligned) top of the stack
+    uint32 top = (uint32)stack + kstack_size(stack) - FPU_STATE_SIZE;
+    fpu_task_init(new_task, (void*)top);
     
     // Set up stack
     // Stack grows downward, so we start at the top
-    uint32* stack_top = (uint32*)((uint32)stack + TASK_STACK_SIZE);
+    uint32* stack_top = (uint32*)top;
+    
+    // Return address for entry_point: a task that returns exits
+    stack_top--;
+    *stack_top = (uint32)task_exit;
     
     // Push initial values onto the stack to simulate interrupt context
     // When we context switch to this task, it will pop these values
@@ -164,11 +413,12 @@ task_t* task_create(void (*entry_point)(void)) {
     new_task->eip = (uint32)entry_point;
     
     // Add to task list (circular linked list)
+    uint32 flags = list_lock();
     if (task_list_head == NULL) {
         // First task
         task_list_head = new_task;
         new_task->next = new_task; // Points to itself
-        current_task = new_task;
+        smp_this_cpu()->current_task = new_task;
     } else {
         // Insert at end of circular list
         task_t* last = task_list_head;
@@ -178,6 +428,109 @@ task_t* task_create(void (*entry_point)(void)) {
         last->next = new_task;
         new_task->next = task_list_head;
     }
+    list_unlock(flags);
+    
+    if (scheduler_is_initialized()) {
+        scheduler_add_task(new_task, NULL, SCHED_PRIORITY_NORMAL);
+    }
     
     return new_task;
 }
+
+// Free a task that is not running; its stack goes back to the pool
+int task_destroy(task_t* task) {
+    if (!task || task_is_running(task) || !task->stack) {
+        return -1;
+    }
+    
+    if (scheduler_is_initialized()) {
+        scheduler_remove_task(task);
+    }
+    fpu_task_exit(task);
+    
+    // Unlink from the circular list
+    uint32 flags = list_lock();
+    task_t* prev = task_list_head;
+    while (prev && prev->next != task) {
+        prev = prev->next;
+        if (prev == task_list_head) {
+            prev = NULL;
+        }
+    }
+    if (prev) {
+        prev->next = task->next;
+        if (task_list_head == task) {
+            task_list_head = task->next;
+        }
+    }
+    list_unlock(flags);
+    
+    kstack_free(task->stack);
+    kfree(task);
+    return 0;
+}
+
+// Free every exited task (runs in a worker, never on a dying stack)
+static void task_reap(void* data) {
+    (void)data;
+    
+    for (;;) {
+        task_t* zombie = NULL;
+        uint32 flags = list_lock();
+        task_t* t = task_list_head;
+        while (t) {
+            if (t->state == TASK_ZOMBIE && !task_is_running(t)) {
+                zombie = t;
+                break;
+            }
+            t = t->next;
+            if (t == task_list_head) {
+                break;
+            }
+        }
+        list_unlock(flags);
+        
+        if (!zombie) {
+            break;
+        }
+        task_destroy(zombie);
+    }
+}
+
+// Terminate the calling task; also where a returning entry point lands
+void task_exit(void) {
+    task_t* task = task_get_current();
+    if (task) {
+        task->state = TASK_ZOMBIE;
+        work_queue(&reap_work, WORK_PRIO_LOW);
+    }
+    
+    scheduler_exit(0);
+    for (;;) {
+        asm volatile("sti; hlt");
+    }
+}
+
+// Park a task until task_wake() (e.g. waiting for an IPC message)
+void task_block(task_t* task, task_state_t state) {
+    if (!task) {
+        return;
+    }
+    
+    task->state = state;
+    if (scheduler_is_initialized()) {
+        scheduler_block_task(task, NULL);
+    }
+}
+
+// Make a parked task runnable again
+void task_wake(task_t* task) {
+    if (!task || (task->state != TASK_WAITING && task->state != TASK_BLOCKED)) {
+        return;
+    }
+    
+    task->state = TASK_READY;
+    if (scheduler_is_initialized()) {
+        scheduler_wake(task);
+    }
+}
@@ -0,0 +1,224 @@
+#include "timer.h"
+#include "string.h"
+#include "video.h"
+#include "spinlock.h"
+
+/* Global timer wheel state */
+static struct {
+    ktimer_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now;               /* Next tick to process */
+    ktimer_t* running;          /* Timer whose callback is executing */
+    timer_stats_t stats;
+    spinlock_t lock;
+    lock_stats_t lock_stats;
+    uint8_t initialized;
+} g_timer = { .lock = SPINLOCK_INIT };
+
+/* Only the boot CPU advances the wheel, but tasks on any CPU arm and
+ * cancel timers (sleeps). Callbacks run with the lock dropped: they take
+ * the scheduler lock, which is held around ktimer_start() by sleepers. */
+static inline uint32_t wheel_lock(void) {
+    return spin_lock_irqsave(&g_timer.lock);
+}
+
+static inline void wheel_unlock(uint32_t flags) {
+    spin_unlock_irqrestore(&g_timer.lock, flags);
+}
+
+/* Put a timer in the slot its expiry falls into relative to now */
+static void wheel_insert(ktimer_t* timer) {
+    uint64_t expires = timer->expires;
+    uint32_t level = 0;
+    uint32_t slot;
+
+    if (expires < g_timer.now) {
+        /* Already due: run on the next processed tick */
+        slot = (uint32_t)g_timer.now & TIMER_WHEEL_MASK;
+    } else {
+        uint64_t delta = expires - g_timer.now;
+        if (delta > TIMER_MAX_DELAY) {
+            /* Parked at the far edge; re-filed when it cascades */
+            expires = g_timer.now + TIMER_MAX_DELAY;
+            delta = TIMER_MAX_DELAY;
+        }
+        while (level < TIMER_WHEEL_LEVELS - 1 &&
+               delta >= (1ull << ((level + 1) * TIMER_WHEEL_BITS))) {
+            level++;
+        }
+        slot = (uint32_t)(expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    }
+
+    ktimer_t** head = &g_timer.slots[level][slot];
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+    timer->pending = 1;
+    g_timer.stats.pending++;
+}
+
+/* Unlink a pending timer from whatever slot it is in */
+static void wheel_remove(ktimer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->pending = 0;
+    g_timer.stats.pending--;
+}
+
+/* Re-file every timer of one higher-level slot; returns the slot index */
+static uint32_t cascade(uint32_t level) {
+    uint32_t slot = (uint32_t)(g_timer.now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    ktimer_t* timer = g_timer.slots[level][slot];
+    g_timer.slots[level][slot] = NULL;
+
+    while (timer) {
+        ktimer_t* next = timer->next;
+        g_timer.stats.pending--;
+        wheel_insert(timer);
+        g_timer.stats.cascaded++;
+        timer = next;
+    }
+    return slot;
+}
+
+void timer_init(void) {
+    if (g_timer.initialized) {
+        return;
+    }
+
+    /* Timers armed before init are kept; only the clock starts here */
+    spin_init(&g_timer.lock, "timer", &g_timer.lock_stats);
+    g_timer.running = NULL;
+    g_timer.initialized = 1;
+
+    debug_print("Timer: wheel of ");
+    debug_print_hex(TIMER_WHEEL_LEVELS);
+    debug_print(" x ");
+    debug_print_hex(TIMER_WHEEL_SLOTS);
+    debug_print(" slots\n");
+}
+
+void timer_tick(void) {
+    uint32_t flags = wheel_lock();
+    uint32_t index = (uint32_t)g_timer.now & TIMER_WHEEL_MASK;
+
+    /* Level 0 wrapped: pull the next slot of each level down */
+    if (index == 0) {
+        for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (cascade(level) != 0) {
+                break;
+            }
+        }
+    }
+
+    /* Move the slot to a local list so callbacks can re-arm or cancel
+     * timers (including ones still waiting in this list) freely; the
+     * list is only touched under the lock */
+    ktimer_t* expired = g_timer.slots[0][index];
+    g_timer.slots[0][index] = NULL;
+    if (expired) {
+        expired->pprev = &expired;
+    }
+    g_timer.now++;
+    g_timer.stats.ticks = g_timer.now;
+
+    while (expired) {
+        ktimer_t* timer = expired;
+        wheel_remove(timer);
+
+        g_timer.running = timer;
+        wheel_unlock(flags);
+        timer->fn(timer->data);
+        flags = wheel_lock();
+        g_timer.running = NULL;
+        g_timer.stats.fired++;
+
+        /* Periodic timers re-arm unless the callback did something */
+        if (timer->period && !timer->pending) {
+            timer->expires += timer->period;
+            wheel_insert(timer);
+        }
+    }
+    wheel_unlock(flags);
+}
+
+uint32_t timer_idle_ticks(uint32_t limit) {
+    uint32_t flags = wheel_lock();
+    uint32_t ticks = limit;
+
+    /* Higher levels only expire through a cascade, so the first
+     * non-empty level-0 slot or the next wrap bounds the idle period */
+    for (uint32_t i = 0; i < limit; i++) {
+        uint32_t index = (uint32_t)(g_timer.now + i) & TIMER_WHEEL_MASK;
+        if (g_timer.slots[0][index] || (index == 0 && i > 0)) {
+            ticks = i + 1;
+            break;
+        }
+    }
+
+    wheel_unlock(flags);
+    return ticks ? ticks : 1;
+}
+
+uint64_t timer_get_ticks(void) {
+    return g_timer.now;
+}
+
+void timer_get_stats(timer_stats_t* stats) {
+    if (stats) {
+        *stats = g_timer.stats;
+    }
+}
+
+void ktimer_init(ktimer_t* timer, ktimer_fn_t fn, void* data) {
+    if (!timer) {
+        return;
+    }
+
+    memset(timer, 0, sizeof(ktimer_t));
+    timer->fn = fn;
+    timer->data = data;
+}
+
+void ktimer_start(ktimer_t* timer, uint32_t delay, uint32_t period) {
+    if (!timer || !timer->fn) {
+        return;
+    }
+
+    uint32_t flags = wheel_lock();
+    if (timer->pending) {
+        wheel_remove(timer);
+    }
+    timer->expires = g_timer.now + delay;
+    timer->period = period;
+    wheel_insert(timer);
+    wheel_unlock(flags);
+}
+
+int ktimer_cancel(ktimer_t* timer) {
+    if (!timer) {
+        return 0;
+    }
+
+    uint32_t flags = wheel_lock();
+    int was_pending = timer->pending;
+    if (was_pending) {
+        wheel_remove(timer);
+    }
+    /* Stop a periodic timer from re-arming itself mid-callback */
+    timer->period = 0;
+    wheel_unlock(flags);
+
+    return was_pending;
+}
+
+int ktimer_pending(ktimer_t* timer) {
+    return timer ? timer->pending : 0;
+}
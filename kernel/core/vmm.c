@@ -4,18 +4,35 @@
 #include "string.h"
 #include "video.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "lapic.h"
+#include "smp.h"
 
 /* Global VMM state */
 static struct {
     page_directory_t* kernel_dir;   /* Kernel page directory */
     page_directory_t* current_dir;  /* Current page directory */
+    uint32_t user_floor;            /* Lowest address handed out by placement */
     vmm_stats_t stats;
     uint8_t initialized;
 } g_vmm;
 
+/* One shootdown at a time; the batch is read by the other CPUs */
+static struct {
+    spinlock_t lock;
+    vmm_tlb_batch_t* batch;
+    volatile uint32_t pending;      /* CPUs yet to flush */
+} g_shootdown = { .lock = SPINLOCK_INIT };
+
 /* Kernel space starts at 3GB */
 #define KERNEL_SPACE_START 0xC0000000
 
+/* VMAs whose pages start out zero-filled and can be faulted in lazily */
+static int vma_is_anonymous(vma_t* vma) {
+    return vma->type == VMA_TYPE_DATA || vma->type == VMA_TYPE_HEAP ||
+           vma->type == VMA_TYPE_STACK;
+}
+
 /* Get page table for a virtual address */
 static uint32_t* get_page_table(page_directory_t* dir, uint32_t virt, int create) {
     uint32_t dir_index = VMM_DIR_INDEX(virt);
@@ -25,7 +42,8 @@ static uint32_t* get_page_table(page_directory_t* dir, uint32_t virt, int create
         return dir->tables[dir_index];
     }
     
-    if (!create) {
+    /* 4MB kernel pages have no table to map into */
+    if (!create || (dir->entries[dir_index] & VMM_FLAG_4MB)) {
         return NULL;
     }
     
@@ -47,18 +65,35 @@ static uint32_t* get_page_table(page_directory_t* dir, uint32_t virt, int create
     return table;
 }
 
+page_directory_t* vmm_alloc_directory(void) {
+    /* Frames are identity mapped, so the address is also what CR3 takes */
+    uint32_t frame = pmm_alloc_frames(VMM_DIR_FRAMES);
+    if (frame == 0) {
+        return NULL;
+    }
+    
+    page_directory_t* dir = (page_directory_t*)PMM_FRAME_TO_ADDR(frame);
+    memset(dir, 0, sizeof(page_directory_t));
+    return dir;
+}
+
+void vmm_free_directory(page_directory_t* dir) {
+    if (dir) {
+        pmm_free_frames(PMM_ADDR_TO_FRAME(dir), VMM_DIR_FRAMES);
+    }
+}
+
 int vmm_init(void) {
     if (g_vmm.initialized) {
         return 0;
     }
     
     /* Allocate kernel page directory */
-    g_vmm.kernel_dir = (page_directory_t*)kmalloc(sizeof(page_directory_t));
+    g_vmm.kernel_dir = vmm_alloc_directory();
     if (!g_vmm.kernel_dir) {
         return -1;
     }
     
-    memset(g_vmm.kernel_dir, 0, sizeof(page_directory_t));
     g_vmm.kernel_dir->ref_count = 1;
     g_vmm.kernel_dir->vma_list = NULL;
     
@@ -88,12 +123,11 @@ int vmm_init(void) {
 
 page_directory_t* vmm_create_directory(void) {
     /* Allocate directory structure */
-    page_directory_t* dir = (page_directory_t*)kmalloc(sizeof(page_directory_t));
+    page_directory_t* dir = vmm_alloc_directory();
     if (!dir) {
         return NULL;
     }
     
-    memset(dir, 0, sizeof(page_directory_t));
     dir->ref_count = 1;
     dir->vma_list = NULL;
     
@@ -133,13 +167,15 @@ void vmm_destroy_directory(page_directory_t* dir) {
         kfree(vma);
         vma = next;
     }
+    dir->vma_list = NULL;
+    dir->vma_root = NULL;
     
-    kfree(dir);
+    vmm_free_directory(dir);
 }
 
 void vmm_switch_directory(page_directory_t* dir) {
-    if (!dir) {
-        return;
+    if (!dir || dir == g_vmm.current_dir) {
+        return; /* Reloading CR3 would only throw away the TLB */
     }
     
     g_vmm.current_dir = dir;
@@ -176,8 +212,15 @@ int vmm_map_page(page_directory_t* dir, uint32_t virt, uint32_t phys, uint32_t f
     
     /* Set page table entry */
     uint32_t table_index = VMM_TABLE_INDEX(virt);
+    uint32_t old = table[table_index];
     table[table_index] = phys | (flags & 0xFFF) | VMM_FLAG_PRESENT;
     
+    /* Only a replaced translation can be stale in the TLB */
+    if (old & VMM_FLAG_PRESENT) {
+        asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+        g_vmm.stats.tlb_page_flushes++;
+    }
+    
     /* Update stats */
     g_vmm.stats.total_pages++;
     if (virt >= KERNEL_SPACE_START) {
@@ -189,15 +232,8 @@ int vmm_map_page(page_directory_t* dir, uint32_t virt, uint32_t phys, uint32_t f
     return 0;
 }
 
-void vmm_unmap_page(page_directory_t* dir, uint32_t virt) {
-    if (!dir) {
-        dir = g_vmm.current_dir;
-    }
-    
-    if (!dir) {
-        return;
-    }
-    
+/* Clear a PTE, queueing its address if a translation may be cached */
+static void unmap_page_batched(page_directory_t* dir, uint32_t virt, vmm_tlb_batch_t* batch) {
     virt &= VMM_PAGE_MASK;
     
     uint32_t* table = get_page_table(dir, virt, 0);
@@ -206,12 +242,28 @@ void vmm_unmap_page(page_directory_t* dir, uint32_t virt) {
     }
     
     uint32_t table_index = VMM_TABLE_INDEX(virt);
+    uint32_t old = table[table_index];
     table[table_index] = 0;
     
-    /* Invalidate TLB entry */
-    asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    if (old & VMM_FLAG_PRESENT) {
+        vmm_tlb_batch_add(batch, virt, old & VMM_FLAG_GLOBAL);
+        g_vmm.stats.total_pages--;
+    }
+}
+
+void vmm_unmap_page(page_directory_t* dir, uint32_t virt) {
+    if (!dir) {
+        dir = g_vmm.current_dir;
+    }
+    
+    if (!dir) {
+        return;
+    }
     
-    g_vmm.stats.total_pages--;
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch);
+    unmap_page_batched(dir, virt, &batch);
+    vmm_tlb_batch_flush(&batch);
 }
 
 int vmm_get_physical(page_directory_t* dir, uint32_t virt, uint32_t* phys_out) {
@@ -223,6 +275,12 @@ int vmm_get_physical(page_directory_t* dir, uint32_t virt, uint32_t* phys_out) {
         return 0;
     }
     
+    uint32_t dir_entry = dir->entries[VMM_DIR_INDEX(virt)];
+    if ((dir_entry & (VMM_FLAG_PRESENT | VMM_FLAG_4MB)) == (VMM_FLAG_PRESENT | VMM_FLAG_4MB)) {
+        *phys_out = (dir_entry & 0xFFC00000) | (virt & 0x3FF000);
+        return 1;
+    }
+    
     virt &= VMM_PAGE_MASK;
     
     uint32_t* table = get_page_table(dir, virt, 0);
@@ -265,12 +323,21 @@ int vmm_alloc_page(page_directory_t* dir, uint32_t virt, uint32_t flags) {
 }
 
 int vmm_alloc_pages(page_directory_t* dir, uint32_t virt, uint32_t count, uint32_t flags) {
+    if (!dir) {
+        dir = g_vmm.current_dir;
+    }
+    
+    /* Anonymous memory is backed on first touch */
+    vma_t* vma = dir ? vmm_find_vma(dir, virt) : NULL;
+    if (vma && vma_is_anonymous(vma) && count <= (vma->end - virt) / VMM_PAGE_SIZE) {
+        g_vmm.stats.lazy_pages += count;
+        return 0;
+    }
+    
     for (uint32_t i = 0; i < count; i++) {
         if (vmm_alloc_page(dir, virt + i * VMM_PAGE_SIZE, flags) != 0) {
             /* Rollback */
-            for (uint32_t j = 0; j < i; j++) {
-                vmm_unmap_page(dir, virt + j * VMM_PAGE_SIZE);
-            }
+            vmm_free_pages(dir, virt, i);
             return -1;
         }
     }
@@ -278,17 +345,237 @@ int vmm_alloc_pages(page_directory_t* dir, uint32_t virt, uint32_t count, uint32
 }
 
 void vmm_free_pages(page_directory_t* dir, uint32_t virt, uint32_t count) {
+    if (!dir) {
+        dir = g_vmm.current_dir;
+    }
+    
+    if (!dir) {
+        return;
+    }
+    
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch);
+    
     for (uint32_t i = 0; i < count; i++) {
         uint32_t addr = virt + i * VMM_PAGE_SIZE;
         
-        /* Get physical address before unmapping */
+        /* Get physical address before unmapping (pages still shared
+         * copy-on-write or mapping the zero page only lose a reference) */
         uint32_t phys;
         if (vmm_get_physical(dir, addr, &phys)) {
-            pmm_free_frame(PMM_ADDR_TO_FRAME(phys));
+            pmm_frame_unref(PMM_ADDR_TO_FRAME(phys));
         }
         
-        vmm_unmap_page(dir, addr);
+        unmap_page_batched(dir, addr, &batch);
     }
+    
+    vmm_tlb_batch_flush(&batch);
+}
+
+void vmm_tlb_batch_init(vmm_tlb_batch_t* batch) {
+    batch->count = 0;
+    batch->global = 0;
+}
+
+void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uint32_t virt, int global) {
+    if (batch->count < VMM_TLB_BATCH_MAX) {
+        batch->addrs[batch->count] = virt & VMM_PAGE_MASK;
+    }
+    batch->count++;
+    if (global) {
+        batch->global = 1;
+    }
+}
+
+/* Invalidate a batch on the calling CPU, leaving it as it is */
+static void tlb_batch_invalidate(const vmm_tlb_batch_t* batch) {
+    if (batch->count > VMM_TLB_BATCH_MAX) {
+        vmm_tlb_flush_all(batch->global);
+    } else {
+        /* invlpg drops global entries as well */
+        for (uint32_t i = 0; i < batch->count; i++) {
+            asm volatile("invlpg (%0)" : : "r"(batch->addrs[i]) : "memory");
+        }
+        g_vmm.stats.tlb_page_flushes += batch->count;
+    }
+}
+
+void vmm_tlb_batch_flush(vmm_tlb_batch_t* batch) {
+    tlb_batch_invalidate(batch);
+    vmm_tlb_batch_init(batch);
+}
+
+void vmm_tlb_shootdown(vmm_tlb_batch_t* batch) {
+    uint32_t others = smp_cpu_count() - 1;
+    if (others == 0 || batch->count == 0 || !lapic_present()) {
+        vmm_tlb_batch_flush(batch);
+        return;
+    }
+    
+    /* A CPU spinning here still takes the IPI of the one holding the
+     * lock, so two shootdowns cannot wait on each other */
+    spin_lock(&g_shootdown.lock);
+    g_shootdown.batch = batch;
+    g_shootdown.pending = others;
+    lapic_send_ipi_others(LAPIC_TLB_VECTOR);
+    tlb_batch_invalidate(batch);
+    while (g_shootdown.pending) {
+        asm volatile("pause");
+    }
+    g_shootdown.batch = NULL;
+    g_vmm.stats.tlb_shootdowns++;
+    spin_unlock(&g_shootdown.lock);
+    
+    vmm_tlb_batch_init(batch);
+}
+
+void vmm_tlb_shootdown_ipi(void) {
+    if (g_shootdown.batch) {
+        tlb_batch_invalidate(g_shootdown.batch);
+        __sync_fetch_and_sub(&g_shootdown.pending, 1);
+    }
+    lapic_eoi();
+}
+
+void vmm_tlb_flush_all(int global) {
+    if (global) {
+        /* Toggling CR4.PGE is the only way to drop global entries */
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~0x80) : "memory");
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    } else {
+        /* Reloading CR3 keeps global (kernel) entries */
+        uint32_t cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+    g_vmm.stats.tlb_full_flushes++;
+}
+
+/* ============== VMA tree ============== */
+
+/*
+ * VMAs live in an AVL tree keyed by start address. Each node also
+ * records the free gap in front of it and the largest gap in its
+ * subtree, so both lookup and first-fit placement are O(log n). The
+ * next pointers keep an address-ordered list for cheap iteration.
+ */
+
+/* Placement never goes below the identity-mapped RAM */
+static uint32_t user_floor(void) {
+    if (!g_vmm.user_floor) {
+        pmm_stats_t pmm;
+        pmm_get_stats(&pmm);
+        uint32_t ram_end = pmm.total_frames * VMM_PAGE_SIZE;
+        g_vmm.user_floor = (ram_end + 0x3FFFFF) & ~0x3FFFFF;
+        if (g_vmm.user_floor < 0x100000) {
+            g_vmm.user_floor = 0x100000;
+        }
+    }
+    return g_vmm.user_floor;
+}
+
+/* Free bytes between prev (or the floor) and a region starting at start */
+static uint32_t gap_before(vma_t* prev, uint32_t start) {
+    uint32_t base = user_floor();
+    if (prev && prev->end > base) {
+        base = prev->end;
+    }
+    return start > base ? start - base : 0;
+}
+
+static inline uint8_t vma_height(vma_t* n) {
+    return n ? n->height : 0;
+}
+
+static inline uint32_t vma_max_gap(vma_t* n) {
+    return n ? n->max_gap : 0;
+}
+
+/* Recompute cached height and max_gap from the children */
+static void vma_update(vma_t* n) {
+    uint8_t hl = vma_height(n->left);
+    uint8_t hr = vma_height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+    
+    uint32_t g = n->gap;
+    if (vma_max_gap(n->left) > g) {
+        g = vma_max_gap(n->left);
+    }
+    if (vma_max_gap(n->right) > g) {
+        g = vma_max_gap(n->right);
+    }
+    n->max_gap = g;
+}
+
+static vma_t* vma_rotate_right(vma_t* n) {
+    vma_t* l = n->left;
+    n->left = l->right;
+    l->right = n;
+    vma_update(n);
+    vma_update(l);
+    return l;
+}
+
+static vma_t* vma_rotate_left(vma_t* n) {
+    vma_t* r = n->right;
+    n->right = r->left;
+    r->left = n;
+    vma_update(n);
+    vma_update(r);
+    return r;
+}
+
+static vma_t* vma_balance(vma_t* n) {
+    vma_update(n);
+    int balance = (int)vma_height(n->left) - (int)vma_height(n->right);
+    
+    if (balance > 1) {
+        if (vma_height(n->left->left) < vma_height(n->left->right)) {
+            n->left = vma_rotate_left(n->left);
+        }
+        return vma_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (vma_height(n->right->right) < vma_height(n->right->left)) {
+            n->right = vma_rotate_right(n->right);
+        }
+        return vma_rotate_left(n);
+    }
+    return n;
+}
+
+/*
+ * A new leaf's predecessor and successor are both on its insertion
+ * path, so their updated gaps are folded in while unwinding.
+ */
+static vma_t* vma_insert(vma_t* n, vma_t* vma) {
+    if (!n) {
+        return vma;
+    }
+    if (vma->start < n->start) {
+        n->left = vma_insert(n->left, vma);
+    } else {
+        n->right = vma_insert(n->right, vma);
+    }
+    return vma_balance(n);
+}
+
+/* Lowest-addressed gap of at least size in the subtree, or NULL */
+static vma_t* vma_find_gap(vma_t* n, uint32_t size) {
+    while (n) {
+        if (vma_max_gap(n->left) >= size) {
+            n = n->left;
+        } else if (n->gap >= size) {
+            return n;
+        } else if (vma_max_gap(n->right) >= size) {
+            n = n->right;
+        } else {
+            return NULL;
+        }
+    }
+    return NULL;
 }
 
 vma_t* vmm_create_vma(page_directory_t* dir, uint32_t start, uint32_t size, 
@@ -300,6 +587,25 @@ vma_t* vmm_create_vma(page_directory_t* dir, uint32_t start, uint32_t size,
     /* Align start and size */
     start = (start + VMM_PAGE_SIZE - 1) & VMM_PAGE_MASK;
     size = (size + VMM_PAGE_SIZE - 1) & VMM_PAGE_MASK;
+    if (size == 0 || start + size < start) {
+        return NULL;
+    }
+    
+    /* Find the neighbours in address order */
+    vma_t* prev = NULL;
+    vma_t* next = NULL;
+    for (vma_t* n = dir->vma_root; n; ) {
+        if (start < n->start) {
+            next = n;
+            n = n->left;
+        } else {
+            prev = n;
+            n = n->right;
+        }
+    }
+    if ((prev && prev->end > start) || (next && next->start < start + size)) {
+        return NULL; /* Overlaps an existing VMA */
+    }
     
     /* Allocate VMA structure */
     vma_t* vma = (vma_t*)kmalloc(sizeof(vma_t));
@@ -307,28 +613,106 @@ vma_t* vmm_create_vma(page_directory_t* dir, uint32_t start, uint32_t size,
         return NULL;
     }
     
+    memset(vma, 0, sizeof(vma_t));
     vma->start = start;
     vma->end = start + size;
     vma->flags = flags;
     vma->type = type;
-    vma->next = NULL;
-    
-    /* Add to directory's VMA list */
-    if (!dir->vma_list) {
-        dir->vma_list = vma;
+    vma->height = 1;
+    vma->gap = gap_before(prev, start);
+    vma->max_gap = vma->gap;
+    
+    /* Link into the sorted list and fix the successor's gap */
+    vma->next = next;
+    if (prev) {
+        prev->next = vma;
     } else {
-        vma_t* current = dir->vma_list;
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = vma;
+        dir->vma_list = vma;
+    }
+    if (next) {
+        next->gap = gap_before(vma, next->start);
     }
     
+    dir->vma_root = vma_insert(dir->vma_root, vma);
     g_vmm.stats.vma_count++;
     
     return vma;
 }
 
+vma_t* vmm_find_vma(page_directory_t* dir, uint32_t addr) {
+    if (!dir) {
+        return NULL;
+    }
+    
+    vma_t* n = dir->vma_root;
+    while (n) {
+        if (addr < n->start) {
+            n = n->left;
+        } else if (addr >= n->end) {
+            n = n->right;
+        } else {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+int vmm_handle_fault(uint32_t addr, uint32_t err_code) {
+    if (err_code & VMM_FAULT_PRESENT) {
+        return -1; /* Protection faults are not ours */
+    }
+    
+    /* Directories are identity mapped, so CR3 doubles as a pointer */
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    page_directory_t* dir = (page_directory_t*)(cr3 & VMM_PAGE_MASK);
+    
+    vma_t* vma = vmm_find_vma(dir, addr);
+    if (!vma || !vma_is_anonymous(vma)) {
+        return -1;
+    }
+    if ((err_code & VMM_FAULT_USER) && !(vma->flags & VMM_FLAG_USER)) {
+        return -1;
+    }
+    if ((err_code & VMM_FAULT_WRITE) && !(vma->flags & VMM_FLAG_WRITABLE)) {
+        return -1;
+    }
+    
+    uint32_t flags = vma->flags & (VMM_FLAG_WRITABLE | VMM_FLAG_USER);
+    uint32_t frame;
+    
+    if (err_code & VMM_FAULT_WRITE) {
+        frame = pmm_alloc_frame();
+        if (frame == 0) {
+            return -1;
+        }
+        memset((void*)PMM_FRAME_TO_ADDR(frame), 0, VMM_PAGE_SIZE);
+    } else {
+        /* Reads share the zero page until the first write copies it */
+        frame = pmm_zero_frame();
+        if (frame == 0) {
+            return -1;
+        }
+        if (flags & VMM_FLAG_WRITABLE) {
+            flags = (flags & ~VMM_FLAG_WRITABLE) | VMM_FLAG_COW;
+        }
+        g_vmm.stats.zero_maps++;
+    }
+    
+    if (vmm_map_page(dir, addr, PMM_FRAME_TO_ADDR(frame), flags) != 0) {
+        if (err_code & VMM_FAULT_WRITE) {
+            pmm_free_frame(frame);
+        }
+        return -1;
+    }
+    
+    g_vmm.stats.demand_faults++;
+    if (g_vmm.stats.lazy_pages > 0) {
+        g_vmm.stats.lazy_pages--;
+    }
+    return 0;
+}
+
 uint32_t vmm_find_free_region(page_directory_t* dir, uint32_t size, uint32_t hint) {
     if (!dir) {
         return 0;
@@ -336,39 +720,49 @@ uint32_t vmm_find_free_region(page_directory_t* dir, uint32_t size, uint32_t hin
     
     /* Align size */
     size = (size + VMM_PAGE_SIZE - 1) & VMM_PAGE_MASK;
+    if (size == 0) {
+        return 0;
+    }
     
-    /* Default user space range: 1MB to 3GB */
-    uint32_t start = hint ? hint : 0x100000;
-    uint32_t end = KERNEL_SPACE_START;
+    uint32_t floor = user_floor();
     
     /* Check if hint region is free */
     if (hint) {
-        int free = 1;
-        for (uint32_t addr = hint; addr < hint + size; addr += VMM_PAGE_SIZE) {
-            if (vmm_is_mapped(dir, addr)) {
-                free = 0;
-                break;
+        hint &= VMM_PAGE_MASK;
+        if (hint >= floor && hint + size > hint && hint + size <= KERNEL_SPACE_START) {
+            vma_t* next = NULL;
+            vma_t* prev = NULL;
+            for (vma_t* n = dir->vma_root; n; ) {
+                if (hint < n->start) {
+                    next = n;
+                    n = n->left;
+                } else {
+                    prev = n;
+                    n = n->right;
+                }
+            }
+            if ((!prev || prev->end <= hint) && (!next || next->start >= hint + size)) {
+                return hint;
             }
-        }
-        if (free) {
-            return hint;
         }
     }
     
-    /* Scan for free region */
-    for (uint32_t addr = start; addr < end - size; addr += VMM_PAGE_SIZE) {
-        int free = 1;
-        for (uint32_t check = addr; check < addr + size; check += VMM_PAGE_SIZE) {
-            if (vmm_is_mapped(dir, check)) {
-                free = 0;
-                addr = check; /* Skip to after this mapped page */
-                break;
-            }
-        }
-        if (free) {
-            return addr;
+    /* First gap in front of some VMA that fits */
+    vma_t* vma = vma_find_gap(dir->vma_root, size);
+    if (vma) {
+        return vma->start - vma->gap;
+    }
+    
+    /* Otherwise the space after the last VMA */
+    uint32_t tail = floor;
+    for (vma_t* n = dir->vma_root; n; n = n->right) {
+        if (!n->right && n->end > tail) {
+            tail = n->end;
         }
     }
+    if (tail < KERNEL_SPACE_START && KERNEL_SPACE_START - tail >= size) {
+        return tail;
+    }
     
     return 0; /* No free region found */
 }
@@ -394,6 +788,16 @@ void vmm_dump(void) {
     debug_print_hex(g_vmm.stats.kernel_pages);
     debug_print("\nVMA count: ");
     debug_print_hex(g_vmm.stats.vma_count);
+    debug_print("\nLazy pages: ");
+    debug_print_hex(g_vmm.stats.lazy_pages);
+    debug_print(" demand faults: ");
+    debug_print_hex(g_vmm.stats.demand_faults);
+    debug_print(" zero maps: ");
+    debug_print_hex(g_vmm.stats.zero_maps);
+    debug_print("\nTLB page flushes: ");
+    debug_print_hex(g_vmm.stats.tlb_page_flushes);
+    debug_print(" full flushes: ");
+    debug_print_hex(g_vmm.stats.tlb_full_flushes);
     debug_print("\n");
     
     if (g_vmm.current_dir && g_vmm.current_dir->vma_list) {
@@ -0,0 +1,220 @@
+#include "workqueue.h"
+#include "task.h"
+#include "scheduler.h"
+#include "string.h"
+#include "video.h"
+#include "spinlock.h"
+
+/* One FIFO per priority and the workers that drain it */
+typedef struct {
+    work_t* head;
+    work_t* tail;
+    uint32_t depth;
+    task_t* idle[WORK_WORKERS_PER_QUEUE];   /* Workers parked on this queue */
+    uint32_t idle_count;
+} work_queue_t;
+
+/* Global work queue state */
+static struct {
+    work_queue_t queues[WORK_PRIO_COUNT];
+    work_stats_t stats;
+    spinlock_t lock;
+    lock_stats_t lock_stats;
+    uint8_t initialized;
+} g_work = { .lock = SPINLOCK_INIT };
+
+/* Scheduler priority of each queue's workers */
+static const sched_priority_t worker_priority[WORK_PRIO_COUNT] = {
+    SCHED_PRIORITY_HIGH,
+    SCHED_PRIORITY_NORMAL,
+    SCHED_PRIORITY_LOW,
+};
+
+/* Queues are fed from IRQ handlers and from tasks on any CPU */
+static inline uint32_t work_lock(void) {
+    return spin_lock_irqsave(&g_work.lock);
+}
+
+static inline void work_unlock(uint32_t flags) {
+    spin_unlock_irqrestore(&g_work.lock, flags);
+}
+
+/* Take the oldest item, or park the calling worker until work arrives */
+static work_t* worker_next(work_queue_t* wq, task_t* self) {
+    for (;;) {
+        uint32_t flags = work_lock();
+        work_t* work = wq->head;
+        if (work) {
+            wq->head = work->next;
+            if (!wq->head) {
+                wq->tail = NULL;
+            }
+            wq->depth--;
+            work->next = NULL;
+            work->pending = 0;
+            work_unlock(flags);
+            return work;
+        }
+
+        /* Register as idle before blocking so work_queue() can wake us */
+        wq->idle[wq->idle_count++] = self;
+        task_block(self, TASK_BLOCKED);
+        spin_unlock(&g_work.lock);
+
+        /* Leave the CPU now rather than idling on it until the next
+         * tick; with interrupts still off a local wakeup cannot slip
+         * past, and a remote one only makes the task ready again */
+        if (scheduler_is_initialized()) {
+            while (self->state == TASK_BLOCKED) {
+                task_switch();
+            }
+        }
+        local_irq_restore(flags);
+
+        while (self->state == TASK_BLOCKED) {
+            asm volatile("sti; hlt");
+        }
+    }
+}
+
+static void worker_run(work_prio_t prio) {
+    work_queue_t* wq = &g_work.queues[prio];
+    task_t* self = task_get_current();
+
+    for (;;) {
+        work_t* work = worker_next(wq, self);
+        work->fn(work->data);
+        g_work.stats.completed++;
+    }
+}
+
+/* task_create() takes no argument: one entry point per queue */
+static void worker_high(void)   { worker_run(WORK_PRIO_HIGH); }
+static void worker_normal(void) { worker_run(WORK_PRIO_NORMAL); }
+static void worker_low(void)    { worker_run(WORK_PRIO_LOW); }
+
+static void (* const worker_entry[WORK_PRIO_COUNT])(void) = {
+    worker_high,
+    worker_normal,
+    worker_low,
+};
+
+int workqueue_init(void) {
+    if (g_work.initialized) {
+        return 0;
+    }
+
+    spin_init(&g_work.lock, "workqueue", &g_work.lock_stats);
+
+    /* Items queued before init stay queued for the workers */
+    for (uint32_t prio = 0; prio < WORK_PRIO_COUNT; prio++) {
+        for (uint32_t i = 0; i < WORK_WORKERS_PER_QUEUE; i++) {
+            task_t* worker = task_create(worker_entry[prio]);
+            if (!worker) {
+                debug_print("Workqueue: failed to create worker\n");
+                break;
+            }
+            scheduler_set_priority(worker, worker_priority[prio]);
+            g_work.stats.workers++;
+        }
+    }
+
+    if (g_work.stats.workers == 0) {
+        return -1;
+    }
+    g_work.initialized = 1;
+
+    debug_print("Workqueue: ");
+    debug_print_hex(g_work.stats.workers);
+    debug_print(" workers\n");
+
+    return 0;
+}
+
+void work_init(work_t* work, work_fn_t fn, void* data) {
+    if (!work) {
+        return;
+    }
+
+    memset(work, 0, sizeof(work_t));
+    work->fn = fn;
+    work->data = data;
+}
+
+int work_queue(work_t* work, work_prio_t prio) {
+    if (!work || !work->fn || prio >= WORK_PRIO_COUNT) {
+        return 0;
+    }
+
+    uint32_t flags = work_lock();
+    if (work->pending) {
+        g_work.stats.merged++;
+        work_unlock(flags);
+        return 0;
+    }
+
+    work_queue_t* wq = &g_work.queues[prio];
+    work->next = NULL;
+    work->prio = (uint8_t)prio;
+    work->pending = 1;
+    if (wq->tail) {
+        wq->tail->next = work;
+    } else {
+        wq->head = work;
+    }
+    wq->tail = work;
+    wq->depth++;
+
+    g_work.stats.queued++;
+    if (wq->depth > g_work.stats.depth_max) {
+        g_work.stats.depth_max = wq->depth;
+    }
+
+    if (wq->idle_count > 0) {
+        task_wake(wq->idle[--wq->idle_count]);
+    }
+    work_unlock(flags);
+
+    return 1;
+}
+
+int work_cancel(work_t* work) {
+    if (!work) {
+        return 0;
+    }
+
+    uint32_t flags = work_lock();
+    if (!work->pending) {
+        work_unlock(flags);
+        return 0;
+    }
+
+    work_queue_t* wq = &g_work.queues[work->prio];
+    work_t* prev = NULL;
+    for (work_t* it = wq->head; it; prev = it, it = it->next) {
+        if (it != work) {
+            continue;
+        }
+        if (prev) {
+            prev->next = it->next;
+        } else {
+            wq->head = it->next;
+        }
+        if (wq->tail == it) {
+            wq->tail = prev;
+        }
+        wq->depth--;
+        break;
+    }
+    work->next = NULL;
+    work->pending = 0;
+    work_unlock(flags);
+
+    return 1;
+}
+
+void workqueue_get_stats(work_stats_t* stats) {
+    if (stats) {
+        *stats = g_work.stats;
+    }
+}
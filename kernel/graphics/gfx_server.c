@@ -334,22 +334,29 @@ void gfx_server_run(void) {
     debug_print("GFX Server: running\n");
     
     for (;;) {
-        /* Process messages from all processes */
-        process_t* current = process_get_current();
-        if (current) {
-            message_t ipc_msg;
-            if (message_queue_dequeue(&current->inbox, &ipc_msg) == 0) {
-                /* Convert IPC message to GFX message */
-                msg.type = ipc_msg.type;
-                msg.sender_pid = ipc_msg.sender_pid;
-                /* Copy data from IPC message (data1 and data2) */
-                memset(&msg.data, 0, sizeof(msg.data));
-                memcpy(&msg.data.raw[0], &ipc_msg.data1, sizeof(uint32_t));
-                memcpy(&msg.data.raw[4], &ipc_msg.data2, sizeof(uint32_t));
-                
-                /* Process the message */
-                process_message(&msg, &resp);
+        /* Sleep until a client sends; a caller blocked in ipc_call()
+         * hands us its CPU directly */
+        process_t* current = process_get_running();
+        message_t ipc_msg;
+        if (current && ipc_wait(&current->inbox, &ipc_msg) == 0) {
+            ipc_call_t* call = ipc_msg_call(&ipc_msg);
+            
+            /* Convert IPC message to GFX message */
+            msg.type = ipc_msg_type(&ipc_msg);
+            msg.sender_pid = ipc_msg.sender_pid;
+            /* Payload arrives inline or in a buffer we now own */
+            memset(&msg.data, 0, sizeof(msg.data));
+            ipc_msg_read(&ipc_msg, &msg.data, sizeof(msg.data));
+            
+            /* Process the message and answer right away: the client
+             * runs again before we redraw */
+            process_message(&msg, &resp);
+            if (call) {
+                ipc_reply(call, (uint32_t)resp.result, resp.data);
             }
+        } else {
+            /* No scheduler to block with yet */
+            asm volatile("hlt");
         }
         
         /* Redraw if any window is damaged */
@@ -364,8 +371,5 @@ void gfx_server_run(void) {
         if (needs_redraw) {
             redraw_all();
         }
-        
-        /* Yield to other tasks */
-        asm volatile("hlt");
     }
 }
\ No newline at end of file
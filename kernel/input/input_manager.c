@@ -1,6 +1,10 @@
 #include "input_manager.h"
 #include "string.h"
 #include "video.h"
+#include "timer.h"
+#include "workqueue.h"
+#include "spinlock.h"
+#include "rwlock.h"
 
 /*
  * Input Manager Implementation - AutismOS
@@ -10,6 +14,61 @@
 
 static input_manager_t g_input;
 
+// Events posted from IRQs wait here until the dispatch work item hands
+// them to listeners, so listener callbacks (redraws) run outside the IRQ
+static struct {
+    input_event_t events[INPUT_QUEUE_SIZE];
+    uint32 head;
+    uint32 tail;
+    uint32 count;
+} g_dispatch;
+static work_t g_dispatch_work;
+
+// g_input_lock guards the event queues and mouse/modifier state, which
+// IRQs update; g_listener_lock guards the listener table, read on every
+// dispatch and written only when a listener comes or goes
+static spinlock_t g_input_lock = SPINLOCK_INIT;
+static lock_stats_t g_input_lock_stats;
+static rwlock_t g_listener_lock = RWLOCK_INIT;
+static lock_stats_t g_listener_lock_stats;
+
+// Events are stamped from the wheel clock rather than a tick counter of
+// our own: a per-tick timer would keep tickless idle from ever sleeping
+static inline uint32 input_now(void) {
+    return (uint32)timer_get_ticks();
+}
+
+static void input_dispatch_work(void* data) {
+    (void)data;
+    
+    for (;;) {
+        uint32 flags = spin_lock_irqsave(&g_input_lock);
+        if (g_dispatch.count == 0) {
+            spin_unlock_irqrestore(&g_input_lock, flags);
+            break;
+        }
+        input_event_t event = g_dispatch.events[g_dispatch.head];
+        g_dispatch.head = (g_dispatch.head + 1) % INPUT_QUEUE_SIZE;
+        g_dispatch.count--;
+        spin_unlock_irqrestore(&g_input_lock, flags);
+        
+        // Callbacks run unlocked so they may add or remove listeners
+        for (uint32 i = 0; ; i++) {
+            read_lock(&g_listener_lock);
+            if (i >= g_input.listener_count) {
+                read_unlock(&g_listener_lock);
+                break;
+            }
+            input_listener_t listener = g_input.listeners[i];
+            read_unlock(&g_listener_lock);
+            
+            if (listener.active && listener.callback) {
+                listener.callback(&event, listener.user_data);
+            }
+        }
+    }
+}
+
 // ============================================================================
 // Initialization
 // ============================================================================
@@ -26,6 +85,12 @@ void input_manager_init(void) {
     g_input.mouse_sensitivity = 3;
     g_input.mouse_acceleration = 0;  // Disabled by default
     g_input.mouse_smoothing = 0;     // Disabled by default
+    
+    memset(&g_dispatch, 0, sizeof(g_dispatch));
+    work_init(&g_dispatch_work, input_dispatch_work, NULL);
+    
+    spin_init(&g_input_lock, "input", &g_input_lock_stats);
+    rw_init(&g_listener_lock, "input_listeners", &g_listener_lock_stats);
 }
 
 // ============================================================================
@@ -59,9 +124,11 @@ void input_post_event(const input_event_t* event) {
     if (!event) return;
     
     input_queue_t* q = &g_input.queue;
+    uint32 flags = spin_lock_irqsave(&g_input_lock);
     
     // Drop event if queue is full
     if (q->count >= INPUT_QUEUE_SIZE) {
+        spin_unlock_irqrestore(&g_input_lock, flags);
         return;
     }
     
@@ -118,13 +185,14 @@ void input_post_event(const input_event_t* event) {
             break;
     }
     
-    // Notify listeners
-    for (uint32 i = 0; i < g_input.listener_count; i++) {
-        input_listener_t* listener = &g_input.listeners[i];
-        if (listener->active && listener->callback) {
-            listener->callback(event, listener->user_data);
-        }
+    // Notify listeners from a worker, not from the posting IRQ
+    if (g_dispatch.count < INPUT_QUEUE_SIZE) {
+        g_dispatch.events[g_dispatch.tail] = *event;
+        g_dispatch.tail = (g_dispatch.tail + 1) % INPUT_QUEUE_SIZE;
+        g_dispatch.count++;
     }
+    spin_unlock_irqrestore(&g_input_lock, flags);
+    work_queue(&g_dispatch_work, WORK_PRIO_HIGH);
 }
 
 // ============================================================================
@@ -134,7 +202,7 @@ void input_post_event(const input_event_t* event) {
 void input_post_mouse_move(sint32 dx, sint32 dy) {
     input_event_t event = {0};
     event.type = INPUT_EVENT_MOUSE_MOVE;
-    event.timestamp = g_input.tick_count;
+    event.timestamp = input_now();
     event.data.mouse.x = g_input.mouse.x;
     event.data.mouse.y = g_input.mouse.y;
     event.data.mouse.dx = dx;
@@ -146,7 +214,7 @@ void input_post_mouse_move(sint32 dx, sint32 dy) {
 void input_post_mouse_button(mouse_button_t button, uint8 pressed) {
     input_event_t event = {0};
     event.type = pressed ? INPUT_EVENT_MOUSE_PRESS : INPUT_EVENT_MOUSE_RELEASE;
-    event.timestamp = g_input.tick_count;
+    event.timestamp = input_now();
     event.data.mouse.x = g_input.mouse.x;
     event.data.mouse.y = g_input.mouse.y;
     event.data.mouse.buttons = g_input.mouse.buttons;
@@ -165,7 +233,7 @@ void input_post_mouse_button(mouse_button_t button, uint8 pressed) {
 void input_post_mouse_wheel(sint32 delta) {
     input_event_t event = {0};
     event.type = INPUT_EVENT_MOUSE_WHEEL;
-    event.timestamp = g_input.tick_count;
+    event.timestamp = input_now();
     event.data.mouse.x = g_input.mouse.x;
     event.data.mouse.y = g_input.mouse.y;
     event.data.mouse.buttons = g_input.mouse.buttons;
@@ -176,7 +244,7 @@ void input_post_mouse_wheel(sint32 delta) {
 void input_post_key(keycode_t keycode, uint8 pressed, char character) {
     input_event_t event = {0};
     event.type = pressed ? INPUT_EVENT_KEY_PRESS : INPUT_EVENT_KEY_RELEASE;
-    event.timestamp = g_input.tick_count;
+    event.timestamp = input_now();
     event.data.key.keycode = keycode;
     event.data.key.character = character;
     event.data.key.shift = g_input.modifiers.shift;
@@ -194,13 +262,18 @@ uint8 input_poll_event(input_event_t* out_event) {
     if (!out_event) return 0;
     
     input_queue_t* q = &g_input.queue;
+    uint32 flags = spin_lock_irqsave(&g_input_lock);
     
-    if (q->count == 0) return 0;
+    if (q->count == 0) {
+        spin_unlock_irqrestore(&g_input_lock, flags);
+        return 0;
+    }
     
     *out_event = q->events[q->head];
     q->head = (q->head + 1) % INPUT_QUEUE_SIZE;
     q->count--;
     
+    spin_unlock_irqrestore(&g_input_lock, flags);
     return 1;
 }
 
@@ -209,9 +282,11 @@ uint8 input_has_events(void) {
 }
 
 void input_flush_events(void) {
+    uint32 flags = spin_lock_irqsave(&g_input_lock);
     g_input.queue.head = 0;
     g_input.queue.tail = 0;
     g_input.queue.count = 0;
+    spin_unlock_irqrestore(&g_input_lock, flags);
 }
 
 // ============================================================================
@@ -219,11 +294,13 @@ void input_flush_events(void) {
 // ============================================================================
 
 int input_add_listener(const char* name, input_listener_fn callback, void* user_data, uint8 priority) {
-    if (g_input.listener_count >= MAX_LISTENERS) {
+    if (!name || !callback) {
         return -1;
     }
     
-    if (!name || !callback) {
+    write_lock(&g_listener_lock);
+    if (g_input.listener_count >= MAX_LISTENERS) {
+        write_unlock(&g_listener_lock);
         return -1;
     }
     
@@ -252,12 +329,14 @@ int input_add_listener(const char* name, input_listener_fn callback, void* user_
     
     g_input.listener_count++;
     
+    write_unlock(&g_listener_lock);
     return (int)insert_at;
 }
 
 void input_remove_listener(const char* name) {
     if (!name) return;
     
+    write_lock(&g_listener_lock);
     for (uint32 i = 0; i < g_input.listener_count; i++) {
         if (strncmp(g_input.listeners[i].name, name, INPUT_LISTENER_NAME_LEN) == 0) {
             // Shift remaining listeners
@@ -265,9 +344,10 @@ void input_remove_listener(const char* name) {
                 g_input.listeners[j] = g_input.listeners[j + 1];
             }
             g_input.listener_count--;
-            return;
+            break;
         }
     }
+    write_unlock(&g_listener_lock);
 }
 
 // ============================================================================
@@ -303,9 +383,11 @@ uint8 input_mouse_button_down(mouse_button_t button) {
 // ============================================================================
 
 void input_set_mouse_position(sint32 x, sint32 y) {
+    uint32 flags = spin_lock_irqsave(&g_input_lock);
     g_input.mouse.x = x;
     g_input.mouse.y = y;
     clamp_mouse_position();
+    spin_unlock_irqrestore(&g_input_lock, flags);
 }
 
 void input_set_mouse_visible(uint8 visible) {
@@ -313,12 +395,14 @@ void input_set_mouse_visible(uint8 visible) {
 }
 
 void input_confine_mouse(sint32 x, sint32 y, sint32 w, sint32 h) {
+    uint32 flags = spin_lock_irqsave(&g_input_lock);
     g_input.mouse.confined = 1;
     g_input.mouse.confine_x = x;
     g_input.mouse.confine_y = y;
     g_input.mouse.confine_w = w;
     g_input.mouse.confine_h = h;
     clamp_mouse_position();
+    spin_unlock_irqrestore(&g_input_lock, flags);
 }
 
 void input_unconfine_mouse(void) {
@@ -345,12 +429,4 @@ void input_set_mouse_smoothing(uint8 level) {
     if (level <= 3) {
         g_input.mouse_smoothing = level;
     }
-}
-
-// ============================================================================
-// Tick Update
-// ============================================================================
-
-void input_tick(void) {
-    g_input.tick_count++;
 }
\ No newline at end of file
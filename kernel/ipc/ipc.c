@@ -1,5 +1,15 @@
 #include "ipc.h"
 #include "string.h"
+#include "kheap.h"
+#include "pmm.h"
+#include "task.h"
+#include "process.h"
+#include "scheduler.h"
+#include "clock.h"
+#include "video.h"
+
+static ipc_stats_t g_ipc_stats;
+static spinlock_t g_ipc_stats_lock = SPINLOCK_INIT;
 
 // Initialize message queue
 void message_queue_init(message_queue_t* queue) {
@@ -7,6 +17,7 @@ void message_queue_init(message_queue_t* queue) {
     queue->read_index = 0;
     queue->write_index = 0;
     queue->count = 0;
+    spin_init(&queue->lock, "ipc", NULL);
 }
 
 // Check if queue is empty
@@ -22,7 +33,9 @@ int message_queue_is_full(message_queue_t* queue) {
 // Enqueue a message (add to queue)
 // Returns 0 on success, -1 if queue is full
 int message_queue_enqueue(message_queue_t* queue, message_t* msg) {
+    uint32 flags = spin_lock_irqsave(&queue->lock);
     if (message_queue_is_full(queue)) {
+        spin_unlock_irqrestore(&queue->lock, flags);
         return -1;  // Queue full
     }
     
@@ -32,6 +45,7 @@ int message_queue_enqueue(message_queue_t* queue, message_t* msg) {
     // Update write index (circular)
     queue->write_index = (queue->write_index + 1) % MESSAGE_QUEUE_SIZE;
     queue->count++;
+    spin_unlock_irqrestore(&queue->lock, flags);
     
     return 0;  // Success
 }
@@ -39,7 +53,9 @@ int message_queue_enqueue(message_queue_t* queue, message_t* msg) {
 // Dequeue a message (remove from queue)
 // Returns 0 on success, -1 if queue is empty
 int message_queue_dequeue(message_queue_t* queue, message_t* msg) {
+    uint32 flags = spin_lock_irqsave(&queue->lock);
     if (message_queue_is_empty(queue)) {
+        spin_unlock_irqrestore(&queue->lock, flags);
         return -1;  // Queue empty
     }
     
@@ -49,6 +65,469 @@ int message_queue_dequeue(message_queue_t* queue, message_t* msg) {
     // Update read index (circular)
     queue->read_index = (queue->read_index + 1) % MESSAGE_QUEUE_SIZE;
     queue->count--;
+    spin_unlock_irqrestore(&queue->lock, flags);
     
     return 0;  // Success
 }
+
+// Count a transfer; bytes are 64-bit, so the counters share a lock
+static void note_transfer(uint32* msgs, uint64* bytes, uint32 len) {
+    uint32 flags = spin_lock_irqsave(&g_ipc_stats_lock);
+    (*msgs)++;
+    if (bytes) {
+        *bytes += len;
+    }
+    spin_unlock_irqrestore(&g_ipc_stats_lock, flags);
+}
+
+// Allocate a message buffer
+// Small payloads share one heap block with the header (the per-CPU
+// magazine path); large ones get contiguous frames so they can be lent
+ipc_buf_t* ipc_buf_alloc(uint32 size) {
+    if (size <= IPC_BUF_HEAP_MAX) {
+        ipc_buf_t* buf = (ipc_buf_t*)kmalloc(sizeof(ipc_buf_t) + size);
+        if (!buf) {
+            return NULL;
+        }
+        buf->size = size;
+        buf->capacity = size;
+        buf->frames = 0;
+        buf->data = (uint8*)(buf + 1);
+        buf->call = NULL;
+        return buf;
+    }
+
+    ipc_buf_t* buf = (ipc_buf_t*)kmalloc(sizeof(ipc_buf_t));
+    if (!buf) {
+        return NULL;
+    }
+    uint32 frames = (size + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+    uint32 frame = pmm_alloc_frames(frames);
+    if (frame == 0) {
+        kfree(buf);
+        return NULL;
+    }
+    buf->size = size;
+    buf->capacity = frames * PMM_PAGE_SIZE;
+    buf->frames = frames;
+    buf->data = (uint8*)PMM_FRAME_TO_ADDR(frame);   // Identity mapped
+    buf->call = NULL;
+    return buf;
+}
+
+// Free a message buffer and its frames
+void ipc_buf_free(ipc_buf_t* buf) {
+    if (!buf) {
+        return;
+    }
+    if (buf->frames) {
+        pmm_free_frames(PMM_ADDR_TO_FRAME(buf->data), buf->frames);
+    }
+    kfree(buf);
+}
+
+static int send_buf(message_queue_t* queue, uint32 sender_pid, uint32 type, ipc_buf_t* buf) {
+    message_t msg;
+    msg.sender_pid = sender_pid;
+    msg.type = type | IPC_MSG_BUF;
+    msg.data1 = (uint32)buf;
+    msg.data2 = buf->size;
+    return message_queue_enqueue(queue, &msg);
+}
+
+// Wake the receiver parked in ipc_wait(), if any. One that has not
+// parked yet finds the message when it looks again
+static void wake_waiter(message_queue_t* queue) {
+    task_t* waiter = queue->waiter;
+    if (waiter) {
+        task_wake(waiter);
+    }
+}
+
+// Lend a buffer to the receiver: only the pointer is queued
+int ipc_send_buf(message_queue_t* queue, uint32 sender_pid, uint32 type, ipc_buf_t* buf) {
+    if (!queue || !buf || (type & IPC_MSG_FLAGS) || buf->size > buf->capacity) {
+        return -1;
+    }
+    if (send_buf(queue, sender_pid, type, buf) != 0) {
+        return -1;
+    }
+    wake_waiter(queue);
+
+    note_transfer(&g_ipc_stats.lent_msgs, &g_ipc_stats.bytes_lent, buf->size);
+    if (buf->frames) {
+        note_transfer(&g_ipc_stats.page_bufs, NULL, 0);
+    }
+    return 0;
+}
+
+// Send a payload by value
+int ipc_send_data(message_queue_t* queue, uint32 sender_pid, uint32 type,
+                  const void* data, uint32 len) {
+    if (!queue || (type & IPC_MSG_FLAGS) || (len && !data)) {
+        return -1;
+    }
+
+    // Fast path: the fixed message carries it
+    if (len <= IPC_INLINE_MAX) {
+        message_t msg;
+        msg.sender_pid = sender_pid;
+        msg.type = type;
+        msg.data1 = 0;
+        msg.data2 = 0;
+        memcpy(&msg.data1, data, len);
+        if (message_queue_enqueue(queue, &msg) != 0) {
+            return -1;
+        }
+        wake_waiter(queue);
+        note_transfer(&g_ipc_stats.inline_msgs, NULL, 0);
+        return 0;
+    }
+
+    // Check for room first: a full queue is the common failure and
+    // should not cost an allocation and a copy
+    if (message_queue_is_full(queue)) {
+        return -1;
+    }
+    ipc_buf_t* buf = ipc_buf_alloc(len);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf->data, data, len);
+    if (send_buf(queue, sender_pid, type, buf) != 0) {
+        ipc_buf_free(buf);
+        return -1;
+    }
+    wake_waiter(queue);
+
+    note_transfer(&g_ipc_stats.copied_msgs, &g_ipc_stats.bytes_copied, len);
+    if (buf->frames) {
+        note_transfer(&g_ipc_stats.page_bufs, NULL, 0);
+    }
+    return 0;
+}
+
+// Copy out a received payload and release its buffer
+uint32 ipc_msg_read(message_t* msg, void* out, uint32 max) {
+    ipc_buf_t* buf = ipc_msg_buf(msg);
+    if (!buf) {
+        uint32 len = max < IPC_INLINE_MAX ? max : IPC_INLINE_MAX;
+        memcpy(out, &msg->data1, len);
+        return IPC_INLINE_MAX;
+    }
+
+    uint32 len = buf->size;
+    memcpy(out, buf->data, len < max ? len : max);
+    ipc_buf_free(buf);
+    msg->type = ipc_msg_type(msg);
+    msg->data1 = 0;
+    return len;
+}
+
+// Sender PID of the calling task, 0 for a kernel task
+static uint32 current_pid(task_t* task) {
+    process_t* proc = task ? (process_t*)task->process : NULL;
+    return proc ? proc->pid : 0;
+}
+
+// Synchronous request
+// The caller parks itself before the request becomes visible, so a reply
+// from another CPU cannot slip in between sending and blocking; with
+// interrupts off the timer cannot switch it away half parked either
+int ipc_call(message_queue_t* queue, uint32 type, const void* data, uint32 len,
+             message_t* reply) {
+    task_t* self = task_get_current();
+    if (!queue || !reply || !self || (type & IPC_MSG_FLAGS) || (len && !data) ||
+        !scheduler_is_initialized() || queue->waiter == self) {
+        return -1;
+    }
+
+    ipc_call_t call;
+    call.caller = self;
+    call.done = 0;
+    ipc_buf_t* buf = ipc_buf_alloc(len);
+    if (!buf) {
+        return -1;
+    }
+    memcpy(buf->data, data, len);
+    buf->call = &call;
+
+    uint32 flags = local_irq_save();
+    task_block(self, TASK_WAITING);
+    if (send_buf(queue, current_pid(self), type | IPC_MSG_CALL, buf) != 0) {
+        task_wake(self);
+        local_irq_restore(flags);
+        ipc_buf_free(buf);
+        return -1;
+    }
+
+    // Run the receiver right here if it is waiting; otherwise just go
+    task_t* server = queue->waiter;
+    if (server) {
+        scheduler_handoff(server);
+    } else {
+        task_switch();
+    }
+
+    // Woken by something other than the reply: park again
+    while (!call.done) {
+        task_block(self, TASK_WAITING);
+        if (call.done) {
+            task_wake(self);
+            break;
+        }
+        task_switch();
+    }
+    local_irq_restore(flags);
+
+    *reply = call.reply;
+    note_transfer(&g_ipc_stats.calls, &g_ipc_stats.bytes_copied, len);
+    return 0;
+}
+
+// Answer a call and switch straight back to the caller
+void ipc_reply(ipc_call_t* call, uint32 data1, uint32 data2) {
+    if (!call) {
+        return;
+    }
+
+    task_t* caller = call->caller;
+    task_t* self = task_get_current();
+    call->reply.sender_pid = current_pid(self);
+    call->reply.type = 0;
+    call->reply.data1 = data1;
+    call->reply.data2 = data2;
+
+    // The record is on the caller's stack: once done is set it may be gone
+    asm volatile("" : : : "memory");
+    call->done = 1;
+    scheduler_handoff(caller);
+}
+
+// Blocking receive
+// Parks first, then looks: a sender that finds the task waiting wakes
+// it, one that came earlier left its message in the queue
+int ipc_wait(message_queue_t* queue, message_t* msg) {
+    if (!queue || !msg) {
+        return -1;
+    }
+    if (message_queue_dequeue(queue, msg) == 0) {
+        return 0;
+    }
+
+    task_t* self = task_get_current();
+    if (!self || !scheduler_is_initialized()) {
+        return -1;
+    }
+
+    uint32 flags = local_irq_save();
+    queue->waiter = self;
+    for (;;) {
+        task_block(self, TASK_WAITING);
+        if (message_queue_dequeue(queue, msg) == 0) {
+            task_wake(self);
+            break;
+        }
+        task_switch();
+    }
+    queue->waiter = NULL;
+    local_irq_restore(flags);
+    return 0;
+}
+
+void ipc_get_stats(ipc_stats_t* stats) {
+    if (!stats) {
+        return;
+    }
+    uint32 flags = spin_lock_irqsave(&g_ipc_stats_lock);
+    *stats = g_ipc_stats;
+    spin_unlock_irqrestore(&g_ipc_stats_lock, flags);
+}
+
+// Throughput benchmark
+// A producer task streams IPC_BENCH_MSGS messages of each size to a
+// consumer task, first by value (copied in by ipc_send_data and out by
+// ipc_msg_read) and then lent (written in place, read in place). The
+// consumer times each round from the producer's first send to its own
+// last receive. Then the producer makes IPC_BENCH_CALLS calls that the
+// consumer answers at once, timing the round trip.
+#define IPC_BENCH_MSGS  256
+#define IPC_BENCH_CALLS 1024
+#define IPC_BENCH_MAX   65536
+
+static const uint32 g_bench_sizes[] = { 8, 64, 1024, 4096, 65536 };
+#define IPC_BENCH_ROUNDS (2 * (sizeof(g_bench_sizes) / sizeof(g_bench_sizes[0])))
+#define IPC_BENCH_CALL   IPC_BENCH_ROUNDS         // Message types after the rounds
+#define IPC_BENCH_STOP   (IPC_BENCH_ROUNDS + 1)
+
+static struct {
+    message_queue_t queue;
+    uint8* src;                  // Producer's data for the copying rounds
+    uint8* dst;                  // Consumer's receive buffer
+    volatile uint32 running;
+    volatile uint32 done;        // Rounds the consumer has finished
+    volatile uint64 start_ns;    // First send of the current round
+} g_bench;
+
+// Tell the consumer to clean up and exit (an inline message needs no memory)
+static void bench_stop(void) {
+    while (ipc_send_data(&g_bench.queue, 0, IPC_BENCH_STOP, NULL, 0) != 0) {
+        scheduler_yield();
+    }
+}
+
+static void bench_calls(void) {
+    sched_stats_t before, after;
+    message_t reply;
+    uint32 arg = 0;
+
+    scheduler_get_stats(&before);
+    uint64 start = clock_monotonic_ns();
+    for (uint32 i = 0; i < IPC_BENCH_CALLS; i++) {
+        if (ipc_call(&g_bench.queue, IPC_BENCH_CALL, &arg, sizeof(arg), &reply) != 0) {
+            debug_print("IPC bench: call failed\n");
+            return;
+        }
+        arg = reply.data1;
+    }
+    uint32 ns = (uint32)(clock_monotonic_ns() - start) / IPC_BENCH_CALLS;
+    scheduler_get_stats(&after);
+
+    debug_print("IPC bench: call round trip 0x");
+    debug_print_hex(ns);
+    debug_print(" ns, handoffs 0x");
+    debug_print_hex(after.handoffs - before.handoffs);
+    debug_print("\n");
+}
+
+static void bench_producer(void) {
+    for (uint32 round = 0; round < IPC_BENCH_ROUNDS; round++) {
+        uint32 size = g_bench_sizes[round >> 1];
+        int lend = round & 1;
+
+        g_bench.start_ns = clock_monotonic_ns();
+        for (uint32 i = 0; i < IPC_BENCH_MSGS; i++) {
+            if (lend) {
+                ipc_buf_t* buf = ipc_buf_alloc(size);
+                if (!buf) {
+                    debug_print("IPC bench: out of memory\n");
+                    bench_stop();
+                    return;
+                }
+                *(uint32*)buf->data = i;
+                while (ipc_send_buf(&g_bench.queue, 0, round, buf) != 0) {
+                    scheduler_yield();
+                }
+            } else {
+                *(uint32*)g_bench.src = i;
+                while (ipc_send_data(&g_bench.queue, 0, round, g_bench.src, size) != 0) {
+                    scheduler_yield();
+                }
+            }
+        }
+
+        // Let the consumer report before the next round starts the clock
+        while (g_bench.done <= round) {
+            scheduler_yield();
+        }
+    }
+
+    bench_calls();
+    bench_stop();
+}
+
+static void bench_consumer(void) {
+    message_t msg;
+    uint32 received = 0;
+
+    for (;;) {
+        if (ipc_wait(&g_bench.queue, &msg) != 0) {
+            break;
+        }
+
+        // Calls are answered at once: the reply carries the argument + 1
+        ipc_call_t* call = ipc_msg_call(&msg);
+        if (call) {
+            uint32 arg = 0;
+            ipc_msg_read(&msg, &arg, sizeof(arg));
+            ipc_reply(call, arg + 1, 0);
+            continue;
+        }
+
+        uint32 round = ipc_msg_type(&msg);
+        if (round >= IPC_BENCH_ROUNDS) {
+            break;
+        }
+        if (round & 1) {
+            // Lent: consume in place
+            ipc_buf_t* buf = ipc_msg_buf(&msg);
+            g_bench.dst[0] = buf->data[0];
+            ipc_buf_free(buf);
+        } else {
+            ipc_msg_read(&msg, g_bench.dst, IPC_BENCH_MAX);
+        }
+        if (++received < IPC_BENCH_MSGS) {
+            continue;
+        }
+
+        // Round complete; a round stays well under 4s, so 32 bits of
+        // nanoseconds are enough and bytes per microsecond is MB/s
+        uint32 size = g_bench_sizes[round >> 1];
+        uint32 us = (uint32)(clock_monotonic_ns() - g_bench.start_ns) / 1000;
+        debug_print("IPC bench: size 0x");
+        debug_print_hex(size);
+        debug_print((round & 1) ? " lent " : " copied ");
+        debug_print_hex(us ? size * IPC_BENCH_MSGS / us : 0);
+        debug_print(" MB/s\n");
+
+        received = 0;
+        g_bench.done = round + 1;
+    }
+
+    // An aborted run can leave buffers queued
+    while (message_queue_dequeue(&g_bench.queue, &msg) == 0) {
+        ipc_buf_free(ipc_msg_buf(&msg));
+    }
+    kfree(g_bench.src);
+    kfree(g_bench.dst);
+    g_bench.running = 0;
+}
+
+// Start the benchmark tasks; -1 if one is already running
+// They only touch locked state (queues, heap, scheduler), so they may run
+// on any CPU and the copies can overlap with the other side's work
+int ipc_bench_start(void) {
+    if (g_bench.running || !scheduler_is_initialized()) {
+        return -1;
+    }
+
+    message_queue_init(&g_bench.queue);
+    g_bench.src = (uint8*)kmalloc(IPC_BENCH_MAX);
+    g_bench.dst = (uint8*)kmalloc(IPC_BENCH_MAX);
+    if (!g_bench.src || !g_bench.dst) {
+        kfree(g_bench.src);
+        kfree(g_bench.dst);
+        return -1;
+    }
+    memset(g_bench.src, 0xA5, IPC_BENCH_MAX);
+    g_bench.done = 0;
+    g_bench.running = 1;
+
+    task_t* consumer = task_create(bench_consumer);
+    if (!consumer) {
+        g_bench.running = 0;
+        kfree(g_bench.src);
+        kfree(g_bench.dst);
+        return -1;
+    }
+    scheduler_set_affinity(consumer, SCHED_AFFINITY_ALL);
+    
+    task_t* producer = task_create(bench_producer);
+    if (!producer) {
+        // The consumer cleans up
+        bench_stop();
+        return -1;
+    }
+    scheduler_set_affinity(producer, SCHED_AFFINITY_ALL);
+    return 0;
+}
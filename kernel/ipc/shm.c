@@ -66,7 +66,8 @@ uint32 shm_create(uint32 size) {
     region->size = aligned_size;
     region->kernel_vaddr = kernel_vaddr;
     region->phys_addr = (uint32)kernel_vaddr;  // Identity mapped
-    region->owner_pid = process_get_current() ? process_get_current()->pid : 0;
+    process_t* owner = process_get_running();
+    region->owner_pid = owner ? owner->pid : 0;
     region->ref_count = 0;
     region->next = NULL;
     
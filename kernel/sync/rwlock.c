@@ -0,0 +1,99 @@
+#include "rwlock.h"
+
+static inline uint32_t read_tsc32(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+static inline void cpu_relax(void) {
+    asm volatile("pause" : : : "memory");
+}
+
+void rw_init(rwlock_t* lock, const char* name, lock_stats_t* stats) {
+    lock->count = 0;
+    lock->writers_waiting = 0;
+    lock->hold_start = 0;
+    lock->stats = stats;
+    lock_stats_register(stats, name);
+}
+
+void read_lock(rwlock_t* lock) {
+    uint32_t spins = 0;
+
+    for (;;) {
+        /* Let a waiting writer in first */
+        while (lock->writers_waiting || lock->count < 0) {
+            cpu_relax();
+            spins++;
+        }
+        int32_t count = lock->count;
+        if (count >= 0 && __sync_bool_compare_and_swap(&lock->count, count, count + 1)) {
+            break;
+        }
+    }
+
+    /* Readers share the lock, so their counters need atomics */
+    if (lock->stats) {
+        __sync_fetch_and_add(&lock->stats->acquisitions, 1);
+        if (spins) {
+            __sync_fetch_and_add(&lock->stats->contended, 1);
+            __sync_fetch_and_add(&lock->stats->spins, spins);
+        }
+    }
+}
+
+void read_unlock(rwlock_t* lock) {
+    __sync_fetch_and_sub(&lock->count, 1);
+}
+
+void write_lock(rwlock_t* lock) {
+    uint32_t spins = 0;
+
+    __sync_fetch_and_add(&lock->writers_waiting, 1);
+    while (!__sync_bool_compare_and_swap(&lock->count, 0, -1)) {
+        cpu_relax();
+        spins++;
+    }
+    __sync_fetch_and_sub(&lock->writers_waiting, 1);
+
+    if (lock->stats) {
+        /* Readers may be counting concurrently with a previous writer's
+         * release, so stay atomic here too */
+        __sync_fetch_and_add(&lock->stats->acquisitions, 1);
+        if (spins) {
+            __sync_fetch_and_add(&lock->stats->contended, 1);
+            __sync_fetch_and_add(&lock->stats->spins, spins);
+        }
+        lock->hold_start = read_tsc32();
+    }
+}
+
+void write_unlock(rwlock_t* lock) {
+    if (lock->stats) {
+        lock_stats_hold(lock->stats, read_tsc32() - lock->hold_start);
+    }
+    __sync_lock_release(&lock->count);
+}
+
+uint32_t read_lock_irqsave(rwlock_t* lock) {
+    uint32_t flags = local_irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+void read_unlock_irqrestore(rwlock_t* lock, uint32_t flags) {
+    read_unlock(lock);
+    local_irq_restore(flags);
+}
+
+uint32_t write_lock_irqsave(rwlock_t* lock) {
+    uint32_t flags = local_irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+void write_unlock_irqrestore(rwlock_t* lock, uint32_t flags) {
+    write_unlock(lock);
+    local_irq_restore(flags);
+}
@@ -0,0 +1,189 @@
+#include "spinlock.h"
+#include "string.h"
+#include "video.h"
+
+/* Every lock_stats_t handed to an *_init function */
+static lock_stats_t* g_lock_stats;
+
+/* Hold times only need the low word: no lock is held for 2^32 cycles */
+static inline uint32_t read_tsc32(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+static inline void cpu_relax(void) {
+    asm volatile("pause" : : : "memory");
+}
+
+/* Account an acquisition (the lock is held, so the counters are ours) */
+static inline void note_acquired(lock_stats_t* stats, uint32_t spins, uint32_t* hold_start) {
+    stats->acquisitions++;
+    if (spins) {
+        stats->contended++;
+        stats->spins += spins;
+    }
+    *hold_start = read_tsc32();
+}
+
+uint32_t local_irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void local_irq_restore(uint32_t flags) {
+    asm volatile("push %0\n\tpopf" : : "r"(flags) : "memory", "cc");
+}
+
+/* ============== Statistics ============== */
+
+void lock_stats_register(lock_stats_t* stats, const char* name) {
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(lock_stats_t));
+    stats->name = name;
+    stats->next = g_lock_stats;
+    g_lock_stats = stats;
+}
+
+void lock_stats_hold(lock_stats_t* stats, uint32_t cycles) {
+    uint32_t bucket = 0;
+    uint32_t limit = LOCK_HOLD_BASE;
+    while (bucket < LOCK_HOLD_BUCKETS - 1 && cycles >= limit) {
+        bucket++;
+        limit <<= 2;
+    }
+
+    stats->hold_hist[bucket]++;
+    if (cycles > stats->hold_max) {
+        stats->hold_max = cycles;
+    }
+}
+
+lock_stats_t* lock_stats_list(void) {
+    return g_lock_stats;
+}
+
+void lock_stats_dump(void) {
+    debug_print("\n=== Lock Statistics ===\n");
+    for (lock_stats_t* s = g_lock_stats; s; s = s->next) {
+        debug_print(s->name ? s->name : "?");
+        debug_print(": acquired ");
+        debug_print_hex(s->acquisitions);
+        debug_print(" contended ");
+        debug_print_hex(s->contended);
+        debug_print(" spins ");
+        debug_print_hex(s->spins);
+        debug_print(" max hold ");
+        debug_print_hex(s->hold_max);
+        debug_print("\n  hold:");
+        for (int i = 0; i < LOCK_HOLD_BUCKETS; i++) {
+            debug_print(" ");
+            debug_print_hex(s->hold_hist[i]);
+        }
+        debug_print("\n");
+    }
+    debug_print("=======================\n");
+}
+
+/* ============== Spinlock ============== */
+
+void spin_init(spinlock_t* lock, const char* name, lock_stats_t* stats) {
+    lock->locked = 0;
+    lock->hold_start = 0;
+    lock->stats = stats;
+    lock_stats_register(stats, name);
+}
+
+void spin_lock(spinlock_t* lock) {
+    uint32_t spins = 0;
+
+    /* Spin on plain reads so waiters don't bounce the cache line */
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        while (lock->locked) {
+            cpu_relax();
+            spins++;
+        }
+    }
+
+    if (lock->stats) {
+        note_acquired(lock->stats, spins, &lock->hold_start);
+    }
+}
+
+int spin_trylock(spinlock_t* lock) {
+    if (__sync_lock_test_and_set(&lock->locked, 1)) {
+        return 0;
+    }
+    if (lock->stats) {
+        note_acquired(lock->stats, 0, &lock->hold_start);
+    }
+    return 1;
+}
+
+void spin_unlock(spinlock_t* lock) {
+    if (lock->stats) {
+        lock_stats_hold(lock->stats, read_tsc32() - lock->hold_start);
+    }
+    __sync_lock_release(&lock->locked);
+}
+
+uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = local_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+/* ============== Ticket lock ============== */
+
+void ticket_init(ticket_lock_t* lock, const char* name, lock_stats_t* stats) {
+    lock->next = 0;
+    lock->owner = 0;
+    lock->hold_start = 0;
+    lock->stats = stats;
+    lock_stats_register(stats, name);
+}
+
+void ticket_lock(ticket_lock_t* lock) {
+    uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    uint32_t spins = 0;
+
+    while (lock->owner != ticket) {
+        cpu_relax();
+        spins++;
+    }
+
+    if (lock->stats) {
+        note_acquired(lock->stats, spins, &lock->hold_start);
+    }
+}
+
+void ticket_unlock(ticket_lock_t* lock) {
+    if (lock->stats) {
+        lock_stats_hold(lock->stats, read_tsc32() - lock->hold_start);
+    }
+
+    /* Only the holder writes owner: a plain store after a compiler
+     * barrier is a release on x86 */
+    asm volatile("" : : : "memory");
+    lock->owner = lock->owner + 1;
+}
+
+uint32_t ticket_lock_irqsave(ticket_lock_t* lock) {
+    uint32_t flags = local_irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+void ticket_unlock_irqrestore(ticket_lock_t* lock, uint32_t flags) {
+    ticket_unlock(lock);
+    local_irq_restore(flags);
+}
@@ -23,10 +23,26 @@ static inline int is_valid_pointer(void* ptr, uint32 size) {
     return 1;  // Appears valid
 }
 
+// User space only sees the fixed message: a payload buffer lives in
+// kernel memory, so drop it and leave just its length in data2. User
+// space cannot reply either, so a waiting caller gets -1 back
+static inline void strip_msg_buf(message_t* msg) {
+    ipc_buf_t* buf = ipc_msg_buf(msg);
+    if (buf) {
+        ipc_call_t* call = ipc_msg_call(msg);
+        ipc_buf_free(buf);
+        msg->type = ipc_msg_type(msg);
+        msg->data1 = 0;
+        if (call) {
+            ipc_reply(call, (uint32)-1, 0);
+        }
+    }
+}
+
 // Syscall handler - called when user mode executes int 0x80
 void syscall_handler(REGISTERS *regs) {
-    // Get current process for context
-    process_t* current = process_get_current();
+    // Get the calling process for context
+    process_t* current = process_get_running();
     
     // Get syscall number from EAX
     uint32 syscall_num = regs->eax;
@@ -77,6 +93,13 @@ void syscall_handler(REGISTERS *regs) {
                 break;
             }
             
+            // Buffer messages carry kernel pointers; never take one from
+            // user space
+            if (msg->type & IPC_MSG_FLAGS) {
+                regs->eax = -1;
+                break;
+            }
+            
             // Find target process
             process_t* target = process_find_by_pid(target_pid);
             if (!target) {
@@ -93,7 +116,7 @@ void syscall_handler(REGISTERS *regs) {
             // Wake up target if it's waiting for messages
             if (result == 0 && target->main_thread && 
                 target->main_thread->state == TASK_WAITING) {
-                target->main_thread->state = TASK_READY;
+                task_wake(target->main_thread);
             }
             
             regs->eax = result;  // 0 on success, -1 if queue full
@@ -116,19 +139,12 @@ void syscall_handler(REGISTERS *regs) {
                 break;
             }
             
-            // Try to dequeue a message
-            int result = message_queue_dequeue(&current->inbox, msg);
-            
+            // Sleep until a message arrives; senders wake us
+            int result = ipc_wait(&current->inbox, msg);
             if (result == 0) {
-                // Message received
-                regs->eax = 0;
-            } else {
-                // No message available - block the task
-                if (current->main_thread) {
-                    current->main_thread->state = TASK_WAITING;
-                }
-                regs->eax = -1;  // Will be retried when task wakes
+                strip_msg_buf(msg);
             }
+            regs->eax = result;  // -1 only before the scheduler runs
             break;
         }
         
@@ -150,6 +166,9 @@ void syscall_handler(REGISTERS *regs) {
             
             // Try to dequeue a message (non-blocking)
             int result = message_queue_dequeue(&current->inbox, msg);
+            if (result == 0) {
+                strip_msg_buf(msg);
+            }
             regs->eax = result;  // 0 if message received, -1 if no message
             break;
         }
@@ -3,11 +3,14 @@
 #include "video.h"
 #include "string.h"
 #include "kernel.h"
+#include "pmm.h"
+#include "vmm.h"
 
 // Page flags from memory.h
 #define PAGE_PRESENT    0x1
 #define PAGE_WRITE      0x2
 #define PAGE_USER       0x4
+#define PAGE_COW        0x200
 
 // User space allocator - simple bump allocator
 static void* user_heap_current = NULL;
@@ -42,22 +45,19 @@ void* allocate_user_memory(uint32 size) {
     // Map pages as user-accessible using kernel page directory
     page_directory_t* kernel_dir = get_kernel_page_directory();
     
-    // Allocate and map the pages with user permissions
+    // Every page starts as the shared zero page, read-only and
+    // copy-on-write: frames are only allocated (and zeroed) when written
     uint32 start_addr = (uint32)result;
     uint32 end_addr = (uint32)user_heap_current;
+    uint32 zero_page = PMM_FRAME_TO_ADDR(pmm_zero_frame());
     
+    // Replaced translations are flushed once at the end
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch);
     for (uint32 addr = start_addr; addr < end_addr; addr += 0x1000) {
-        // Map to physical address (identity mapping for now)
-        map_page_in_directory(kernel_dir, addr, addr, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+        map_page_in_directory_batch(kernel_dir, addr, zero_page, PAGE_PRESENT | PAGE_USER | PAGE_COW, &batch);
     }
-    
-    // Flush TLB for the affected pages
-    for (uint32 addr = start_addr; addr < end_addr; addr += 0x1000) {
-        asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
-    }
-    
-    // Clear the allocated memory (full aligned size to prevent memory leaks)
-    memset(result, 0, aligned_size);
+    vmm_tlb_batch_flush(&batch);
     
     return result;
 }
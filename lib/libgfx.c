@@ -7,7 +7,6 @@
 static struct {
     uint32_t server_pid;
     uint32_t connected;
-    uint32_t next_window_id;
 } g_gfx_client;
 
 /* Helper: send message and wait for response */
@@ -16,31 +15,25 @@ static int gfx_send_request(gfx_message_t* msg, gfx_response_t* resp) {
         return GFX_ERR_NO_SERVER;
     }
     
-    /* Send message to graphics server */
-    message_t ipc_msg;
-    ipc_msg.type = msg->type;
-    ipc_msg.sender_pid = process_get_current()->pid;
-    /* Copy data (only data1 and data2 available in message_t) */
-    memcpy(&ipc_msg.data1, &msg->data, sizeof(uint32_t) * 2);
-    
     process_t* server = process_find_by_pid(g_gfx_client.server_pid);
     if (!server) {
         return GFX_ERR_NO_SERVER;
     }
     
-    int result = message_queue_enqueue(&server->inbox, &ipc_msg);
-    
-    if (result != 0) {
+    /* Send the whole payload and wait for the answer; a server blocked
+     * waiting for requests runs straight away on this CPU */
+    message_t reply;
+    if (ipc_call(&server->inbox, msg->type, &msg->data, sizeof(msg->data), &reply) != 0) {
         return GFX_ERR_TIMEOUT;
     }
     
-    /* For now, we don't wait for response in this simplified version */
     if (resp) {
-        resp->result = GFX_OK;
-        resp->data = 0;
+        resp->request_id = msg->type;
+        resp->result = (int32_t)reply.data1;
+        resp->data = reply.data2;
     }
     
-    return GFX_OK;
+    return (int32_t)reply.data1;
 }
 
 int gfx_connect(void) {
@@ -48,7 +41,6 @@ int gfx_connect(void) {
     /* For now, assume server PID is 1 */
     g_gfx_client.server_pid = 1;
     g_gfx_client.connected = 1;
-    g_gfx_client.next_window_id = 1;
     
     return GFX_OK;
 }
@@ -81,7 +73,7 @@ uint32_t gfx_create_window(int32_t x, int32_t y, uint32_t width, uint32_t height
     
     gfx_response_t resp;
     if (gfx_send_request(&msg, &resp) == GFX_OK) {
-        return g_gfx_client.next_window_id++;
+        return resp.data;    /* ID the server assigned */
     }
     
     return 0;
@@ -0,0 +1,492 @@
+/*
+ * Host-side allocator benchmark and fuzz harness
+ *
+ * Builds kernel/core/kheap.c and kernel/core/pmm.c against host_shim.c
+ * and replays deterministic allocation traces, reporting ns/op, peak
+ * usage and fragmentation. The same seed always replays the same trace.
+ * Each trace runs in its own child process because both allocators keep
+ * global state that cannot be re-initialized.
+ *
+ * Usage: alloc_bench [seed] [ops]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "kheap.h"
+#include "pmm.h"
+#include "smp.h"
+
+#define HEAP_SIZE      (16 * 1024 * 1024)
+#define HEAP_SLOTS     1024
+#define BATCH_SIZE     512
+#define REALLOC_BUFS   64
+#define PMM_MEM_SIZE   (128 * 1024 * 1024)
+#define PMM_FRAMES     (PMM_MEM_SIZE / PMM_PAGE_SIZE)
+#define PMM_SLOTS      8192
+#define CHECK_INTERVAL 1024
+#define BENCH_CPUS     4
+
+/* Trace result */
+typedef struct {
+    uint64_t ops;
+    uint64_t ns;
+    size_t peak;        /* Peak bytes in use */
+    double frag;        /* 1 - largest free block / total free */
+} bench_result_t;
+
+static uint32_t g_seed = 1;
+static uint32_t g_ops = 200000;
+static uint32_t g_rng;
+
+/* xorshift32 - deterministic across hosts */
+static uint32_t rng_next(void) {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 17;
+    g_rng ^= g_rng << 5;
+    return g_rng;
+}
+
+/* Size mix: mostly small objects, some buffers, a few large blocks */
+static size_t rng_size(void) {
+    uint32_t r = rng_next() % 100;
+    if (r < 80) {
+        return 8 + rng_next() % 504;
+    }
+    if (r < 95) {
+        return 512 + rng_next() % 3584;
+    }
+    return 4096 + rng_next() % 61440;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* ============== kheap traces ============== */
+
+static void heap_setup(void) {
+    void* arena = malloc(HEAP_SIZE);
+    if (!arena || kheap_init(arena, HEAP_SIZE) != 0) {
+        fprintf(stderr, "kheap_init failed\n");
+        exit(2);
+    }
+}
+
+static void heap_track_peak(bench_result_t* res) {
+    size_t used = kheap_get_state()->total_allocated;
+    if (used > res->peak) {
+        res->peak = used;
+    }
+}
+
+static double heap_fragmentation(void) {
+    size_t total = 0;
+    size_t largest = 0;
+    for (kheap_block_t* b = kheap_get_state()->free_list; b; b = b->next) {
+        total += b->size;
+        if (b->size > largest) {
+            largest = b->size;
+        }
+    }
+    return total ? 1.0 - (double)largest / (double)total : 0.0;
+}
+
+/* Random alloc/free/realloc over a fixed set of slots */
+static int trace_heap_random(bench_result_t* res) {
+    static void* slots[HEAP_SLOTS];
+    heap_setup();
+
+    uint64_t start = now_ns();
+    for (uint32_t op = 0; op < g_ops; op++) {
+        uint32_t i = rng_next() % HEAP_SLOTS;
+        if (!slots[i]) {
+            slots[i] = kmalloc(rng_size());
+            heap_track_peak(res);
+        } else if (rng_next() % 4 == 0) {
+            void* p = krealloc(slots[i], rng_size());
+            if (p) {
+                slots[i] = p;
+            }
+            heap_track_peak(res);
+        } else {
+            kfree(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+    res->ns = now_ns() - start;
+    res->ops = g_ops;
+    res->frag = heap_fragmentation();
+    return 0;
+}
+
+/* Allocate a batch, then free it newest-first or oldest-first */
+static int trace_heap_batch(bench_result_t* res, int lifo) {
+    static void* batch[BATCH_SIZE];
+    heap_setup();
+
+    uint32_t rounds = g_ops / (BATCH_SIZE * 2);
+    uint64_t start = now_ns();
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            batch[i] = kmalloc(rng_size());
+        }
+        heap_track_peak(res);
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            kfree(batch[lifo ? BATCH_SIZE - 1 - i : i]);
+        }
+    }
+    res->ns = now_ns() - start;
+    res->ops = (uint64_t)rounds * BATCH_SIZE * 2;
+    res->frag = heap_fragmentation();
+    return 0;
+}
+
+static int trace_heap_lifo(bench_result_t* res) {
+    return trace_heap_batch(res, 1);
+}
+
+static int trace_heap_fifo(bench_result_t* res) {
+    return trace_heap_batch(res, 0);
+}
+
+/* Producer/consumer: one CPU allocates a batch, another frees it, so
+ * blocks flow through the depot instead of staying in one CPU's cache */
+static int trace_heap_xcpu(bench_result_t* res) {
+    static void* batch[BATCH_SIZE];
+    heap_setup();
+
+    uint32_t rounds = g_ops / (BATCH_SIZE * 2);
+    uint64_t start = now_ns();
+    for (uint32_t r = 0; r < rounds; r++) {
+        g_bench_cpu = r % BENCH_CPUS;
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            batch[i] = kmalloc(8 + rng_next() % 504);
+        }
+        heap_track_peak(res);
+        g_bench_cpu = (r + 1) % BENCH_CPUS;
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            kfree(batch[i]);
+        }
+    }
+    res->ns = now_ns() - start;
+    res->ops = (uint64_t)rounds * BATCH_SIZE * 2;
+    res->frag = heap_fragmentation();
+    return 0;
+}
+
+/* Buffers that keep growing, like document and packet buffers */
+static int trace_heap_realloc(bench_result_t* res) {
+    static void* bufs[REALLOC_BUFS];
+    static size_t sizes[REALLOC_BUFS];
+    heap_setup();
+
+    uint64_t start = now_ns();
+    for (uint32_t op = 0; op < g_ops; op++) {
+        uint32_t i = rng_next() % REALLOC_BUFS;
+        if (sizes[i] > 65536) {
+            kfree(bufs[i]);
+            bufs[i] = NULL;
+            sizes[i] = 0;
+            continue;
+        }
+        size_t grow = sizes[i] + 16 + rng_next() % 1024;
+        void* p = krealloc(bufs[i], grow);
+        if (p) {
+            bufs[i] = p;
+            sizes[i] = grow;
+        }
+        heap_track_peak(res);
+    }
+    res->ns = now_ns() - start;
+    res->ops = g_ops;
+    res->frag = heap_fragmentation();
+    return 0;
+}
+
+/* Untimed: fill every block with a pattern, verify it on free/realloc
+ * and run kheap_check_integrity() periodically. Each op runs on a random
+ * CPU so blocks migrate between magazines. */
+static int trace_heap_fuzz(bench_result_t* res) {
+    static uint8_t* slots[HEAP_SLOTS];
+    static size_t sizes[HEAP_SLOTS];
+    heap_setup();
+
+    for (uint32_t op = 0; op < g_ops; op++) {
+        uint32_t i = rng_next() % HEAP_SLOTS;
+        uint8_t tag = (uint8_t)i;
+        g_bench_cpu = rng_next() % BENCH_CPUS;
+
+        if (slots[i]) {
+            for (size_t k = 0; k < sizes[i]; k++) {
+                if (slots[i][k] != tag) {
+                    fprintf(stderr, "fuzz: slot %u corrupted at op %u\n", i, op);
+                    return 1;
+                }
+            }
+        }
+
+        if (!slots[i] || rng_next() % 4 == 0) {
+            size_t size = rng_size();
+            uint8_t* p = slots[i] ? krealloc(slots[i], size) : kmalloc(size);
+            if (p) {
+                slots[i] = p;
+                sizes[i] = size;
+                memset(p, tag, size);
+            }
+            heap_track_peak(res);
+        } else {
+            kfree(slots[i]);
+            slots[i] = NULL;
+            sizes[i] = 0;
+        }
+
+        if (op % CHECK_INTERVAL == 0 && kheap_check_integrity() != 0) {
+            fprintf(stderr, "fuzz: integrity check failed at op %u\n", op);
+            return 1;
+        }
+    }
+    res->ops = g_ops;
+    res->frag = heap_fragmentation();
+    return kheap_check_integrity() != 0;
+}
+
+/* ============== PMM traces ============== */
+
+static void pmm_setup(void) {
+    static uint32_t bitmap[PMM_FRAMES / 32];
+    if (pmm_init(PMM_MEM_SIZE, bitmap) != 0) {
+        fprintf(stderr, "pmm_init failed\n");
+        exit(2);
+    }
+    pmm_mark_used(0);
+}
+
+static void pmm_track_peak(bench_result_t* res) {
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+    size_t used = (size_t)stats.used_frames * PMM_PAGE_SIZE;
+    if (used > res->peak) {
+        res->peak = used;
+    }
+}
+
+static double pmm_fragmentation(void) {
+    uint32_t total = 0;
+    uint32_t largest = 0;
+    uint32_t run = 0;
+    for (uint32_t f = 0; f < PMM_FRAMES; f++) {
+        if (pmm_is_frame_free(f)) {
+            total++;
+            run++;
+            if (run > largest) {
+                largest = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return total ? 1.0 - (double)largest / (double)total : 0.0;
+}
+
+/* Random single-frame alloc/free */
+static int trace_pmm_single(bench_result_t* res) {
+    static uint32_t slots[PMM_SLOTS];
+    pmm_setup();
+
+    uint64_t start = now_ns();
+    for (uint32_t op = 0; op < g_ops; op++) {
+        uint32_t i = rng_next() % PMM_SLOTS;
+        if (slots[i]) {
+            pmm_free_frame(slots[i]);
+            slots[i] = 0;
+        } else {
+            slots[i] = pmm_alloc_frame();
+            pmm_track_peak(res);
+        }
+    }
+    res->ns = now_ns() - start;
+    res->ops = g_ops;
+    res->frag = pmm_fragmentation();
+    return 0;
+}
+
+/* Every free frame must be on exactly one buddy list */
+static int pmm_buddy_consistent(void) {
+    pmm_stats_t stats;
+    pmm_buddy_stats_t buddy;
+    pmm_get_stats(&stats);
+    pmm_get_buddy_stats(&buddy);
+
+    uint32_t listed = 0;
+    for (uint32_t k = 0; k < PMM_BUDDY_ORDERS; k++) {
+        listed += buddy.free_blocks[k] << k;
+    }
+    if (listed != stats.free_frames) {
+        fprintf(stderr, "buddy: %u frames listed, %u free\n", listed, stats.free_frames);
+        return 0;
+    }
+    return 1;
+}
+
+/* Random contiguous runs of 1..64 frames */
+static int trace_pmm_runs(bench_result_t* res, int buddy) {
+    static uint32_t starts[PMM_SLOTS / 16];
+    static uint32_t counts[PMM_SLOTS / 16];
+    static pmm_buddy_frame_t meta[PMM_FRAMES];
+    pmm_setup();
+    if (buddy && pmm_buddy_init(meta) != 0) {
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    for (uint32_t op = 0; op < g_ops; op++) {
+        uint32_t i = rng_next() % (PMM_SLOTS / 16);
+        if (starts[i]) {
+            pmm_free_frames(starts[i], counts[i]);
+            starts[i] = 0;
+        } else {
+            counts[i] = 1 + rng_next() % 64;
+            starts[i] = pmm_alloc_frames(counts[i]);
+            pmm_track_peak(res);
+        }
+    }
+    res->ns = now_ns() - start;
+    res->ops = g_ops;
+    res->frag = pmm_fragmentation();
+    return buddy && !pmm_buddy_consistent();
+}
+
+static int trace_pmm_contig(bench_result_t* res) {
+    return trace_pmm_runs(res, 0);
+}
+
+static int trace_pmm_buddy(bench_result_t* res) {
+    return trace_pmm_runs(res, 1);
+}
+
+/* Single-frame alloc/free with 90% of memory already in use: low memory
+ * is full and the remaining free frames are scattered */
+static int trace_pmm_full(bench_result_t* res) {
+    static uint32_t live[PMM_SLOTS];
+    pmm_setup();
+
+    pmm_mark_range_used(0, PMM_FRAMES * 85 / 100);
+    for (uint32_t f = PMM_FRAMES * 85 / 100; f < PMM_FRAMES; f++) {
+        if (rng_next() % 5 == 0) {
+            pmm_mark_used(f);
+        }
+    }
+
+    /* Top up to exactly 90% with frames we can later free */
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+    uint32_t nlive = 0;
+    while (stats.used_frames < PMM_FRAMES * 9 / 10 && nlive < PMM_SLOTS) {
+        live[nlive++] = pmm_alloc_frame();
+        pmm_get_stats(&stats);
+    }
+    if (nlive == 0) {
+        return 1;
+    }
+
+    /* Steady state: free a random live frame, allocate a replacement */
+    uint64_t start = now_ns();
+    for (uint32_t op = 0; op < g_ops; op += 2) {
+        uint32_t i = rng_next() % nlive;
+        pmm_free_frame(live[i]);
+        live[i] = pmm_alloc_frame();
+        pmm_track_peak(res);
+    }
+    res->ns = now_ns() - start;
+    res->ops = g_ops;
+    res->frag = pmm_fragmentation();
+    return 0;
+}
+
+/* ============== Driver ============== */
+
+typedef struct {
+    const char* name;
+    int (*run)(bench_result_t* res);
+    int timed;
+} bench_trace_t;
+
+static const bench_trace_t g_traces[] = {
+    { "kheap/random",  trace_heap_random,  1 },
+    { "kheap/lifo",    trace_heap_lifo,    1 },
+    { "kheap/fifo",    trace_heap_fifo,    1 },
+    { "kheap/xcpu",    trace_heap_xcpu,    1 },
+    { "kheap/realloc", trace_heap_realloc, 1 },
+    { "kheap/fuzz",    trace_heap_fuzz,    0 },
+    { "pmm/single",    trace_pmm_single,   1 },
+    { "pmm/contig",    trace_pmm_contig,   1 },
+    { "pmm/buddy",     trace_pmm_buddy,    1 },
+    { "pmm/90pct",     trace_pmm_full,     1 },
+};
+
+/* Run one trace in a child so every trace starts from a fresh allocator */
+static int run_trace(const bench_trace_t* trace) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        bench_result_t res;
+        memset(&res, 0, sizeof(res));
+        g_rng = g_seed ? g_seed : 1;
+
+        int rc = trace->run(&res);
+        if (trace->timed) {
+            printf("%-14s %10llu %10.1f %10zu %8.3f\n", trace->name,
+                   (unsigned long long)res.ops,
+                   res.ops ? (double)res.ns / (double)res.ops : 0.0,
+                   res.peak / 1024, res.frag);
+        } else {
+            printf("%-14s %10llu %10s %10zu %8.3f  %s\n", trace->name,
+                   (unsigned long long)res.ops, "-", res.peak / 1024,
+                   res.frag, rc ? "FAILED" : "ok");
+        }
+        fflush(stdout);
+        _exit(rc);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: failed (seed %u)\n", trace->name, g_seed);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        g_seed = (uint32_t)strtoul(argv[1], NULL, 0);
+    }
+    if (argc > 2) {
+        g_ops = (uint32_t)strtoul(argv[2], NULL, 0);
+    }
+
+    printf("seed %u, %u ops per trace\n", g_seed, g_ops);
+    printf("%-14s %10s %10s %10s %8s\n", "trace", "ops", "ns/op", "peak KB", "frag");
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(g_traces) / sizeof(g_traces[0]); i++) {
+        failed |= run_trace(&g_traces[i]);
+    }
+    return failed;
+}
@@ -0,0 +1,85 @@
+/*
+ * Host shim for allocator benchmarks
+ *
+ * Provides the handful of kernel services kheap.c and pmm.c link
+ * against so they can be built and run as a normal Linux program.
+ * Locks spin without touching the interrupt flag (cli faults in user
+ * mode) and keep no statistics. smp_cpu_id() comes from the smp.h stub
+ * next to this file and returns g_bench_cpu.
+ * Set BENCH_VERBOSE=1 to see the allocators' debug output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "spinlock.h"
+
+uint32_t g_bench_cpu;
+
+static int verbose = -1;
+
+static int is_verbose(void) {
+    if (verbose < 0) {
+        verbose = getenv("BENCH_VERBOSE") != NULL;
+    }
+    return verbose;
+}
+
+void debug_print(const char* str) {
+    if (is_verbose()) {
+        fputs(str, stderr);
+    }
+}
+
+void debug_print_hex(uint32_t num) {
+    if (is_verbose()) {
+        fprintf(stderr, "%x", num);
+    }
+}
+
+void print(const char* str) {
+    debug_print(str);
+}
+
+void print_hex(uint32_t num) {
+    debug_print_hex(num);
+}
+
+void kernel_panic(const char* message) {
+    fprintf(stderr, "KERNEL PANIC: %s\n", message);
+    abort();
+}
+
+void spin_init(spinlock_t* lock, const char* name, lock_stats_t* stats) {
+    (void)name;
+    (void)stats;
+    lock->locked = 0;
+    lock->stats = NULL;
+}
+
+void spin_lock(spinlock_t* lock) {
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+    }
+}
+
+void spin_unlock(spinlock_t* lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    spin_lock(lock);
+    return 0;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    (void)flags;
+    spin_unlock(lock);
+}
+
+uint32_t local_irq_save(void) {
+    return 0;
+}
+
+void local_irq_restore(uint32_t flags) {
+    (void)flags;
+}
@@ -0,0 +1,22 @@
+#ifndef BENCH_SMP_H
+#define BENCH_SMP_H
+
+/*
+ * Host stand-in for include/smp.h
+ *
+ * Found before the kernel header (-iquote order), so kheap.c builds
+ * without the str instruction. The benchmark picks the "CPU" it runs on
+ * by setting g_bench_cpu, to replay cross-CPU alloc/free patterns.
+ */
+
+#include <stdint.h>
+
+#define SMP_MAX_CPUS 8
+
+extern uint32_t g_bench_cpu;
+
+static inline uint32_t smp_cpu_id(void) {
+    return g_bench_cpu;
+}
+
+#endif